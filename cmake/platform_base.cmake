@@ -7,16 +7,28 @@ function(set_source_files_base)
 
     set(
         ${BASE_SSS_RESULT}
+        src/blip/AdmissionController.cc
         src/blip/BLIPConnection.cc
+        src/blip/CompressionDictionary.cc
+        src/blip/CompressionTuner.cc
+        src/blip/ConnectionPool.cc
         src/blip/Message.cc
         src/blip/MessageBuilder.cc
+        src/blip/MessageBatch.cc
         src/blip/MessageOut.cc
+        src/blip/PropertyTable.cc
+        src/blip/RelayPipe.cc
+        src/blip/ResponseCache.cc
+        src/blip/Topic.cc
+        src/blip/TransferStore.cc
         src/util/Actor.cc
         src/util/ActorProperty.cc
         src/util/Async.cc
         src/util/Channel.cc
+        src/util/CRC32.cc
         src/util/Codec.cc
         src/util/Timer.cc
+        src/util/ZstdCodec.cc
         src/websocket/Headers.cc
         src/websocket/WebSocketImpl.cc
         src/websocket/WebSocketInterface.cc
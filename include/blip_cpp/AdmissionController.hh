@@ -0,0 +1,77 @@
+//
+// AdmissionController.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+namespace litecore { namespace blip {
+
+    /** Decides whether incoming requests should be shed because their handlers are overloaded.
+        It tracks the number of requests being handled (delivered to a handler but not yet
+        responded to) and the average time handlers take to respond. Each Connection has one,
+        configured by its options, and there's also a process-wide one.
+
+        When either is over its limits, new requests that aren't urgent are rejected with a
+        BLIP error 503 whose Retry-After property gives a number of seconds; their bodies are
+        discarded as they arrive instead of being stored. If the abort extension is enabled,
+        the error is sent as soon as a request's properties arrive, and the sender is told to
+        stop sending the rest; otherwise it's sent when the request is complete.
+        The methods are thread-safe. */
+    class AdmissionController {
+    public:
+        struct Limits {
+            unsigned maxHandling {0};                   // Max requests being handled; 0 = any
+            std::chrono::milliseconds maxDelay {0};     // Max average handling time; 0 = any
+            std::chrono::seconds retryAfter {1};        // Value of Retry-After property
+        };
+
+        void setLimits(const Limits &limits);
+        Limits limits() const;
+
+        /** True if new non-urgent requests should be rejected. */
+        bool overloaded() const;
+
+        /** Number of requests currently being handled. */
+        unsigned handling() const                       {return _handling;}
+
+        /** Number of requests that have been rejected. */
+        uint64_t shedCount() const                      {return _shed;}
+
+        /** The process-wide instance, shared by all Connections. */
+        static AdmissionController& processWide();
+
+    private:
+        friend class Connection;
+        friend class MessageIn;
+        friend class BLIPIO;
+
+        void started()                                  {++_handling;}
+        void finished(std::chrono::steady_clock::duration handlingTime);
+        void shed()                                     {++_shed;}
+
+        std::atomic<unsigned> _maxHandling {0};
+        std::atomic<int64_t> _maxDelayMicros {0};
+        std::atomic<int64_t> _retryAfterSecs {1};
+        std::atomic<unsigned> _handling {0};
+        std::atomic<int64_t> _avgDelayMicros {0};       // Moving average of handling time
+        std::atomic<uint64_t> _shed {0};
+    };
+
+} }
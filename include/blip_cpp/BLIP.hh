@@ -20,4 +20,12 @@
 
 #include "Message.hh"
 #include "MessageBuilder.hh"
+#include "MessageTemplate.hh"
+#include "MessageBatch.hh"
 #include "BLIPConnection.hh"
+#include "AdmissionController.hh"
+#include "CompressionDictionary.hh"
+#include "ConnectionPool.hh"
+#include "ResponseCache.hh"
+#include "Topic.hh"
+#include "TransferStore.hh"
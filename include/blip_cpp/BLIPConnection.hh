@@ -19,13 +19,22 @@
 #pragma once
 #include "WebSocketInterface.hh"
 #include "Message.hh"
+#include "TransferStore.hh"
+#include "AdmissionController.hh"
+#include "Async.hh"
 #include "Logging.hh"
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 namespace litecore { namespace blip {
     class BLIPIO;
     class ConnectionDelegate;
     class MessageOut;
+    class MessageBatch;
+    class ResponseCache;
 
 
     /** A BLIP connection. Use this object to open and close connections and send requests.
@@ -47,9 +56,77 @@ namespace litecore { namespace blip {
         /** WebSocket 'protocol' name for BLIP; use as value of kProtocolsOption option. */
         static constexpr const char *kWSProtocolName = "BLIP_3";
 
-        /** Option to set the 'deflate' compression level. Value must be an integer in the range
-            0 (no compression) to 9 (best compression). */
+        /** Optional protocol extensions. A client requests them by appending "+" and the name
+            of each extension to kWSProtocolName (see protocolName()); they're enabled only if
+            the subprotocol accepted by the server includes them. Unknown names are ignored. */
+        enum Extension : uint8_t {
+            kPropertyTableExtension = 0x01,     // "+PropTable": Compressed property strings
+            kBatchExtension         = 0x02,     // "+Batch": Batched requests (MessageBatch)
+            kAbortExtension         = 0x04,     // "+Abort": Aborting messages (MessageIn::abort)
+            kDictionaryExtension    = 0x08,     // "+Dict-<id>": Preset compression dictionary
+        };
+        using Extensions = uint8_t;
+
+        /** Returns a WebSocket subprotocol name requesting the given extensions. A client should
+            also offer the plain kWSProtocolName, for servers that don't support them.
+            With kDictionaryExtension, `dictionaryID` names the CompressionDictionary to use;
+            the default is the built-in one. `codec` names a compression codec to use instead
+            of deflate, e.g. "zstd" (see kDefaultCodec.) */
+        static std::string protocolName(Extensions,
+                                        fleece::slice dictionaryID =fleece::nullslice,
+                                        fleece::slice codec =fleece::nullslice);
+
+        /** Returns the extensions named in a WebSocket subprotocol name. */
+        static Extensions extensionsInProtocol(fleece::slice protocol);
+
+        /** Returns the ID of the CompressionDictionary named in a WebSocket subprotocol name,
+            or an empty string if none. (A server should accept the kDictionaryExtension only
+            if it has that dictionary; see CompressionDictionary::named.) */
+        static std::string dictionaryInProtocol(fleece::slice protocol);
+
+        /** The compression codec used unless another is negotiated. */
+        static constexpr const char *kDefaultCodec = "deflate";
+
+        /** Returns the compression codec named in a WebSocket subprotocol name, or kDefaultCodec
+            if none. Only codecs this build supports are recognized, e.g. "zstd" only if it was
+            built with BLIP_ZSTD. */
+        static std::string codecInProtocol(fleece::slice protocol);
+
+        /** Option giving the WebSocket subprotocol a server accepted, which determines the
+            extensions in use. A client-side Connection instead gets this from the
+            Sec-WebSocket-Protocol header of the HTTP response. */
+        static constexpr const char *kAcceptedProtocolOption = "BLIPAcceptedProtocol";
+
+        /** Option to set the compression level. Value must be an integer in the range
+            0 (no compression) to 9 (best compression), or kAutoCompressionLevel to adjust the
+            level while the connection runs, trading CPU time against link throughput. (These
+            are 'deflate' levels; other codecs map them to comparable levels of their own.) */
         static constexpr const char *kCompressionLevelOption = "BLIPCompressionLevel";
+        static constexpr const char *kAutoCompressionLevel = "auto";
+
+        /** Options to reduce the memory used by the compressor, at some cost in compression:
+            the base-2 log of its window size (9-15, default 15), and its memory level (1-9,
+            default 9). 'deflate' uses (1 << (windowBits+2)) + (1 << (memLevel+9)) bytes, i.e.
+            384KB by default; e.g. 12 and 5 use 32KB. These don't affect the decompressor,
+            since the peer's window size isn't known. Neither context is allocated until the
+            first compressed frame is sent or received. */
+        static constexpr const char *kCompressionWindowBitsOption = "BLIPCompressionWindowBits";
+        static constexpr const char *kCompressionMemLevelOption = "BLIPCompressionMemLevel";
+
+        /** Option giving the number of seconds without any traffic after which an idle
+            connection frees its buffers (they're reallocated when traffic resumes.) The default
+            is 60; 0 disables it. */
+        static constexpr const char *kHibernateAfterOption = "BLIPHibernateAfter";
+
+        /** Option to set the default time (in seconds) to wait for a response to a request.
+            See MessageBuilder::timeout. The default is to wait indefinitely. */
+        static constexpr const char *kRequestTimeoutOption = "BLIPRequestTimeout";
+
+        /** Options to shed load: if this many requests are being handled at once, or handlers
+            take longer than this many seconds (on average) to respond, new requests that aren't
+            urgent are rejected. See AdmissionController. */
+        static constexpr const char *kMaxHandlingRequestsOption = "BLIPMaxHandlingRequests";
+        static constexpr const char *kMaxHandlingDelayOption = "BLIPMaxHandlingDelay";
 
         /** Creates a BLIP connection on a WebSocket. */
         Connection(websocket::WebSocket*,
@@ -62,20 +139,90 @@ namespace litecore { namespace blip {
 
         ConnectionDelegate& delegate() const                    {return _delegate;}
 
+        /** The protocol extensions in use. Not known until the HTTP response arrives. */
+        Extensions extensions() const                           {return _extensions;}
+
+        /** The compression codec in use, e.g. "deflate". Not known until the HTTP response
+            arrives. */
+        const std::string& codec() const                       {return _codec;}
+
         void start();
 
         /** Tears down a Connection's state including any reference cycles.
             The Connection must have either already stopped, or never started. */
         void terminate();
 
-        /** Sends a built message as a new request. */
-        void sendRequest(MessageBuilder&);
+        /** Sends a built message as a new request. Returns an Async that resolves, exactly
+            once, to the response when it's complete. It resolves to nullptr if the request is
+            noreply (once it's sent), or if the connection closes, or the request times out or
+            is aborted, before a response arrives.
+            If the builder has no onProgress callback, no progress is reported until then. */
+        actor::Async<Retained<MessageIn>> sendRequest(MessageBuilder&);
+
+        /** Sends a batch of requests as a single message, and resets the batch.
+            If the kBatchExtension isn't in use, the requests are sent individually. */
+        void sendBatch(MessageBatch&);
+
+        /** Enables automatic batching of requests with the given profile: each request is held
+            for up to `maxDelay` so that others sent meanwhile can share its message, and the
+            batch is sent early once it reaches `maxBytes`. A zero `maxDelay` disables it.
+            Requests with a dataSource are never batched, nor are urgent ones, nor ones with
+            their own timeout, compression, progressGranularity or coalescing settings, since
+            those couldn't be applied to the batch. Requires the kBatchExtension. */
+        void setBatching(std::string profile,
+                         std::chrono::milliseconds maxDelay,
+                         size_t maxBytes =16384);
+
+        /** Sends a resumable request (see MessageBuilder::setTransferID) that was interrupted
+            by the closing of an earlier Connection. The builder must produce the same message
+            as before. The peer is first asked how much of the body it saved, and then only the
+            rest of the body is sent. Returns the response, as sendRequest does. */
+        actor::Async<Retained<MessageIn>> resumeRequest(MessageBuilder&);
+
+        /** Forwards an incoming request to another Connection, streaming its body as it
+            arrives instead of waiting for all of it; the response is streamed back the same
+            way, as the response to the request. Flow control is linked end to end: the request's
+            sender is throttled while the target connection falls behind, and vice versa.
+            This can be called from a request handler registered for the beginning of the request,
+            and should also be called from one for complete requests (since a request that fits
+            in a single frame has no beginning notification); the second call is ignored. */
+        void relayRequest(MessageIn *request, Connection *target);
+
+        /** Enables resuming incoming requests: the partial bodies of resumable requests that
+            are interrupted by the connection closing are saved in the store, and are used to
+            complete those requests when they're resumed. A store is normally shared by all
+            Connections. Must be called before start(). */
+        void setTransferStore(TransferStore *store)             {_transferStore = store;}
+
+        /** Sets the identity of the peer (such as its authenticated user name), which scopes
+            the transfers it can resume: a saved transfer can only be resumed by a connection
+            with the same peer identity. Must be called before start(). */
+        void setPeerIdentity(std::string peer)                  {_peerIdentity = std::move(peer);}
+
+        /** The connection's admission controller, which sheds incoming requests when its
+            handlers are overloaded. (AdmissionController::processWide() is also consulted.) */
+        AdmissionController& admissionController()              {return _admission;}
+
+        /** The current compression level; this changes over time if it's automatic. */
+        int compressionLevel() const                            {return _compressionLevel;}
+
+        /** Compression statistics of the messages sent so far, in total. */
+        CompressionStats compressionStats() const;
+
+        /** Compression statistics of the messages sent so far, for each profile. (Messages
+            without a profile, such as responses, are under the empty string.) */
+        std::unordered_map<std::string, CompressionStats> compressionStatsByProfile() const;
 
         typedef std::function<void(MessageIn*)> RequestHandler;
 
         /** Registers a callback that will be called when a message with a given profile arrives. */
         void setRequestHandler(std::string profile, bool atBeginning, RequestHandler);
 
+        /** Registers a handler for complete requests with a given profile, whose successful
+            responses are cached: a request identical to an earlier one is answered from the
+            cache without calling the handler. */
+        void setRequestHandler(std::string profile, RequestHandler, ResponseCache*);
+
         /** Closes the connection. */
         void close(websocket::CloseCode =websocket::kCodeNormal,
                    fleece::slice message =fleece::nullslice);
@@ -92,20 +239,49 @@ namespace litecore { namespace blip {
 
         friend class MessageIn;
         friend class BLIPIO;
+        friend class ConnectionPool;
+        friend class TopicShard;
 
         void send(MessageOut*);
+        void abort(MessageIn*);
+        void dispatchRequest(MessageIn*);
         void gotHTTPResponse(int status, const websocket::Headers &headers);
         void connected();
         void closed(CloseStatus);
+        void setProtocol(fleece::slice protocol);
 
     private:
+        struct CoalescedRequest;
+
+        bool overloaded() const;
+        void recordCompression(const std::string &profile, const CompressionStats&);
+        static Retained<MessageOut> relay(MessageIn*, Connection *target, FrameFlags, MessageNo,
+                                          MessageProgressCallback =nullptr);
+        static std::string coalescingKeyFor(MessageBuilder&);
+        bool coalesce(const std::string &key, MessageBuilder&,
+                      Retained<actor::AsyncProvider<Retained<MessageIn>>>);
+
         std::string _name;
         websocket::Role const _role;
         ConnectionDelegate &_delegate;
         Retained<BLIPIO> _io;
-        int8_t _compressionLevel;
+        std::atomic<int8_t> _compressionLevel;
+        bool _autoCompressionLevel {false};
+        int8_t _compressionWindowBits {0}, _compressionMemLevel {0};  // 0 means default
+        std::chrono::milliseconds _hibernateAfter;
+        std::chrono::milliseconds _requestTimeout {0};
+        Retained<TransferStore> _transferStore;
+        std::string _peerIdentity;
+        AdmissionController _admission;
+        std::atomic<Extensions> _extensions {0};
+        fleece::alloc_slice _compressionDictionary;     // Negotiated preset dictionary, if any
+        std::string _codec {kDefaultCodec};             // Negotiated compression codec
         std::atomic<State> _state {kClosed};
         CloseStatus _closeStatus;
+        std::mutex _coalesceMutex;
+        std::unordered_map<std::string, std::shared_ptr<CoalescedRequest>> _coalescedRequests;
+        mutable std::mutex _compressionStatsMutex;
+        std::unordered_map<std::string, CompressionStats> _compressionStats;
     };
 
 
@@ -29,6 +29,8 @@ namespace litecore { namespace blip {
         kErrorType       = 2,  // A response indicating failure
         kAckRequestType  = 4,  // Acknowledgement of data received from a Request (internal)
         kAckResponseType = 5,  // Acknowledgement of data received from a Response (internal)
+        kAbortRequestType  = 6, // Tells the sender of a Request to stop sending it (internal)
+        kAbortResponseType = 7, // Tells the sender of a Response to stop sending it (internal)
     };
 
     // Array mapping MessageType to a short mnemonic like "REQ".
@@ -49,4 +51,25 @@ namespace litecore { namespace blip {
 
     // Implementation-imposed max encoded size of message properties (not part of protocol)
     constexpr uint64_t kMaxPropertiesSize = 100 * 1024;
+
+    // Property identifying the encoding of a message body. A body without this property is
+    // JSON (if it's structured at all); a value of kFleeceBodyEncoding means binary Fleece.
+    constexpr const char* kBodyEncodingProperty = "Body-Encoding";
+    constexpr const char* kFleeceBodyEncoding = "fleece";
+
+    // Profile of a request whose body contains a batch of requests (see MessageBatch.)
+    constexpr const char* kBatchProfile = "BLIP_Batch";
+
+    // Profile of a request that's one part of a larger striped request (see ConnectionPool.)
+    constexpr const char* kStripeProfile = "BLIP_Stripe";
+
+    // Properties of a resumable request (see MessageBuilder::setTransferID): its transfer ID,
+    // and the number of body bytes omitted from its start because the recipient already has them.
+    constexpr const char* kTransferIDProperty = "Transfer-ID";
+    constexpr const char* kTransferOffsetProperty = "Transfer-Offset";
+
+    // Profile of a request asking how much of a resumable request's body the recipient has
+    // saved. Its Transfer-ID property identifies the request; the response's Transfer-Offset
+    // property gives the number of bytes (see Connection::resumeRequest.)
+    constexpr const char* kResumeProfile = "BLIP_Resume";
 } }
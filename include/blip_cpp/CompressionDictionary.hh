@@ -0,0 +1,46 @@
+//
+// CompressionDictionary.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include <string>
+
+namespace litecore { namespace blip {
+
+    /** Process-wide registry of preset 'deflate' dictionaries, identified by ID. A connection
+        using the Dict extension (Connection::kDictionaryExtension) primes both its compression
+        contexts with the negotiated dictionary, so its first messages compress as well as later
+        ones do. Both peers must have registered the same data under the same ID.
+
+        The built-in dictionary, kBuiltInID, contains common BLIP property names and the keys
+        of the Couchbase Mobile replication protocol. The methods are thread-safe. */
+    class CompressionDictionary {
+    public:
+        /** ID of the built-in dictionary. */
+        static constexpr const char *kBuiltInID = "blip1";
+
+        /** Registers a dictionary. Its ID may contain only letters, digits, '.' and '_', and
+            its data should be at most 32KB; the strings most likely to occur should be at its
+            end. A registered dictionary can't be changed; register a new ID instead. */
+        static void registerDictionary(const std::string &id, fleece::alloc_slice data);
+
+        /** Returns the dictionary with the given ID, or a null slice if there isn't one. */
+        static fleece::alloc_slice named(fleece::slice id);
+    };
+
+} }
@@ -0,0 +1,123 @@
+//
+// ConnectionPool.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "BLIPConnection.hh"
+#include "MessageBuilder.hh"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace litecore { namespace blip {
+
+    /** A group of Connections to the same peer, used together to get more throughput than a
+        single WebSocket (and single compressor and I/O actor) can provide.
+
+        Requests are routed by profile, if a route has been set, or else to the connection with
+        the fewest bytes in flight. A request whose payload is larger than the stripe size is
+        split into one ranged part per connection; the parts are sent concurrently, and the
+        peer's ConnectionPool reassembles them and delivers the original request to its handler.
+        Both peers must use a ConnectionPool for striping to work.
+
+        (Striping protocol: each part is a kStripeProfile request whose body is a range of the
+        original request's encoded payload, with properties Stripe-ID, Stripe-Index and
+        Stripe-Count. The part that completes the set carries the real response; the others
+        are answered as soon as they arrive, with a "Stripe-Received" property. Incomplete
+        sets are dropped after kReassemblyTimeout, or when the parts being held would exceed
+        the maxReassemblyBytes limit.) */
+    class ConnectionPool : public RefCounted {
+    public:
+        /** Creates a pool from Connections that were opened to the same peer. They may or may
+            not have been started yet. */
+        explicit ConnectionPool(const std::vector<Retained<Connection>>&);
+
+        size_t size() const                                 {return _connections.size();}
+        Connection* connection(size_t i) const              {return _connections[i].conn;}
+
+        /** Sends all requests with the given profile over connection #index. */
+        void setRoute(std::string profile, size_t index);
+
+        /** Requests whose payloads are larger than this are striped across the connections.
+            Zero disables striping. Requests with a dataSource are never striped. */
+        void setStripeSize(size_t size)                     {_stripeSize = size;}
+
+        /** The most bytes of incoming striped-request parts that will be held while waiting
+            for the rest of their sets. A part that would exceed it gets a 413 error. */
+        void setMaxReassemblyBytes(size_t size)             {_maxReassemblyBytes = size;}
+
+        /** How long the parts of an incomplete striped request are kept. */
+        static constexpr auto kReassemblyTimeout = std::chrono::seconds(60);
+
+        /** Sends a request over the pool. Returns the response, as Connection::sendRequest. */
+        actor::Async<Retained<MessageIn>> sendRequest(MessageBuilder&);
+
+        /** Registers a request handler on all of the connections. */
+        void setRequestHandler(std::string profile, bool atBeginning,
+                               Connection::RequestHandler);
+
+        /** Closes all of the connections. */
+        void close(websocket::CloseCode =websocket::kCodeNormal,
+                   fleece::slice message =fleece::nullslice);
+
+    protected:
+        virtual ~ConnectionPool();
+
+    private:
+        struct Member {
+            Retained<Connection> conn;
+            std::shared_ptr<std::atomic<int64_t>> bytesInFlight;
+        };
+
+        // Reassembly state of an incoming striped request
+        struct Reassembly {
+            std::vector<fleece::alloc_slice> parts;
+            size_t received {0};
+            size_t bytes {0};
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        // Lets the connections' stripe handlers reach the pool without retaining it (which
+        // would be a reference cycle); the destructor clears `pool`.
+        struct Backpointer {
+            std::mutex lock;
+            ConnectionPool* pool;
+        };
+
+        size_t chooseConnection(fleece::slice payload) const;
+        actor::Async<Retained<MessageIn>> sendStriped(MessageBuilder&, fleece::alloc_slice payload);
+        void receivedPart(MessageIn*);
+        void pruneReassemblies();
+
+        std::vector<Member> _connections;
+        std::map<std::string, size_t> _routes;
+        std::atomic<size_t> _stripeSize {1024 * 1024};
+        std::atomic<size_t> _maxReassemblyBytes {128 * 1024 * 1024};
+        std::string _stripeIDPrefix;            // Random; unique to this pool instance
+        std::atomic<uint64_t> _lastStripeID {0};
+        std::shared_ptr<Backpointer> _backpointer;
+        mutable std::mutex _mutex;              // Protects _routes, _reassemblies
+        std::unordered_map<std::string, Reassembly> _reassemblies;
+        size_t _reassemblyBytes {0};            // Total size of the parts in _reassemblies
+    };
+
+} }
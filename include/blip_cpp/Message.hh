@@ -20,6 +20,8 @@
 #include "BLIPProtocol.hh"
 #include "RefCounted.hh"
 #include "fleece/Fleece.hh"
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <ostream>
 #include <memory>
@@ -38,6 +40,10 @@ namespace litecore { namespace blip {
     class MessageIn;
     class InflaterWriter;
     class Codec;
+    class PropertyDecoder;
+    class BatchResponder;
+    class BodyBuffer;
+    class RelayPipe;
 
 
     /** Progress notification for an outgoing request. */
@@ -48,7 +54,9 @@ namespace litecore { namespace blip {
             kAwaitingReply,         // Message sent; waiting for a reply (unless noreply)
             kReceivingReply,        // Reply is being received
             kComplete,              // Delivery (and receipt, if not noreply) complete.
-            kDisconnected           // Socket disconnected before delivery or receipt completed
+            kDisconnected,          // Socket disconnected before delivery or receipt completed
+            kTimedOut,              // Reply didn't arrive in time (see MessageBuilder::timeout)
+            kAborted                // Request or reply was aborted (see MessageIn::abort)
         } state;
         MessageSize bytesSent;
         MessageSize bytesReceived;
@@ -58,6 +66,41 @@ namespace litecore { namespace blip {
     using MessageProgressCallback = std::function<void(const MessageProgress&)>;
 
 
+    /** Determines how often a message's progress callback is called while it's being sent or
+        received, i.e. with the kSending and kReceivingReply states. The other states are
+        always reported. */
+    struct ProgressGranularity {
+        enum Mode : uint8_t {
+            kEveryFrame,            // Notify on every frame (the default)
+            kCompletionOnly,        // Don't notify of kSending or kReceivingReply at all
+            kEveryNBytes,           // Notify once `interval` more bytes have been transferred
+            kEveryNMilliseconds,    // Notify at most once every `interval` milliseconds
+        };
+
+        Mode mode {kEveryFrame};
+        uint32_t interval {0};
+
+        ProgressGranularity() { }
+        ProgressGranularity(Mode m, uint32_t i =0)  :mode(m), interval(i) { }
+    };
+
+
+    /** Compression statistics of outgoing messages that have the compressed flag. Frames of
+        such messages are sent uncompressed when their data doesn't look compressible. */
+    struct CompressionStats {
+        uint64_t messages {0};          // Messages sent
+        uint64_t compressedFrames {0};  // Frames sent compressed
+        uint64_t rawFrames {0};         // Frames sent uncompressed, since it wouldn't pay
+        uint64_t inputBytes {0};        // Message data, before compression
+        uint64_t outputBytes {0};       // Message data as sent (excluding headers & checksums)
+
+        /** The ratio of output to input size; smaller is better. */
+        double ratio() const  {return inputBytes ? double(outputBytes) / inputBytes : 1.0;}
+
+        CompressionStats& operator+= (const CompressionStats&);
+    };
+
+
     struct Error {
         const fleece::slice domain;
         const int code {0};
@@ -98,6 +141,7 @@ namespace litecore { namespace blip {
 
     protected:
         friend class BLIPIO;
+        friend class ConnectionPool;
         
         Message(FrameFlags f, MessageNo n)
         :_flags(f), _number(n)
@@ -113,6 +157,9 @@ namespace litecore { namespace blip {
         bool hasFlag(FrameFlags f) const    {return (_flags & f) != 0;}
         bool isAck() const                  {return type() == kAckRequestType ||
                                                     type() == kAckResponseType;}
+        bool isAbort() const                {return type() == kAbortRequestType ||
+                                                    type() == kAbortResponseType;}
+        bool isControl() const              {return isAck() || isAbort();}
         virtual bool isIncoming() const     {return false;}
         MessageType type() const            {return (MessageType)(_flags & kTypeMask);}
         const char* typeName() const        {return kMessageTypeNames[type()];}
@@ -120,6 +167,7 @@ namespace litecore { namespace blip {
         void sendProgress(MessageProgress::State state,
                           MessageSize bytesSent, MessageSize bytesReceived,
                           MessageIn *reply);
+        bool progressDue(MessageProgress::State, MessageSize bytes);
         void disconnected();
 
         void dump(slice payload, slice body, std::ostream&);
@@ -131,6 +179,9 @@ namespace litecore { namespace blip {
         FrameFlags _flags;
         MessageNo _number;
         MessageProgressCallback _onProgress;
+        ProgressGranularity _progressGranularity;
+        MessageSize _lastProgressBytes {0};     // Byte count at last progress notification
+        std::chrono::steady_clock::time_point _lastProgressTime; // Time of last notification
     };
 
 
@@ -147,6 +198,9 @@ namespace litecore { namespace blip {
 
         void setProgressCallback(MessageProgressCallback callback);
 
+        /** Sets how often the progress callback is called as the message arrives. */
+        void setProgressGranularity(ProgressGranularity);
+
         /** Returns true if the message has been completely received including the body. */
         bool isComplete() const;
 
@@ -157,9 +211,23 @@ namespace litecore { namespace blip {
             body() will return only the data that's been read since this call. */
         alloc_slice extractBody();
 
-        /** Converts the body from JSON to Fleece and returns a pointer to the root object. */
+        /** Converts the body from JSON to Fleece and returns a pointer to the root object.
+            If the body is already binary Fleece (see hasFleeceBody), returns its root. */
         fleece::Value JSONBody();
 
+        /** True if the body is binary Fleece, as written by MessageBuilder::fleeceBody(). */
+        bool hasFleeceBody() const;
+
+        /** Returns the root of a binary Fleece body, without parsing or copying it, or nullptr
+            if the body isn't Fleece or is invalid. The Value points into the body, so it's
+            only valid as long as the body is (i.e. until extractBody is called.) */
+        fleece::Value fleeceBody();
+
+        /** Gives up on receiving an incomplete message: any more data that arrives is
+            discarded, and the progress callback (if any) is called with kAborted.
+            If the kAbortExtension is in use, the sender is also told to stop sending it. */
+        void abort();
+
         /** Sends a response. (The message must be complete.) */
         void respond(MessageBuilder&);
 
@@ -182,6 +250,13 @@ namespace litecore { namespace blip {
     protected:
         friend class MessageOut;
         friend class BLIPIO;
+        friend class FrameDecoder;
+        friend class MessageTemplateBase;
+        friend class MessageBatch;
+        friend class ConnectionPool;
+        friend class ResponseCache;
+        friend class RelayPipe;
+        friend class Connection;
 
         enum ReceiveState {
             kOther,
@@ -189,32 +264,70 @@ namespace litecore { namespace blip {
             kEnd
         };
 
+        /** A progress notification that receivedFrame() found to be due. It's delivered by the
+            connection's I/O thread, not the decoder thread that called receivedFrame. */
+        struct PendingProgress {
+            MessageProgressCallback callback;
+            MessageProgress progress {};
+
+            explicit operator bool() const      {return callback != nullptr;}
+            void deliver() const                {if (callback) callback(progress);}
+        };
+
         MessageIn(Connection*, FrameFlags, MessageNo,
                   MessageProgressCallback =nullptr,
                   MessageSize outgoingSize =0);
+        MessageIn(Connection*, FrameFlags, MessageNo,
+                  alloc_slice properties, alloc_slice body);     // complete message
+        static Retained<MessageIn> fromPayload(Connection*, FrameFlags, MessageNo,
+                                               slice payload);
         virtual ~MessageIn();
         virtual bool isIncoming() const     {return true;}
-        ReceiveState receivedFrame(Codec&, slice frame, FrameFlags);
+        ReceiveState receivedFrame(Codec&, slice frame, FrameFlags, PendingProgress&,
+                                   PropertyDecoder* =nullptr);
 
         std::string description();
 
     private:
         void readFrame(Codec&, int mode, slice &frame, bool finalFrame);
         void acknowledge(uint32_t frameSize);
+        void discard(MessageProgress::State);
+        void disconnected();
+        MessageProgressCallback takeProgressCallback();
+        void resumeTransfer();
+        void respondWithPayload(alloc_slice payload, FrameFlags);
+        void startedHandling();
+        void finishedHandling();
+        void startRelay(RelayPipe*);
+        void relayDrained();
+        void stopRelay();
+        alloc_slice extractPartialBody();
+        Retained<MessageIn> copy();
 
         Retained<Connection> _connection;       // The owning BLIP connection     
         mutable std::mutex _receiveMutex;
         MessageSize _rawBytesReceived {0};
-        std::unique_ptr<fleece::JSONEncoder> _in; // Accumulates body data (not JSON)
+        std::unique_ptr<BodyBuffer> _in;        // Accumulates body data
         uint32_t _propertiesSize {0};           // Length of properties in bytes
         slice _propertiesRemaining;             // Subrange of _properties still to be read
         uint32_t _unackedBytes {0};             // # bytes received that haven't been ACKed yet
         alloc_slice _properties;                // Just the (still encoded) properties
         alloc_slice _body;                      // Just the body
         alloc_slice _bodyAsFleece;              // Body re-encoded into Fleece [lazy]
+        fleece::Value _fleeceRoot;              // Root of validated Fleece body [lazy]
+        bool _fleeceValidated {false};          // Has _body been validated as Fleece?
         const MessageSize _outgoingSize {0};
+        Retained<BatchResponder> _batchResponder; // Collects response, if I came from a batch
+        size_t _batchIndex {0};                 // My index in _batchResponder
+        std::function<void(alloc_slice,FrameFlags)> _onRespond; // Observes response [ResponseCache]
+        Retained<RelayPipe> _relay;             // Body goes here instead of _in, if relaying
         bool _complete {false};
-        bool _responded {false};
+        // (These flags are set and tested on the decoder, I/O and handler threads:)
+        std::atomic<bool> _responded {false};
+        std::atomic<bool> _discarding {false};  // Timed out/aborted; ignore any more body data
+        std::atomic<bool> _resumeFailed {false}; // Saved start of resumed body is unavailable
+        std::atomic<bool> _shed {false};        // Rejected by AdmissionController
+        std::chrono::steady_clock::time_point _handlingStarted; // When given to handler
     };
 
 } }
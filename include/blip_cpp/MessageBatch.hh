@@ -0,0 +1,128 @@
+//
+// MessageBatch.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "MessageBuilder.hh"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace litecore { namespace actor {
+    class Timer;
+} }
+
+namespace litecore { namespace blip {
+
+    /** Accumulates small requests to be sent together as a single BLIP message, saving the
+        per-message overhead of framing, checksums and compression flushes.
+        Send it with Connection::sendBatch(). The peer unpacks the batch and delivers each request
+        individually, then returns all their responses together in a single response.
+        Batches require the kBatchExtension; without it the requests are sent individually.
+
+        (Batch format: the body of a kBatchProfile request is a series of items, each consisting
+        of the request's flags and payload size as varints, then the payload as produced by
+        MessageBuilder. The response body has the same format, with one item per request that
+        wants a reply.) */
+    class MessageBatch {
+    public:
+        MessageBatch() =default;
+
+        /** Adds a request to the batch. The builder's onProgress callback, if any, is called
+            with kComplete when the request is sent (if it's noreply) or when its response
+            arrives. Requests with a dataSource can't be batched. The batch is sent as one
+            message, so the builder's timeout, compression and progressGranularity settings
+            don't apply to it individually; and if any request is urgent the whole batch is,
+            so the peer sees every request in it as urgent. */
+        MessageBatch& add(MessageBuilder&);
+
+        /** The number of requests in the batch. */
+        size_t count() const                        {return _items.size();}
+
+        /** The total encoded size of the requests in the batch. */
+        size_t size() const                         {return _size;}
+
+        bool empty() const                          {return _items.empty();}
+
+        /** Removes all requests from the batch. */
+        void reset()                                {_items.clear(); _size = 0;}
+
+    protected:
+        friend class Connection;
+        friend class BLIPIO;
+
+        struct Item {
+            fleece::alloc_slice payload;
+            FrameFlags flags;
+            MessageProgressCallback onProgress;
+        };
+
+        void add(fleece::alloc_slice payload, FrameFlags, MessageProgressCallback);
+        void build(MessageBuilder&);
+        const std::vector<Item>& items() const      {return _items;}
+
+        /** Unpacks a received batch request into its individual requests. If the batch
+            wants a reply, sets `responder` to the BatchResponder that will send it. */
+        static std::vector<Retained<MessageIn>> unpack(MessageIn *batch,
+                                                       Retained<BatchResponder> &responder);
+
+    private:
+        struct Sent;
+        static void sentProgress(Sent&, const MessageProgress&);
+        static Retained<MessageIn> newMessage(MessageIn *batch, FrameFlags, fleece::slice payload);
+
+        std::vector<Item> _items;
+        size_t _size {0};
+    };
+
+
+    /** Collects the responses to the requests unpacked from a batch, and sends them back as
+        the batch's response once they've all arrived. (Internal class.)
+        A request that's freed without being responded to gets an error response, and if
+        any are still unanswered after kTimeout, the batch's response is sent anyway, with
+        errors in their place; so one stuck handler can't hold up the others' responses.
+        The timer is cancelled once the response is sent, and holds no reference, so the
+        responder is freed as soon as its requests are. */
+    class BatchResponder : public RefCounted {
+    public:
+        static constexpr std::chrono::seconds kTimeout {60};
+
+        BatchResponder(MessageIn *batch, size_t count);
+        void respond(size_t index, MessageBuilder&);
+        void respond(size_t index, MessageType, fleece::alloc_slice payload);
+        void respondWithError(size_t index, Error);
+
+        /** Sends the batch's response now, if it hasn't been sent, with an error in place of
+            each response that hasn't arrived. */
+        void expire();
+
+    protected:
+        virtual ~BatchResponder();
+
+    private:
+        void sendResponse();
+
+        std::mutex _mutex;
+        Retained<MessageIn> _batch;
+        std::vector<std::pair<MessageType, fleece::alloc_slice>> _responses;
+        size_t _remaining;
+        std::unique_ptr<actor::Timer> _timer;   // Calls expire() after kTimeout [last member,
+                                                //  so it's destroyed (and stopped) first]
+    };
+
+} }
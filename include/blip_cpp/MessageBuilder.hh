@@ -18,7 +18,9 @@
 
 #pragma once
 #include "Message.hh"
-#include <sstream>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace litecore { namespace blip {
 
@@ -45,6 +47,8 @@ namespace litecore { namespace blip {
         /** Constructs a MessageBuilder for a response. */
         MessageBuilder(MessageIn *inReplyTo);
 
+        ~MessageBuilder();
+
         /** Adds a property. */
         MessageBuilder& addProperty(slice name, slice value);
 
@@ -62,50 +66,119 @@ namespace litecore { namespace blip {
         };
         propertySetter operator[] (slice name)        { return {*this, name}; }
 
+        /** Makes a request resumable, by giving it a transfer ID that's unique and unguessable,
+            and at least TransferStore::kMinTransferIDLength bytes long (a random UUID is a good
+            choice.) If the connection closes while the request is being sent,
+            a recipient with a TransferStore keeps the part of the body it received; the
+            request can then be rebuilt and sent with Connection::resumeRequest on a new
+            Connection, which sends only the rest of the body. */
+        MessageBuilder& setTransferID(slice id)  {return addProperty(slice(kTransferIDProperty), id);}
+
         /** Makes a response an error. */
         void makeError(Error);
 
         /** JSON encoder that can be used to write JSON to the body. */
-        fleece::JSONEncoder& jsonBody()          {finishProperties(); return _out;}
+        fleece::JSONEncoder& jsonBody();
+
+        /** Fleece encoder that can be used to write binary Fleece to the body, instead of JSON.
+            This adds a kBodyEncodingProperty property, so it must be called before writing
+            the body; nothing else can be written to the body afterwards.
+            Only use this with peers known to support it; others will expect JSON. */
+        fleece::Encoder& fleeceBody();
 
         /** Adds data to the body of the message. No more properties can be added afterwards. */
         MessageBuilder& write(slice s);
         MessageBuilder& operator<< (slice s)        {return write(s);}
 
-        /** Clears the MessageBuilder so it can be used to create another message. */
+        /** Clears the MessageBuilder so it can be used to create another message.
+            The buffer space already allocated is kept, so reusing a builder doesn't allocate. */
         void reset();
 
         /** Callback to provide the body of the message; will be called whenever data is needed. */
         MessageDataSource dataSource;
 
-        /** Callback to be invoked as the message is delivered (and replied to, if appropriate) */
+        /** Callback to be invoked as the message is delivered (and replied to, if appropriate).
+            Optional for requests, since Connection::sendRequest() returns the response.
+            It's normally called on the connection's I/O thread, so it shouldn't block. */
         MessageProgressCallback onProgress;
 
+        /** How often onProgress is called while the message and its reply are in transit.
+            With large messages, notifying on every frame can be costly. */
+        ProgressGranularity progressGranularity;
+
+        /** How long to wait for a reply, starting when the request has been sent. If it
+            expires, onProgress is called with kTimedOut and the reply is discarded. Zero means
+            the connection's kRequestTimeoutOption; a negative value means no timeout. */
+        std::chrono::milliseconds timeout {0};
+
+        /** Requests with the same non-empty coalescing key that are sent over a Connection
+            while one of them is awaiting its response are coalesced: only the first is sent,
+            and all of them complete with its response (each with its own MessageIn, so each
+            caller may extract the body.) The others' onProgress callbacks also get the first
+            one's progress notifications, without the incomplete reply. Only requests with the
+            same flags, timeout and progressGranularity coalesce. The caller is responsible
+            for giving the same key only to requests that are interchangeable.
+            Ignored for noreply requests and ones with a dataSource. */
+        std::string coalescingKey;
+
+        /** If true, and there's no coalescingKey, the request's entire encoded properties and
+            body are used as its coalescing key, so only exactly identical requests coalesce. */
+        bool coalesceIdentical {false};
+
         /** Is the message urgent (will be sent more quickly)? */
         bool urgent         {false};
 
         /** Should the message's body be gzipped? */
         bool compressed     {false};
 
+        /** The compression level (1-9) of the message's frames, if it's compressed, instead of
+            the connection's level. -1 means the connection's level; 0 means no compression.
+            E.g. small urgent messages can use a fast level, and bulk data a high one. */
+        int8_t compressionLevel {-1};
+
+        /** Hints at what kind of data the message contains, to tune compression. */
+        enum CompressionStrategy : uint8_t {
+            kDefaultStrategy,   // Unknown; use deflate's default string matching
+            kTextJSON,          // JSON or other text, which compresses well: skip checking
+                                //  whether each frame is compressible (see CompressionStats)
+            kFiltered,          // Numeric data with small values, e.g. filtered samples
+            kRLE,               // Runs of repeated bytes, e.g. simple images; fast
+            kHuffmanOnly,       // No repeated strings, but skewed byte frequencies; fastest
+        };
+        CompressionStrategy compressionStrategy {kDefaultStrategy};
+
         /** Should the message refuse replies? */
         bool noreply        {false};
 
     protected:
         friend class MessageIn;
         friend class MessageOut;
+        friend class MessageTemplateBase;
+        friend class MessageBatch;
+        friend class BatchResponder;
+        friend class ConnectionPool;
+        friend class Connection;
+        friend class Topic;
 
         FrameFlags flags() const;
         alloc_slice finish();
-        void writeTokenizedString(std::ostream &out, slice str);
+        void writeTokenizedString(slice str);
 
         MessageType type {kRequestType};
 
     private:
         void finishProperties();
-
-        fleece::JSONEncoder _out;    // Actually using it for the entire msg, not just JSON
-        std::stringstream _properties;  // Accumulates encoded properties
-        bool _wroteProperties {false};  // Have _properties been written to _out yet?
+        void flushJSON();
+        void append(slice);
+
+        // The entire encoded message is accumulated in _arena. It begins with headroom for the
+        // properties-length varint, which is filled in by finishProperties(); the encoded
+        // message then starts at _start.
+        std::vector<uint8_t> _arena;            // Properties and body [from per-thread pool]
+        size_t _start {0};                      // Offset in _arena where message begins
+        std::unique_ptr<fleece::JSONEncoder> _jsonOut; // Encoder for jsonBody() [lazy]
+        std::unique_ptr<fleece::Encoder> _fleeceOut;   // Encoder for fleeceBody() [lazy]
+        bool _wroteProperties {false};          // Has properties-length been written?
     };
 
 } }
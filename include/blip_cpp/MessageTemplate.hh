@@ -0,0 +1,89 @@
+//
+// MessageTemplate.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "MessageBuilder.hh"
+#include <array>
+#include <string>
+
+namespace litecore { namespace blip {
+
+    /** Non-template implementation of MessageTemplate. */
+    class MessageTemplateBase {
+    public:
+        using slice = fleece::slice;
+
+        MessageTemplateBase(const MessageTemplateBase&) =delete;
+
+    protected:
+        MessageTemplateBase(slice profile, const slice names[], size_t count);
+
+        void build(MessageBuilder&, const slice values[]) const;
+        void read(const MessageIn*, slice values[]) const;
+
+    private:
+        bool readSlots(slice properties, slice values[]) const;
+
+        std::string _encoded;                   // Encoded properties, minus the values
+        std::vector<size_t> _segmentEnds;       // End of each segment preceding a value
+        std::vector<slice> _names;              // Property names, pointing into _encoded
+    };
+
+
+    /** A precomputed encoding of the properties of a message whose profile and property names
+        are fixed, with slots for the property values. Building a message from a template is
+        a series of copies of the precomputed segments and the values; reading the values back
+        out of a message built from the template just checks each segment in place and finds
+        the end of each value, without comparing property names.
+        Templates are immutable and thread-safe; declare them as static constants:
+
+            static const MessageTemplate<2> kRevTemplate("rev", {"id"_sl, "rev"_sl});
+
+            MessageBuilder msg;
+            kRevTemplate.build(msg, {docID, revID});
+
+            auto [docID, revID] = kRevTemplate.read(request);
+        */
+    template <size_t N>
+    class MessageTemplate : public MessageTemplateBase {
+    public:
+        using Values = std::array<slice, N>;
+
+        /** Creates a template. The profile may be null, for responses. */
+        MessageTemplate(slice profile, const Values &names)
+        :MessageTemplateBase(profile, names.data(), N)
+        { }
+
+        /** Adds the template's profile and properties, with the given values, to a
+            MessageBuilder (which should have been constructed without a profile.)
+            Other properties may be added before or after, but not once the body's begun. */
+        void build(MessageBuilder &builder, const Values &values) const {
+            MessageTemplateBase::build(builder, values.data());
+        }
+
+        /** Returns the values of the template's properties in a received message. If it wasn't
+            built from this template, the properties are looked up by name instead.
+            Missing properties are returned as nullslice. */
+        Values read(const MessageIn *msg) const {
+            Values values;
+            MessageTemplateBase::read(msg, values.data());
+            return values;
+        }
+    };
+
+} }
@@ -0,0 +1,103 @@
+//
+// ResponseCache.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "BLIPConnection.hh"
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace litecore { namespace blip {
+
+    /** Caches the responses to idempotent requests, so that a request whose properties and body
+        are identical to an earlier one gets the same response without its handler being
+        called. Attach a cache to a profile's handler with Connection::setRequestHandler.
+        A cache may be shared by many Connections; its methods are thread-safe.
+
+        Only successful responses are cached, and only those of requests that aren't noreply.
+        A handler's response must not have a dataSource. */
+    class ResponseCache : public RefCounted {
+    public:
+        struct Stats {
+            uint64_t hits;          // Requests answered from the cache
+            uint64_t misses;        // Requests passed to the handler
+            uint64_t evictions;     // Entries removed because they expired or didn't fit
+            size_t   count;         // Current number of entries
+            size_t   bytes;         // Current total size of the cached requests & responses
+        };
+
+        /** Creates a cache whose entries expire after `ttl`, and whose total size of cached
+            requests and responses is at most `maxBytes`. */
+        explicit ResponseCache(std::chrono::milliseconds ttl,
+                               size_t maxBytes =4 * 1024 * 1024);
+
+        /** Returns a request handler that answers requests from the cache when it can, and
+            otherwise calls `handler` and caches the response it sends. */
+        Connection::RequestHandler cachingHandler(Connection::RequestHandler handler);
+
+        Stats stats() const;
+
+        /** Removes all entries. */
+        void clear();
+
+    protected:
+        virtual ~ResponseCache() =default;
+
+        // A 128-bit hash of a request's properties and body. (It only locates an entry; the hash
+        // isn't keyed, so a peer could craft a colliding request, and the request itself is
+        // compared before a cached response is used.)
+        struct Key {
+            uint64_t h1, h2;
+            bool operator== (const Key &k) const        {return h1 == k.h1 && h2 == k.h2;}
+        };
+
+        /** Computes a request's Key. Virtual only so tests can force collisions. */
+        virtual Key keyFor(MessageIn*) const;
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct KeyHash {
+            size_t operator() (const Key &k) const      {return (size_t)k.h1;}
+        };
+
+        struct Entry {
+            fleece::alloc_slice properties, body;   // The request
+            fleece::alloc_slice payload;            // Encoded response
+            FrameFlags flags;
+            clock::time_point expires;
+            std::list<Key>::iterator lru;           // Position in _lru
+        };
+
+        bool respondFromCache(const Key&, MessageIn*);
+        void store(const Key&, fleece::alloc_slice properties, fleece::alloc_slice body,
+                   fleece::alloc_slice payload, FrameFlags);
+        static size_t sizeOf(const Entry&);
+        void remove(std::unordered_map<Key, Entry, KeyHash>::iterator);
+
+        std::chrono::milliseconds const _ttl;
+        size_t const _maxBytes;
+        mutable std::mutex _mutex;
+        std::unordered_map<Key, Entry, KeyHash> _entries;
+        std::list<Key> _lru;                        // Least recently used key is first
+        size_t _bytes {0};
+        uint64_t _hits {0}, _misses {0}, _evictions {0};
+    };
+
+} }
@@ -0,0 +1,90 @@
+//
+// Topic.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "BLIPConnection.hh"
+#include "MessageBuilder.hh"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace litecore { namespace blip {
+    class TopicShard;
+
+    /** Publishes messages to many subscribed Connections at once. A published message is
+        encoded only once, and every subscriber's copy shares its payload. The subscribers are
+        divided into shards, each run by an Actor, so the fan-out is spread across the
+        Scheduler's threads.
+
+        Each subscriber may have only a limited number of published messages in its outbox
+        at once. When a subscriber is that far behind, new messages are either skipped or
+        coalesced, i.e. only the latest one is kept and sent when the backlog drains. */
+    class Topic : public RefCounted {
+    public:
+        enum SlowSubscriberPolicy {
+            kSkipMessages,          // Slow subscribers miss messages
+            kCoalesceMessages,      // Slow subscribers get only the latest message
+        };
+
+        struct Stats {
+            uint64_t published;     // Messages published to the topic
+            uint64_t sent;          // Copies queued for sending to subscribers
+            uint64_t skipped;       // Copies not sent because the subscriber was too slow
+            uint64_t coalesced;     // Copies replaced by a later message
+        };
+
+        explicit Topic(std::string name,
+                       unsigned maxPendingPerSubscriber =16,
+                       SlowSubscriberPolicy =kCoalesceMessages);
+
+        const std::string& name() const                     {return _name;}
+
+        /** Adds a Connection as a subscriber. Closed connections are unsubscribed automatically. */
+        void subscribe(Connection*);
+
+        void unsubscribe(Connection*);
+
+        size_t subscriberCount() const;
+
+        /** Sends a message to all subscribers, as a noreply request, and resets the builder.
+            (A dataSource is not allowed.) Returns immediately; the message is delivered
+            asynchronously, in the order published. */
+        void publish(MessageBuilder&);
+
+        Stats stats() const;
+
+    protected:
+        virtual ~Topic();
+
+    private:
+        friend class TopicShard;
+
+        // Statistics, shared with the shards (which may outlive the Topic briefly)
+        struct Counters {
+            std::atomic<uint64_t> published {0}, sent {0}, skipped {0}, coalesced {0};
+        };
+
+        TopicShard* shardFor(Connection*) const;
+
+        std::string const _name;
+        std::shared_ptr<Counters> _counters;
+        std::vector<Retained<TopicShard>> _shards;
+    };
+
+} }
@@ -0,0 +1,87 @@
+//
+// TransferStore.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "RefCounted.hh"
+#include "fleece/slice.hh"
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace litecore { namespace blip {
+
+    /** Holds the partial bodies of resumable requests whose connection closed before they were
+        completely received, so that the sender can resume them on a new Connection.
+        (See MessageBuilder::setTransferID and Connection::resumeRequest.)
+
+        Saved transfers are scoped to the identity of the peer that sent them (see
+        Connection::setPeerIdentity), so one peer can't resume or probe another's transfer.
+        Transfer IDs must also be unguessable: IDs shorter than kMinTransferIDLength are ignored,
+        so their transfers are never saved.
+
+        This implementation keeps them in memory, for a limited time and up to a limited total
+        size. Subclasses can override its methods to spill them to disk or to some other sink.
+        The methods are thread-safe, since a store may be shared by many Connections. */
+    class TransferStore : public fleece::RefCounted {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /** The minimum length of a transfer ID. (A UUID string is 36 characters.) */
+        static constexpr size_t kMinTransferIDLength = 16;
+
+        static bool isValidTransferID(const std::string &transferID) {
+            return transferID.size() >= kMinTransferIDLength;
+        }
+
+        TransferStore(clock::duration gracePeriod =std::chrono::minutes(10),
+                      size_t maxBytes =256 * 1024 * 1024);
+
+        /** Saves the partial body of the transfer with the given ID, sent by the given peer. */
+        virtual void save(const std::string &peer, const std::string &transferID,
+                          fleece::alloc_slice body);
+
+        /** Returns the size of the saved partial body of a transfer from the given peer,
+            or 0 if there is none. */
+        virtual uint64_t savedSize(const std::string &peer, const std::string &transferID);
+
+        /** Removes and returns the saved partial body of a transfer from the given peer. */
+        virtual fleece::alloc_slice take(const std::string &peer, const std::string &transferID);
+
+    protected:
+        virtual ~TransferStore() =default;
+
+    private:
+        struct Entry {
+            fleece::alloc_slice body;
+            clock::time_point expires;
+        };
+
+        using Key = std::pair<std::string, std::string>;    // (peer, transfer ID)
+
+        void purge();
+
+        std::mutex _mutex;
+        std::map<Key, Entry> _entries;
+        clock::duration const _gracePeriod;
+        size_t const _maxBytes;
+        size_t _totalBytes {0};
+    };
+
+} }
@@ -0,0 +1,72 @@
+//
+// AdmissionController.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "AdmissionController.hh"
+
+using namespace std;
+
+namespace litecore { namespace blip {
+
+    // Weight of each new sample in the moving average of handling time, as a shift (1/8)
+    static constexpr int kAverageShift = 3;
+
+
+    void AdmissionController::setLimits(const Limits &limits) {
+        _maxHandling = limits.maxHandling;
+        _maxDelayMicros = chrono::duration_cast<chrono::microseconds>(limits.maxDelay).count();
+        _retryAfterSecs = limits.retryAfter.count();
+    }
+
+
+    AdmissionController::Limits AdmissionController::limits() const {
+        Limits limits;
+        limits.maxHandling = _maxHandling;
+        limits.maxDelay = chrono::duration_cast<chrono::milliseconds>(
+                                                    chrono::microseconds(_maxDelayMicros));
+        limits.retryAfter = chrono::seconds(_retryAfterSecs);
+        return limits;
+    }
+
+
+    bool AdmissionController::overloaded() const {
+        unsigned handling = _handling;
+        if (handling == 0)
+            return false;   // (Otherwise a high average could never come down again)
+        unsigned maxHandling = _maxHandling;
+        if (maxHandling > 0 && handling >= maxHandling)
+            return true;
+        int64_t maxDelay = _maxDelayMicros;
+        return maxDelay > 0 && _avgDelayMicros > maxDelay;
+    }
+
+
+    void AdmissionController::finished(chrono::steady_clock::duration handlingTime) {
+        --_handling;
+        int64_t sample = chrono::duration_cast<chrono::microseconds>(handlingTime).count();
+        int64_t avg = _avgDelayMicros;
+        // (Races between threads may drop a sample, which is harmless.)
+        _avgDelayMicros = avg + ((sample - avg) >> kAverageShift);
+    }
+
+
+    AdmissionController& AdmissionController::processWide() {
+        static AdmissionController sInstance;
+        return sInstance;
+    }
+
+} }
@@ -18,11 +18,18 @@
 
 #include "BLIPConnection.hh"
 #include "MessageOut.hh"
+#include "MessageBatch.hh"
 #include "BLIPInternal.hh"
+#include "PropertyTable.hh"
+#include "ResponseCache.hh"
 #include "WebSocketInterface.hh"
+#include "Headers.hh"
 #include "Actor.hh"
 #include "Batcher.hh"
+#include "Timer.hh"
 #include "Codec.hh"
+#include "CompressionDictionary.hh"
+#include "CompressionTuner.hh"
 #include "Error.hh"
 #include "Logging.hh"
 #include "StringUtil.hh"
@@ -31,8 +38,11 @@
 #include <algorithm>
 #include <assert.h>
 #include <atomic>
+#include <deque>
 #include <mutex>
 #include <map>
+#include <set>
+#include <sstream>
 #include <unordered_map>
 #include <vector>
 
@@ -46,10 +56,29 @@ namespace litecore { namespace blip {
     static const size_t kDefaultFrameSize = 4096;       // Default size of frame
     static const size_t kBigFrameSize = 16384;          // Max size of frame
 
-    static const auto kDefaultCompressionLevel = (Deflater::CompressionLevel)6;
+    // Max number of frames the FrameEncoder may have been given and not yet sent:
+    static const unsigned kMaxFramesInFlight = 4;
+
+    static const auto kDefaultCompressionLevel = (Codec::CompressionLevel)6;
+
+    static constexpr auto kDefaultHibernateAfter = chrono::seconds(60);
+
+    // Max number of timed-out or aborted messages whose late frames are recognized & ignored
+    static const size_t kMaxDiscardedMessages = 256;
+
+    // How long after its last frame an aborted message is forgotten. Once the peer gets the
+    // ABORT it stops sending, so this only has to cover frames that were already in transit.
+    static constexpr auto kAbortedMessageLifetime = chrono::seconds(60);
 
     const char* const kMessageTypeNames[8] = {"REQ", "RES", "ERR", "?3?",
-                                              "ACKREQ", "AKRES", "?6?", "?7?"};
+                                              "ACKREQ", "AKRES", "ABREQ", "ABRES"};
+
+    static const struct {Connection::Extension extension; const char *name;} kExtensionNames[] = {
+        {Connection::kPropertyTableExtension, "PropTable"},
+        {Connection::kBatchExtension,         "Batch"},
+        {Connection::kAbortExtension,         "Abort"},
+        {Connection::kDictionaryExtension,    "Dict"},
+    };
 
     LogDomain BLIPLog("BLIP", LogLevel::Warning);
     static LogDomain BLIPMessagesLog("BLIPMessages", LogLevel::None);
@@ -65,7 +94,8 @@ namespace litecore { namespace blip {
 
         MessageOut* findMessage(MessageNo msgNo, bool isResponse) const {
             auto i = find_if(begin(), end(), [&](const Retained<MessageOut> &msg) {
-                return msg->number() == msgNo && msg->isResponse() == isResponse;
+                return msg->number() == msgNo && msg->isResponse() == isResponse
+                                              && !msg->isControl();
             });
             return (i != end()) ? *i : nullptr;
         }
@@ -88,6 +118,202 @@ namespace litecore { namespace blip {
     };
 
 
+#pragma mark - FRAME CODECS:
+
+
+    /** What a FrameEncoder reports about a frame it's sent. */
+    struct SentFrame {
+        FrameFlags flags;
+        size_t size;                                // Frame size, including the header
+        uint32_t prevBytesSent, bytesSent;          // Message's _bytesSent before & after
+        uint32_t prevUncompressedBytesSent, uncompressedBytesSent; // ...and _uncompressedBytesSent
+        CompressionTuner::clock::duration time;     // Time taken to encode the frame
+        bool writeable;                             // Result of WebSocket::send
+        bool last;                                  // Last frame the encoder will send, for now
+    };
+
+
+    /** Actor that encodes a connection's outgoing frames and writes them to the WebSocket.
+        It owns the output codec, so compressing a frame doesn't hold up BLIPIO, which goes on
+        handling ACKs and incoming requests meanwhile. BLIPIO gives it a message and the number
+        of frames of it to send; it may give it several messages before hearing back, but each
+        only once at a time, since what happens to a message next depends on how its last frame
+        went. Frames go out in the order they're given. */
+    class FrameEncoder : public actor::Actor {
+    public:
+        using Callback = function<void(Retained<MessageOut>, SentFrame)>;
+        using ErrorCallback = function<void(error)>;
+
+        FrameEncoder(const string &name, WebSocket *webSocket, unique_ptr<Codec> codec,
+                     unique_ptr<PropertyEncoder> propertyEncoder,
+                     Callback onSent, ErrorCallback onFailed)
+        :Actor(name)
+        ,_webSocket(webSocket)
+        ,_codec(move(codec))
+        ,_propertyEncoder(move(propertyEncoder))
+        ,_onSent(onSent)
+        ,_onFailed(onFailed)
+        { }
+
+        /** Encodes up to `maxFrames` frames of a message, each at most `maxSize` bytes, and
+            sends them, calling the `onSent` callback after each. It stops early after the
+            message's final frame, or when the message needs an ACK, or its relay source has
+            no data, or the WebSocket isn't writeable. Messages that don't set a compression
+            level get `defaultLevel`. */
+        void encode(Retained<MessageOut> msg, size_t maxSize, unsigned maxFrames,
+                    Codec::CompressionLevel defaultLevel) {
+            enqueue(&FrameEncoder::_encode, msg, maxSize, maxFrames, defaultLevel);
+        }
+
+        /** Frees the frame buffer. (The codec has to keep its state.) */
+        void hibernate()                        {enqueue(&FrameEncoder::_hibernate);}
+
+    private:
+        void _encode(Retained<MessageOut> msg, size_t maxSize, unsigned maxFrames,
+                     Codec::CompressionLevel defaultLevel)
+        {
+            if (_failed)
+                return;     // The stream can't be encoded past an error
+            try {
+                // Set up a buffer for the frame contents:
+                if (!_frameBuf)
+                    _frameBuf.reset(new uint8_t[kMaxVarintLen64 + 1 + 4 + kBigFrameSize]);
+                for (unsigned n = 1; ; ++n) {
+                    SentFrame sent = encodeFrame(msg, maxSize, defaultLevel);
+                    sent.last = (n >= maxFrames || !(sent.flags & kMoreComing) || !sent.writeable
+                                 || msg->needsAck() || msg->relayStalled() || msg->relayFailed());
+                    _onSent(msg, sent);
+                    if (sent.last)
+                        break;
+                }
+            } catch (const std::exception &x) {
+                _failed = true;
+                _onFailed(error::convertException(x));
+            }
+        }
+
+        /** Encodes the next frame of a message and writes it to the WebSocket. */
+        SentFrame encodeFrame(MessageOut *msg, size_t maxSize,
+                              Codec::CompressionLevel defaultLevel)
+        {
+            slice out(_frameBuf.get(), maxSize);
+            WriteUVarInt(&out, msg->_number);
+            auto flagsPos = (FrameFlags*)out.buf;
+            out.moveStart(1);
+
+            // Compress the properties before the first frame, if enabled:
+            if (msg->_bytesSent == 0 && !msg->isControl() && _propertyEncoder)
+                msg->encodeProperties(*_propertyEncoder);
+
+            // Set the message's compression parameters on the shared compression
+            // stream (it was flushed at the end of the previous frame, so this is cheap):
+            if (msg->hasFlag(kCompressed))
+                setCompressionParams(msg, defaultLevel);
+
+            // Ask the MessageOut to write data to fill the buffer:
+            SentFrame sent;
+            sent.prevBytesSent = msg->_bytesSent;
+            sent.prevUncompressedBytesSent = msg->_uncompressedBytesSent;
+            auto startTime = CompressionTuner::clock::now();
+            msg->nextFrameToSend(*_codec, out, sent.flags);
+            sent.time = CompressionTuner::clock::now() - startTime;
+            sent.bytesSent = msg->_bytesSent;
+            sent.uncompressedBytesSent = msg->_uncompressedBytesSent;
+            *flagsPos = sent.flags;
+            slice frame(_frameBuf.get(), out.buf);
+            sent.size = frame.size;
+
+            // Write it to the WebSocket:
+            sent.writeable = _webSocket->send(frame);
+            return sent;
+        }
+
+        void setCompressionParams(MessageOut *msg, Codec::CompressionLevel level) {
+            if (msg->_compressionLevel > 0)
+                level = (Codec::CompressionLevel)min(msg->_compressionLevel,
+                                                     (int8_t)Codec::BestCompression);
+            Codec::Strategy strategy;
+            switch (msg->_compressionStrategy) {
+                case MessageBuilder::kFiltered:     strategy = Codec::Filtered; break;
+                case MessageBuilder::kRLE:          strategy = Codec::RLE; break;
+                case MessageBuilder::kHuffmanOnly:  strategy = Codec::HuffmanOnly; break;
+                default:                            strategy = Codec::DefaultStrategy; break;
+            }
+            _codec->setParams(level, strategy);
+        }
+
+        void _hibernate() {
+            _frameBuf.reset();
+        }
+
+        Retained<WebSocket>         _webSocket;
+        unique_ptr<Codec>           _codec;
+        unique_ptr<PropertyEncoder> _propertyEncoder;
+        unique_ptr<uint8_t[]>       _frameBuf;
+        Callback const              _onSent;
+        ErrorCallback const         _onFailed;
+        bool                        _failed {false};
+    };
+
+
+    /** Actor that decodes a connection's incoming frames -- decompressing them and checking
+        their checksums -- and appends them to their MessageIns. It owns the input codec. Frames
+        are decoded in the order they're given, which is the order they arrived in. Progress
+        notifications aren't called here, but passed on with the `onDecoded` callback. */
+    class FrameDecoder : public actor::Actor {
+    public:
+        using Callback = function<void(Retained<MessageIn>, MessageIn::ReceiveState,
+                                       MessageIn::PendingProgress)>;
+        using ErrorCallback = function<void(Retained<MessageIn>, error)>;
+
+        FrameDecoder(const string &name, unique_ptr<Codec> codec,
+                     unique_ptr<PropertyDecoder> propertyDecoder,
+                     Callback onDecoded, ErrorCallback onFailed)
+        :Actor(name)
+        ,_codec(move(codec))
+        ,_propertyDecoder(move(propertyDecoder))
+        ,_onDecoded(onDecoded)
+        ,_onFailed(onFailed)
+        { }
+
+        /** Decodes a frame and appends it to a message. `payload` is the frame after its header,
+            and points into `frame`. If that begins or completes the message, or a progress
+            notification is due, calls the `onDecoded` callback. */
+        void decode(Retained<MessageIn> msg, alloc_slice frame, slice payload, FrameFlags flags) {
+            enqueue(&FrameDecoder::_decode, msg, frame, payload, flags);
+        }
+
+        /** Calls `fn` once the frames already passed to decode() have been decoded. */
+        void flush(function<void()> fn)         {enqueue(&FrameDecoder::_flush, fn);}
+
+    private:
+        void _decode(Retained<MessageIn> msg, alloc_slice frame, slice payload, FrameFlags flags) {
+            if (_failed)
+                return;     // The stream can't be decoded past an error
+            try {
+                MessageIn::PendingProgress progress;
+                auto state = msg->receivedFrame(*_codec, payload, flags, progress,
+                                                _propertyDecoder.get());
+                if (state != MessageIn::kOther || progress)
+                    _onDecoded(msg, state, move(progress));
+            } catch (const std::exception &x) {
+                _failed = true;
+                _onFailed(msg, error::convertException(x));
+            }
+        }
+
+        void _flush(function<void()> fn) {
+            fn();
+        }
+
+        unique_ptr<Codec>           _codec;
+        unique_ptr<PropertyDecoder> _propertyDecoder;
+        Callback const              _onDecoded;
+        ErrorCallback const         _onFailed;
+        bool                        _failed {false};
+    };
+
+
 #pragma mark - BLIP I/O:
 
 
@@ -95,23 +321,58 @@ namespace litecore { namespace blip {
     class BLIPIO : public actor::Actor, public Logging, public websocket::Delegate {
     private:
         using MessageMap = unordered_map<MessageNo, Retained<MessageIn>>;
+        // A message whose remaining frames are decoded but ignored (see discardIncoming)
+        struct Discarded {
+            Retained<MessageIn> msg;
+            actor::Timer::time expires;     // When to forget it, if the peer was told to stop
+        };
+        using DiscardedMap = map<MessageNo, Discarded>;     // (ordered, oldest first)
         using HandlerKey = pair<string, bool>;
         using RequestHandlers = map<HandlerKey, Connection::RequestHandler>;
 
+        // A message the encoder has been given frames of to send (see writeToWebSocket)
+        struct Encoding {
+            Retained<MessageOut> msg;
+            unsigned frames;                // Frames the encoder may still send of it
+            unsigned writeableCount;        // _writeableCount as of its last frame
+            uint32_t ack {0};               // ACKed byte count received meanwhile
+            bool aborted {false};           // Peer aborted it meanwhile
+        };
+
+        // Automatic batching state for one profile (see Connection::setBatching)
+        struct AutoBatch {
+            chrono::milliseconds maxDelay;
+            size_t maxBytes;
+            MessageBatch batch;
+            unsigned generation {0};        // Incremented on flush; invalidates pending timer
+        };
+
         Retained<Connection>    _connection;
         Retained<WebSocket>     _webSocket;
         unique_ptr<error>       _closingWithError;
         actor::ActorBatcher<BLIPIO,websocket::Message> _incomingFrames;
         MessageQueue            _outbox;
         MessageQueue            _icebox;
-        bool                    _writeable {true};
+        bool                    _writeable {false};
         MessageMap              _pendingRequests, _pendingResponses;
+        DiscardedMap            _discardedRequests, _discardedResponses; // Late frames ignored
+        set<MessageNo>          _abortedResponses;      // Unsent responses the peer aborted
+        multimap<actor::Timer::time, MessageNo> _responseDeadlines;
+        unique_ptr<actor::Timer> _timeoutTimer;         // Fires at earliest response deadline
+        unique_ptr<actor::Timer> _idleTimer;            // Fires to check for hibernation
+        actor::Timer::time      _lastActivity;          // When a frame was last sent/received
+        bool                    _idleTimerArmed {false};
         atomic<MessageNo>       _lastMessageNo {0};
         MessageNo               _numRequestsReceived {0};
-        Deflater                _outputCodec;
-        Inflater                _inputCodec;
-        unique_ptr<uint8_t[]>   _frameBuf;
+        Retained<FrameEncoder>  _encoder;               // Created on first use; see encoder()
+        Retained<FrameDecoder>  _decoder;               // Created on first use; see decoder()
+        deque<Encoding>         _encoding;              // Messages _encoder has, in order
+        unsigned                _framesInFlight {0};    // Max frames _encoder may still send
+        unsigned                _writeableCount {0};    // Number of WebSocket writeable calls
+        Codec::CompressionLevel _compressionLevel;      // Level of messages that don't set one
+        unique_ptr<CompressionTuner> _compressionTuner; // Adjusts _compressionLevel, if auto
         RequestHandlers         _requestHandlers;
+        map<string, AutoBatch>  _autoBatches;
         size_t                  _maxOutboxDepth {0}, _totalOutboxDepth {0}, _countOutboxDepth {0};
         uint64_t                _totalBytesWritten {0}, _totalBytesRead {0};
         Stopwatch               _timeOpen;
@@ -119,17 +380,18 @@ namespace litecore { namespace blip {
 
     public:
 
-        BLIPIO(Connection *connection, WebSocket *webSocket, Deflater::CompressionLevel compressionLevel)
+        BLIPIO(Connection *connection, WebSocket *webSocket, Codec::CompressionLevel compressionLevel)
         :Actor(string("BLIP[") + connection->name() + "]")
         ,Logging(BLIPLog)
         ,_connection(connection)
         ,_webSocket(webSocket)
         ,_incomingFrames(this, &BLIPIO::_onWebSocketMessages)
-        ,_outbox(10)
-        ,_outputCodec(compressionLevel)
+        ,_compressionLevel(compressionLevel)
         {
-            _pendingRequests.reserve(10);
-            _pendingResponses.reserve(10);
+            // (Containers and buffers aren't preallocated, since most connections on a busy
+            // server are idle most of the time.)
+            if (connection->_autoCompressionLevel)
+                _compressionTuner.reset(new CompressionTuner(compressionLevel));
         }
 
         void start() {
@@ -155,6 +417,30 @@ namespace litecore { namespace blip {
             enqueue(&BLIPIO::_setRequestHandler, profile, atBeginning, handler);
         }
 
+        void abortIncoming(MessageIn *msg) {
+            enqueue(&BLIPIO::_abortIncoming, Retained<MessageIn>(msg));
+        }
+
+        void dispatchRequest(MessageIn *request) {
+            enqueue(&BLIPIO::_dispatchRequest, Retained<MessageIn>(request));
+        }
+
+        void setBatching(std::string profile, chrono::milliseconds maxDelay, size_t maxBytes) {
+            enqueue(&BLIPIO::_setBatching, profile, maxDelay, maxBytes);
+        }
+
+        void relayDataAvailable(MessageOut *msg) {
+            enqueue(&BLIPIO::_relayDataAvailable, Retained<MessageOut>(msg));
+        }
+
+        void relayResponse(MessageIn *request, MessageIn *reply) {
+            enqueue(&BLIPIO::_relayResponse, Retained<MessageIn>(request), Retained<MessageIn>(reply));
+        }
+
+        void relayFailed(MessageIn *request) {
+            enqueue(&BLIPIO::_relayFailed, Retained<MessageIn>(request));
+        }
+
         void close(CloseCode closeCode = kCodeNormal, slice message =nullslice) {
             enqueue(&BLIPIO::_close, closeCode, alloc_slice(message));
         }
@@ -227,6 +513,18 @@ namespace litecore { namespace blip {
             _onWebSocketMessages(); // process any pending incoming frames
 
             _webSocket = nullptr;
+            _writeable = false;
+            if (_decoder) {
+                // Let the decoder deliver the frames it's been given, before finishing:
+                _decoder->flush(asynchronize([this, status] {
+                    _finishClosing(status);
+                }));
+            } else {
+                _finishClosing(status);
+            }
+        }
+
+        void _finishClosing(websocket::CloseStatus status) {
             if (_connection) {
                 Retained<BLIPIO> holdOn (this);
                 if (_closingWithError) {
@@ -234,13 +532,25 @@ namespace litecore { namespace blip {
                     status.code = _closingWithError->code;
                     status.message = alloc_slice(_closingWithError->what());
                 }
+                saveTransfers();
                 _connection->closed(status);
                 _connection = nullptr;
+                for (auto &ab : _autoBatches)
+                    cancelAll(ab.second.batch);
+                _autoBatches.clear();
                 cancelAll(_outbox);
                 cancelAll(_icebox);
                 cancelAll(_pendingRequests);
                 cancelAll(_pendingResponses);
+                _discardedRequests.clear();
+                _discardedResponses.clear();
+                _abortedResponses.clear();
+                _responseDeadlines.clear();
+                _timeoutTimer.reset();
+                _idleTimer.reset();
                 _requestHandlers.clear();
+                _encoder = nullptr;     // (they retain me, via their callbacks)
+                _decoder = nullptr;
                 release(this); // webSocket is done calling delegate now (balances retain in ctor)
             }
         }
@@ -258,10 +568,17 @@ namespace litecore { namespace blip {
                 msg->disconnected();
                 return;
             }
-            if (msg->_number == 0)
+            if (msg->isResponse() && !msg->isControl() && _abortedResponses.erase(msg->number())) {
+                logVerbose("Not sending %s; the peer aborted it", msg->description().c_str());
+                return;
+            }
+            if (msg->_number == 0) {
+                if (!_autoBatches.empty() && addToAutoBatch(msg))
+                    return;
                 msg->_number = ++_lastMessageNo;
+            }
             if (BLIPLog.willLog(LogLevel::Verbose)) {
-                if (!msg->isAck() || BLIPLog.willLog(LogLevel::Debug))
+                if (!msg->isControl() || BLIPLog.willLog(LogLevel::Debug))
                     logVerbose("Sending %s", msg->description().c_str());
             }
             _maxOutboxDepth = max(_maxOutboxDepth, _outbox.size()+1);
@@ -271,6 +588,72 @@ namespace litecore { namespace blip {
         }
 
 
+        /** If msg is a request whose profile is being auto-batched, adds it to the batch. */
+        bool addToAutoBatch(MessageOut *msg) {
+            if (msg->type() != kRequestType || msg->hasDataSource() || !msg->_batchable
+                    || !(_connection->extensions() & Connection::kBatchExtension))
+                return false;
+            const char *profile = msg->findProperty("Profile");
+            if (!profile)
+                return false;
+            auto i = _autoBatches.find(profile);
+            if (i == _autoBatches.end())
+                return false;
+            AutoBatch &ab = i->second;
+            ab.batch.add(msg->payload(), msg->flags(), move(msg->_onProgress));
+            if (ab.batch.size() >= ab.maxBytes)
+                flushAutoBatch(i->first, ab);
+            else if (ab.batch.count() == 1)
+                enqueueAfter(ab.maxDelay, &BLIPIO::_autoBatchTimeout, i->first, ab.generation);
+            return true;
+        }
+
+
+        void _autoBatchTimeout(string profile, unsigned generation) {
+            auto i = _autoBatches.find(profile);
+            if (i != _autoBatches.end() && i->second.generation == generation)
+                flushAutoBatch(profile, i->second);
+        }
+
+
+        /** Sends an auto-batch's pending requests. */
+        void flushAutoBatch(const string &profile, AutoBatch &ab) {
+            ++ab.generation;
+            if (ab.batch.empty() || !_webSocket)
+                return;
+            logVerbose("Sending batch of %zu '%s' requests", ab.batch.count(), profile.c_str());
+            Retained<MessageOut> msg;
+            if (ab.batch.count() == 1) {
+                auto &item = ab.batch._items[0];
+                msg = new MessageOut(_connection, item.flags, item.payload, nullptr, 0);
+                msg->_onProgress = move(item.onProgress);
+                ab.batch.reset();
+            } else {
+                MessageBuilder mb;
+                ab.batch.build(mb);
+                msg = new MessageOut(_connection, mb, 0);
+            }
+            msg->_number = ++_lastMessageNo;    // (A nonzero number bypasses auto-batching)
+            _queueMessage(msg);
+        }
+
+
+        void _setBatching(string profile, chrono::milliseconds maxDelay, size_t maxBytes) {
+            auto i = _autoBatches.find(profile);
+            if (i != _autoBatches.end()) {
+                flushAutoBatch(i->first, i->second);
+                if (maxDelay.count() <= 0) {
+                    _autoBatches.erase(i);
+                    return;
+                }
+                i->second.maxDelay = maxDelay;
+                i->second.maxBytes = maxBytes;
+            } else if (maxDelay.count() > 0) {
+                _autoBatches.emplace(profile, AutoBatch{maxDelay, maxBytes, {}});
+            }
+        }
+
+
         /** Adds a message to the outgoing queue */
         void requeue(MessageOut *msg, bool andWrite =false) {
             DebugAssert(!_outbox.contains(msg));
@@ -316,79 +699,337 @@ namespace litecore { namespace blip {
         }
 
 
+        /** Starts relaying the response to a request relayed from this connection back to its
+            sender. (Runs here, not on the target connection that received the response, since
+            the request belongs to this connection; see Connection::relayRequest.) */
+        void _relayResponse(Retained<MessageIn> request, Retained<MessageIn> reply) {
+            if (!_connection)
+                return;
+            auto flags = (FrameFlags)(reply->flags() & (kTypeMask | kUrgent | kCompressed));
+            request->_responded = true;
+            request->finishedHandling();
+            Connection::relay(reply, _connection, flags, request->number());
+        }
+
+
+        /** Called when the target of a request relayed from this connection fails. */
+        void _relayFailed(Retained<MessageIn> request) {
+            if (_connection)
+                request->respondWithError({"BLIP"_sl, 502, "relay target failed"_sl});
+        }
+
+
+        /** Called when a relayed message's RelayPipe has more data, or has ended. */
+        void _relayDataAvailable(Retained<MessageOut> msg) {
+            if (!_icebox.contains(msg))
+                return;
+            if (msg->relayFailed()) {
+                _icebox.remove(msg);
+                logInfo("Source of relayed %s failed; abandoning it", msg->description().c_str());
+                msg->disconnected();
+            } else if (!msg->needsAck()) {
+                thawMessage(msg);
+            }
+        }
+
+
         /** WebSocketDelegate method -- socket has room to write data. */
         void _onWebSocketWriteable() {
             logVerbose("WebSocket is hungry!");
             _writeable = true;
+            ++_writeableCount;                      // (see _frameSent)
+            if (_compressionTuner)
+                _compressionTuner->linkUnblocked();
             writeToWebSocket();
         }
 
 
-        /** Sends the next frame. */
+        /** Passes messages to the encoder, which sends their frames. Up to kMaxFramesInFlight
+            frames may be in flight, so the encoder can compress the next frame while this actor
+            handles the last one. While other messages are waiting, each gets one frame at a
+            time, so they take turns; otherwise a message gets as many as there's room for. */
         void writeToWebSocket() {
-            if (!_writeable)
-                return;
-
-            //logVerbose("Writing to WebSocket...");
-            size_t bytesWritten = 0;
-            while (_writeable) {
+            while (_writeable && _framesInFlight < kMaxFramesInFlight && _webSocket) {
                 // Get the next message, if any, from the queue:
                 Retained<MessageOut> msg(_outbox.pop());
                 if (!msg)
                     break;
-
-                FrameFlags frameFlags;
-                {
-                    // Set up a buffer for the frame contents:
-                    size_t maxSize = kDefaultFrameSize;
-                    if (msg->urgent() || _outbox.empty() || !_outbox.front()->urgent())
-                        maxSize = kBigFrameSize;
-
-                    if (!_frameBuf)
-                        _frameBuf.reset(new uint8_t[kMaxVarintLen64 + 1 + 4 + kBigFrameSize]);
-                    slice out(_frameBuf.get(), maxSize);
-                    WriteUVarInt(&out, msg->_number);
-                    auto flagsPos = (FrameFlags*)out.buf;
-                    out.moveStart(1);
-
-                    // Ask the MessageOut to write data to fill the buffer:
-                    auto prevBytesSent = msg->_bytesSent;
-                    msg->nextFrameToSend(_outputCodec, out, frameFlags);
-                    *flagsPos = frameFlags;
-                    slice frame(_frameBuf.get(), out.buf);
-                    bytesWritten += frame.size;
-
-                    logVerbose("    Sending frame: %s #%" PRIu64 " %c%c%c%c, bytes %u--%u",
-                               kMessageTypeNames[frameFlags & kTypeMask], msg->number(),
-                               (frameFlags & kMoreComing ? 'M' : '-'),
-                               (frameFlags & kUrgent ? 'U' : '-'),
-                               (frameFlags & kNoReply ? 'N' : '-'),
-                               (frameFlags & kCompressed ? 'C' : '-'),
-                               prevBytesSent, msg->_bytesSent - 1);
-                    //logVerbose("    %s", frame.hexString().c_str());
-                    // Write it to the WebSocket:
-                    _writeable = _webSocket->send(frame);
+                if (msg->relayFailed()) {
+                    logInfo("Source of relayed %s failed; abandoning it",
+                            msg->description().c_str());
+                    msg->disconnected();
+                    continue;
+                } else if (msg->relayStalled()) {
+                    freezeMessage(msg);     // until _relayDataAvailable is called
+                    continue;
                 }
-                
-                // Return message to the queue if it has more frames left to send:
-                if (frameFlags & kMoreComing) {
+
+                size_t maxSize = kDefaultFrameSize;
+                if (msg->urgent() || _outbox.empty() || !_outbox.front()->urgent())
+                    maxSize = kBigFrameSize;
+                unsigned maxFrames = _outbox.empty() ? kMaxFramesInFlight - _framesInFlight : 1;
+
+                _encoding.push_back({msg, maxFrames, _writeableCount});
+                _framesInFlight += maxFrames;
+                encoder().encode(msg, maxSize, maxFrames, _compressionLevel);
+            }
+        }
+
+
+        /** Called when the encoder has sent a frame of the message at the front of
+            `_encoding`. */
+        void _frameSent(Retained<MessageOut> msg, SentFrame frame) {
+            DebugAssert(!_encoding.empty() && msg == _encoding.front().msg);
+            Encoding &encoding = _encoding.front();
+            --encoding.frames;
+            --_framesInFlight;
+            // If the socket became writeable during the send, it may have been in response to
+            // it, so don't trust a false result:
+            bool writeable = frame.writeable || encoding.writeableCount != _writeableCount;
+            encoding.writeableCount = _writeableCount;
+            uint32_t ack = encoding.ack;
+            bool aborted = encoding.aborted;
+            if (frame.last) {
+                _framesInFlight -= encoding.frames;     // (the encoder may have stopped early)
+                _encoding.pop_front();
+            }
+
+            if (!_connection) {
+                // The connection closed meanwhile:
+                if (frame.last && ((frame.flags & kMoreComing)
+                                   || (msg->type() == kRequestType && !msg->noReply())))
+                    msg->disconnected();
+                return;
+            }
+
+            _writeable = writeable;
+            _totalBytesWritten += frame.size;
+            if (_compressionTuner) {
+                if ((frame.flags & kCompressed) && msg->_compressionLevel < 0)
+                    _compressionTuner->compressedFrame(
+                                frame.uncompressedBytesSent - frame.prevUncompressedBytesSent,
+                                frame.bytesSent - frame.prevBytesSent,
+                                frame.time);
+                _compressionTuner->sentFrame(frame.size);
+                if (!_writeable)
+                    _compressionTuner->linkBlocked();
+            }
+
+            logVerbose("    Sent frame: %s #%" PRIu64 " %c%c%c%c, bytes %u--%u (writeable=%d)",
+                       kMessageTypeNames[frame.flags & kTypeMask], msg->number(),
+                       (frame.flags & kMoreComing ? 'M' : '-'),
+                       (frame.flags & kUrgent ? 'U' : '-'),
+                       (frame.flags & kNoReply ? 'N' : '-'),
+                       (frame.flags & kCompressed ? 'C' : '-'),
+                       frame.prevBytesSent, frame.bytesSent - 1, _writeable);
+
+            // Notify of progress here, not on the encoder's thread. (Not after the peer has
+            // aborted it or responded early; see createResponse.)
+            if (!aborted && !msg->_responseCreated) {
+                MessageProgress::State state;
+                if (frame.flags & kMoreComing)
+                    state = MessageProgress::kSending;
+                else if (msg->noReply())
+                    state = MessageProgress::kComplete;
+                else
+                    state = MessageProgress::kAwaitingReply;
+                msg->sendProgress(state, frame.uncompressedBytesSent, 0, nullptr);
+            }
+
+            if (frame.last) {
+                if (aborted) {
+                    // The peer aborted it while its frames were being sent (see receivedAbort):
+                    abortedByPeer(msg);
+                } else if (frame.flags & kMoreComing) {
+                    // Return message to the queue if it has more frames left to send:
+                    if (ack > 0)
+                        msg->receivedAck(ack);
                     if (msg->needsAck())
                         freezeMessage(msg);
                     else
                         requeue(msg);
                 } else {
-                    if (!msg->isAck()) {
+                    if (!msg->isControl()) {
                         logVerbose("Finished sending %s", msg->description().c_str());
+                        if (msg->hasFlag(kCompressed)) {
+                            auto &stats = msg->_compressionStats;
+                            logVerbose("    compressed %" PRIu64 " of %" PRIu64 " frames, "
+                                       "%" PRIu64 " bytes to %" PRIu64 " (%.0f%%)",
+                                       stats.compressedFrames,
+                                       stats.compressedFrames + stats.rawFrames,
+                                       stats.inputBytes, stats.outputBytes,
+                                       stats.ratio() * 100.0);
+                            _connection->recordCompression(msg->_profile, stats);
+                        }
                         // Add its response message to _pendingResponses:
                         MessageIn* response = msg->createResponse();
-                        if (response)
+                        if (response) {
                             _pendingResponses.emplace(response->number(), response);
+                            scheduleTimeout(response->number(), msg->_timeout);
+                        }
                     }
                 }
             }
-            _totalBytesWritten += bytesWritten;
-            logVerbose("...Wrote %zu bytes to WebSocket (writeable=%d)",
-                       bytesWritten, _writeable);
+
+            noteActivity();
+            if (_compressionTuner)
+                tuneCompression();
+            writeToWebSocket();
+        }
+
+
+        /** Called when the encoder fails; the connection can't send anything more. */
+        void _encodingFailed(error err) {
+            logError("Caught exception sending BLIP message: %s", err.what());
+            deque<Encoding> encoding;
+            swap(encoding, _encoding);
+            _framesInFlight = 0;
+            for (auto &e : encoding)
+                e.msg->disconnected();
+            _closeWithError(err);
+        }
+
+
+        /** Updates the default level from the CompressionTuner. */
+        void tuneCompression() {
+            auto level = (Codec::CompressionLevel)_compressionTuner->update();
+            if (level != _compressionLevel) {
+                logVerbose("Changing compression level from %d to %d", _compressionLevel, level);
+                _compressionLevel = level;
+                _connection->_compressionLevel = level;
+            }
+        }
+
+
+        /** The encoder and decoder are created just before they're first used, with codecs of
+            the negotiated type, primed with the preset dictionary if any. (The codec and the
+            extensions aren't known until the connection opens.) The codecs' compression
+            contexts are allocated later still, by the first compressed frame. */
+        FrameEncoder& encoder() {
+            if (!_encoder) {
+                Codec::ContextParams params;
+                params.windowBits = _connection->_compressionWindowBits;
+                params.memLevel = _connection->_compressionMemLevel;
+                auto codec = CodecRegistry::newEncoder(slice(_connection->_codec),
+                                                       _compressionLevel, params);
+                if (alloc_slice dictionary = _connection->_compressionDictionary; dictionary)
+                    codec->setDictionary(dictionary);
+                unique_ptr<PropertyEncoder> propertyEncoder;
+                if (_connection->extensions() & Connection::kPropertyTableExtension)
+                    propertyEncoder.reset(new PropertyEncoder);
+                _encoder = new FrameEncoder(string("BLIPEncoder[") + _connection->name() + "]",
+                                            _webSocket, move(codec), move(propertyEncoder),
+                    asynchronize([this](Retained<MessageOut> msg, SentFrame frame) {
+                        _frameSent(msg, frame);
+                    }),
+                    asynchronize([this](error err) {
+                        _encodingFailed(err);
+                    }));
+            }
+            return *_encoder;
+        }
+
+        FrameDecoder& decoder() {
+            if (!_decoder) {
+                auto codec = CodecRegistry::newDecoder(slice(_connection->_codec));
+                if (alloc_slice dictionary = _connection->_compressionDictionary; dictionary)
+                    codec->setDictionary(dictionary);
+                unique_ptr<PropertyDecoder> propertyDecoder;
+                if (_connection->extensions() & Connection::kPropertyTableExtension)
+                    propertyDecoder.reset(new PropertyDecoder);
+                _decoder = new FrameDecoder(string("BLIPDecoder[") + _connection->name() + "]",
+                                            move(codec), move(propertyDecoder),
+                    asynchronize([this](Retained<MessageIn> msg, MessageIn::ReceiveState state,
+                                        MessageIn::PendingProgress progress) {
+                        _frameDecoded(msg, state, progress);
+                    }),
+                    asynchronize([this](Retained<MessageIn> msg, error err) {
+                        _decodingFailed(msg, err);
+                    }));
+            }
+            return *_decoder;
+        }
+
+
+        /** Called when frames are sent or received. Arms the timer that checks for idleness,
+            unless it's already armed; it re-arms itself if there's been activity since. */
+        void noteActivity() {
+            if (!_connection || _connection->_hibernateAfter.count() <= 0)
+                return;
+            _lastActivity = actor::Timer::clock::now();
+            if (!_idleTimerArmed) {
+                if (!_idleTimer) {
+                    _idleTimer.reset(new actor::Timer([this] {
+                        enqueue(&BLIPIO::_checkIdle);
+                    }));
+                }
+                _idleTimer->fireAt(_lastActivity + _connection->_hibernateAfter);
+                _idleTimerArmed = true;
+            }
+        }
+
+
+        /** Timer callback: hibernates if there's been no traffic for long enough. */
+        void _checkIdle() {
+            _idleTimerArmed = false;
+            if (!_connection)
+                return;
+            auto idleAt = _lastActivity + _connection->_hibernateAfter;
+            if (actor::Timer::clock::now() < idleAt) {
+                _idleTimer->fireAt(idleAt);
+                _idleTimerArmed = true;
+            } else if (_outbox.empty() && _icebox.empty() && _encoding.empty()) {
+                hibernate();
+            }
+        }
+
+
+        /** Frees memory an idle connection doesn't need. Everything freed is reallocated on
+            demand. (The codecs have to keep their state, since the peer's codecs depend on it.) */
+        void hibernate() {
+            logVerbose("Idle; hibernating");
+            if (_encoder)
+                _encoder->hibernate();
+            _outbox.shrink_to_fit();
+            _icebox.shrink_to_fit();
+            for (MessageMap *map : {&_pendingRequests, &_pendingResponses})
+                map->rehash(0);
+            pruneDiscarded(_discardedRequests);
+            pruneDiscarded(_discardedResponses);
+        }
+
+
+        /** Sets a deadline for the response to request #msgNo to arrive. */
+        void scheduleTimeout(MessageNo msgNo, chrono::milliseconds timeout) {
+            if (timeout.count() == 0)
+                timeout = _connection->_requestTimeout;
+            if (timeout.count() <= 0)
+                return;
+            auto deadline = actor::Timer::clock::now() + timeout;
+            _responseDeadlines.emplace(deadline, msgNo);
+            if (!_timeoutTimer) {
+                _timeoutTimer.reset(new actor::Timer([this] {
+                    enqueue(&BLIPIO::_checkTimeouts);
+                }));
+            }
+            _timeoutTimer->fireEarlierAt(deadline);
+        }
+
+
+        /** Timer callback: expires the pending responses whose deadlines have passed. */
+        void _checkTimeouts() {
+            auto now = actor::Timer::clock::now();
+            while (!_responseDeadlines.empty() && _responseDeadlines.begin()->first <= now) {
+                MessageNo msgNo = _responseDeadlines.begin()->second;
+                _responseDeadlines.erase(_responseDeadlines.begin());
+                auto i = _pendingResponses.find(msgNo);
+                if (i != _pendingResponses.end()) {
+                    logInfo("Request #%" PRIu64 " timed out waiting for a response", msgNo);
+                    discardIncoming(Retained<MessageIn>(i->second), MessageProgress::kTimedOut);
+                }
+            }
+            if (!_responseDeadlines.empty() && _timeoutTimer)
+                _timeoutTimer->fireAt(_responseDeadlines.begin()->first);
         }
 
 
@@ -400,6 +1041,7 @@ namespace litecore { namespace blip {
             auto messages = _incomingFrames.pop(gen);
             if (!messages)
                 return;
+            noteActivity();
             try {
                 for (auto &wsMessage : *messages) {
                     if (_closingWithError)
@@ -434,6 +1076,10 @@ namespace litecore { namespace blip {
                         case kAckResponseType:
                             receivedAck(msgNo, (type == kAckResponseType), payload);
                             break;
+                        case kAbortRequestType:
+                        case kAbortResponseType:
+                            receivedAbort(msgNo, (type == kAbortResponseType));
+                            break;
                         default:
                             warn("  Unknown BLIP frame type received");
                             // For forward compatibility let's just ignore this instead of closing
@@ -441,38 +1087,9 @@ namespace litecore { namespace blip {
                         }
                     }
                     
-                    // Append the frame to the message:
-                    if (msg) {
-                        MessageIn::ReceiveState state;
-                        try {
-                            state = msg->receivedFrame(_inputCodec, payload, flags);
-                        } catch (...) {
-                            // If this is the final frame, then msg may not be in either pending list
-                            // anymore. But on an exception we need to call its progress handler to
-                            // disconnect it, so make sure to re-add it:
-                            if (type == kRequestType)
-                                _pendingRequests.emplace(msgNo, msg);
-                            else if (type == kResponseType)
-                                _pendingResponses.emplace(msgNo, msg);
-                            throw;
-                        }
-                        
-                        if (state == MessageIn::kEnd) {
-                            if (BLIPMessagesLog.willLog(LogLevel::Info)) {
-                                stringstream dump;
-                                bool withBody = BLIPMessagesLog.willLog(LogLevel::Verbose);
-                                msg->dump(dump, withBody);
-                                BLIPMessagesLog.log(LogLevel::Info, "RECEIVED: %s", dump.str().c_str());
-                            }
-                        }
-                        
-                        if (type == kRequestType) {
-                            if (state == MessageIn::kEnd || state == MessageIn::kBeginning) {
-                                // Message complete!
-                                handleRequestReceived(msg, state);
-                            }
-                        }
-                    }
+                    // Pass the frame to the decoder, which appends it to the message:
+                    if (msg)
+                        decoder().decode(msg, wsMessage->data, payload, flags);
                     
                     wsMessage = nullptr; // free the frame
                 }
@@ -484,19 +1101,63 @@ namespace litecore { namespace blip {
         }
 
 
+        /** Called when the decoder has received the beginning or end of a message, or a frame
+            whose progress notification is due. */
+        void _frameDecoded(Retained<MessageIn> msg, MessageIn::ReceiveState state,
+                           MessageIn::PendingProgress progress) {
+            // Deliver progress even if closing, since a final state won't be delivered again;
+            // but not an intermediate one, if the message was discarded since it was decoded:
+            if (progress.progress.state == MessageProgress::kComplete || !msg->_discarding)
+                progress.deliver();
+            if (state == MessageIn::kOther || !_connection || _closingWithError)
+                return;
+            if (state == MessageIn::kEnd) {
+                if (BLIPMessagesLog.willLog(LogLevel::Info)) {
+                    stringstream dump;
+                    bool withBody = BLIPMessagesLog.willLog(LogLevel::Verbose);
+                    msg->dump(dump, withBody);
+                    BLIPMessagesLog.log(LogLevel::Info, "RECEIVED: %s", dump.str().c_str());
+                }
+            }
+            if (msg->type() == kRequestType) {
+                // Message complete!
+                handleRequestReceived(msg, state);
+            }
+        }
+
+
+        /** Called when the decoder fails to decode a frame; the connection can't receive
+            anything more. */
+        void _decodingFailed(Retained<MessageIn> msg, error err) {
+            logError("Caught exception handling incoming BLIP message: %s", err.what());
+            if (!_connection) {
+                msg->disconnected();
+                return;
+            }
+            // If this was the final frame, then msg may not be in either pending list
+            // anymore. But we need to call its progress handler to disconnect it, so make sure
+            // to re-add it:
+            (msg->isResponse() ? _pendingResponses : _pendingRequests).emplace(msg->number(), msg);
+            _closeWithError(err);
+        }
+
+
         /** Handle an incoming ACK message, by unfreezing the associated outgoing message. */
         void receivedAck(MessageNo msgNo, bool onResponse, slice body) {
-            // Find the MessageOut in either _outbox or _icebox:
+            // Find the MessageOut in either _outbox or _icebox, or being encoded:
             bool frozen = false;
+            Encoding *encoding = nullptr;
             Retained<MessageOut> msg = _outbox.findMessage(msgNo, onResponse);
             if (!msg) {
                 msg = _icebox.findMessage(msgNo, onResponse);
-                if (!msg) {
+                if (!msg && (encoding = findEncoding(msgNo, onResponse))) {
+                    msg = encoding->msg;
+                } else if (!msg) {
                     //logVerbose("Received ACK of non-current message (%s #%" PRIu64 ")",
                     //      (onResponse ? "RES" : "REQ"), msgNo);
                     return;
                 }
-                frozen = true;
+                frozen = !encoding;
             }
 
             // Acks have no checksum and don't go through the codec; just read the byte count:
@@ -506,12 +1167,141 @@ namespace litecore { namespace blip {
                 return;
             }
             
+            if (encoding) {
+                // The encoder is using it; apply the ACK when it's done (see _frameSent):
+                encoding->ack = max(encoding->ack, byteCount);
+                return;
+            }
             msg->receivedAck(byteCount);
             if (frozen && !msg->needsAck())
                 thawMessage(msg);
         }
 
 
+        /** Handle an incoming ABORT message, by dropping the associated outgoing message. */
+        void receivedAbort(MessageNo msgNo, bool onResponse) {
+            Retained<MessageOut> msg = _outbox.findMessage(msgNo, onResponse);
+            if (msg)
+                _outbox.remove(msg);
+            else if ((msg = _icebox.findMessage(msgNo, onResponse)))
+                _icebox.remove(msg);
+            if (msg) {
+                abortedByPeer(msg);
+            } else if (Encoding *encoding = findEncoding(msgNo, onResponse)) {
+                encoding->aborted = true;   // it'll be dropped when its frames are sent
+            } else if (!onResponse) {
+                // Request was already sent, so the peer isn't going to respond to it. (But
+                // frames of a response it had begun may still be in transit.)
+                auto i = _pendingResponses.find(msgNo);
+                if (i != _pendingResponses.end()) {
+                    Retained<MessageIn> response = i->second;
+                    _pendingResponses.erase(i);
+                    response->discard(MessageProgress::kAborted);
+                    addDiscarded(_discardedResponses, response, true);
+                }
+            } else {
+                // The response hasn't been sent yet, so don't send it when it's ready:
+                if (_abortedResponses.size() >= kMaxDiscardedMessages)
+                    _abortedResponses.erase(_abortedResponses.begin());
+                _abortedResponses.insert(msgNo);
+            }
+        }
+
+
+        /** Drops an outgoing message that the peer has aborted. */
+        void abortedByPeer(MessageOut *msg) {
+            logVerbose("Peer aborted %s", msg->description().c_str());
+            if (!msg->isResponse() && !msg->_responseCreated)
+                msg->sendProgress(MessageProgress::kAborted, msg->_uncompressedBytesSent,
+                                  0, nullptr);
+        }
+
+
+        /** Returns the encoder's entry for the given outgoing message, if it's sending it. */
+        Encoding* findEncoding(MessageNo msgNo, bool isResponse) {
+            auto i = find_if(_encoding.begin(), _encoding.end(), [&](const Encoding &e) {
+                return e.msg->number() == msgNo && e.msg->isResponse() == isResponse
+                                                && !e.msg->isControl();
+            });
+            return (i != _encoding.end()) ? &*i : nullptr;
+        }
+
+
+        /** Stops receiving an incoming message, which is discarded as its remaining frames
+            arrive. If the abort extension is enabled, tells the peer to stop sending it. */
+        void discardIncoming(Retained<MessageIn> msg, MessageProgress::State state) {
+            bool isResponse = msg->isResponse();
+            MessageMap &pending = isResponse ? _pendingResponses : _pendingRequests;
+            auto i = pending.find(msg->number());
+            if (i == pending.end() || i->second != msg)
+                return;     // already complete
+            pending.erase(i);
+            msg->discard(state);
+            bool sendAbort = (_connection->extensions() & Connection::kAbortExtension) != 0;
+            addDiscarded(isResponse ? _discardedResponses : _discardedRequests, msg, sendAbort);
+
+            if (sendAbort) {
+                auto type = isResponse ? kAbortResponseType : kAbortRequestType;
+                Retained<MessageOut> abort = new MessageOut(_connection,
+                                                            (FrameFlags)(type | kUrgent | kNoReply),
+                                                            alloc_slice(),
+                                                            nullptr,
+                                                            msg->number());
+                _queueMessage(abort);
+            }
+        }
+
+
+        /** Remembers a discarded message, so that frames of it that arrive later can be decoded
+            (keeping the codec and property tables in sync) and ignored. If the peer has been
+            told to stop sending it (`aborted`), it's forgotten kAbortedMessageLifetime after
+            its last frame. Otherwise it's kept until its last frame arrives, but the number
+            kept is limited, since a peer might never send it, e.g. the response to a timed-out
+            request; past that, the oldest are forgotten, and any frames of theirs that do
+            arrive are a protocol error. */
+        void addDiscarded(DiscardedMap &discarded, MessageIn *msg, bool aborted) {
+            pruneDiscarded(discarded);
+            if (discarded.size() >= kMaxDiscardedMessages)
+                discarded.erase(discarded.begin());
+            auto expires = aborted ? actor::Timer::clock::now() + kAbortedMessageLifetime
+                                   : actor::Timer::time::max();
+            discarded[msg->number()] = {msg, expires};
+        }
+
+
+        /** Forgets discarded messages that have expired. */
+        void pruneDiscarded(DiscardedMap &discarded) {
+            auto now = actor::Timer::clock::now();
+            for (auto i = discarded.begin(); i != discarded.end(); ) {
+                if (i->second.expires <= now)
+                    i = discarded.erase(i);
+                else
+                    ++i;
+            }
+        }
+
+
+        /** Returns the discarded message a frame belongs to, or null. */
+        Retained<MessageIn> discardedFrame(DiscardedMap &discarded, MessageNo msgNo,
+                                           FrameFlags flags)
+        {
+            auto i = discarded.find(msgNo);
+            if (i == discarded.end())
+                return nullptr;
+            Retained<MessageIn> msg = i->second.msg;
+            if (!(flags & kMoreComing))
+                discarded.erase(i);
+            else if (i->second.expires != actor::Timer::time::max())
+                i->second.expires = actor::Timer::clock::now() + kAbortedMessageLifetime;
+            return msg;
+        }
+
+
+        void _abortIncoming(Retained<MessageIn> msg) {
+            discardIncoming(msg, MessageProgress::kAborted);
+        }
+
+
         /** Returns the MessageIn object for the incoming request with the given MessageNo. */
         Retained<MessageIn> pendingRequest(MessageNo msgNo, FrameFlags flags) {
             Retained<MessageIn> msg;
@@ -521,10 +1311,19 @@ namespace litecore { namespace blip {
                 msg = i->second;
                 if (!(flags & kMoreComing))
                     _pendingRequests.erase(i);
+            } else if ((msg = discardedFrame(_discardedRequests, msgNo, flags))) {
+                // Remainder of an aborted request; it'll be decoded but discarded
             } else if (msgNo == _numRequestsReceived + 1) {
                 // New request: create and add to _pendingRequests unless it's a singleton frame:
                 ++_numRequestsReceived;
                 msg = new MessageIn(_connection, flags, msgNo);
+                if (!(flags & kUrgent) && _connection->overloaded()) {
+                    // Reject it, without keeping its body (see AdmissionController):
+                    logVerbose("Overloaded; rejecting REQ #%" PRIu64, msgNo);
+                    msg->_shed = msg->_discarding = true;
+                    _connection->_admission.shed();
+                    AdmissionController::processWide().shed();
+                }
                 if (flags & kMoreComing)
                     _pendingRequests.emplace(msgNo, msg);
             } else {
@@ -543,6 +1342,12 @@ namespace litecore { namespace blip {
                 msg = i->second;
                 if (!(flags & kMoreComing))
                     _pendingResponses.erase(i);
+            } else if ((msg = discardedFrame(_discardedResponses, msgNo, flags))) {
+                // Late response that timed out or was aborted; it'll be decoded but discarded
+            } else if ((msg = earlyResponse(msgNo))) {
+                // Error response to a request the peer rejected before it was all sent
+                if (flags & kMoreComing)
+                    _pendingResponses.emplace(msgNo, msg);
             } else {
                 throw runtime_error(format("BLIP protocol error: Bad incoming RES #%" PRIu64 " (%s)",
                        msgNo, (msgNo <= _lastMessageNo ? "no request waiting" : "too high")));
@@ -551,6 +1356,59 @@ namespace litecore { namespace blip {
         }
 
 
+        /** If a response arrives for a request that's still being sent, the peer is rejecting
+            the request (which, with the abort extension, it may do without waiting for all of
+            it; see BLIP Protocol.md §4.3.) Stops sending the request and returns its response. */
+        Retained<MessageIn> earlyResponse(MessageNo msgNo) {
+            if (!(_connection->extensions() & Connection::kAbortExtension))
+                return nullptr;
+            Retained<MessageOut> request = _outbox.findMessage(msgNo, false);
+            if (request) {
+                _outbox.remove(request);
+            } else if ((request = _icebox.findMessage(msgNo, false))) {
+                _icebox.remove(request);
+            } else if (Encoding *encoding = findEncoding(msgNo, false)) {
+                request = encoding->msg;
+                encoding->aborted = true;   // it'll be dropped when its frames are sent
+            } else {
+                return nullptr;
+            }
+            logVerbose("Peer responded to %s before it was sent; stopping it",
+                       request->description().c_str());
+            return request->createResponse();
+        }
+
+
+        // Saves the partial bodies of incomplete resumable requests, so they can be resumed
+        // on another connection.
+        void saveTransfers() {
+            TransferStore *store = _connection->_transferStore;
+            if (!store)
+                return;
+            for (auto &item : _pendingRequests) {
+                MessageIn *request = item.second;
+                alloc_slice body = request->extractPartialBody();
+                slice transferID = request->property(slice(kTransferIDProperty));
+                if (body && transferID) {
+                    logInfo("Saving %zu bytes of interrupted transfer %.*s",
+                            body.size, SPLAT(transferID));
+                    store->save(_connection->_peerIdentity, transferID.asString(), body);
+                }
+            }
+        }
+
+
+        // Responds to a kResumeProfile request with the size of the saved transfer.
+        void handleResumeQuery(MessageIn *request) {
+            string transferID = request->property(slice(kTransferIDProperty)).asString();
+            MessageBuilder response(request);
+            response.addProperty(slice(kTransferOffsetProperty),
+                                 (int64_t)_connection->_transferStore->savedSize(
+                                                        _connection->_peerIdentity, transferID));
+            request->respond(response);
+        }
+
+
         void cancelAll(MessageQueue &queue) {   // either _outbox or _icebox
             if (!queue.empty())
                 logInfo("Notifying %zd outgoing messages they're canceled", queue.size());
@@ -559,11 +1417,21 @@ namespace litecore { namespace blip {
             queue.clear();
         }
 
+        void cancelAll(MessageBatch &batch) {   // an auto-batch
+            for (auto &item : batch._items) {
+                if (item.onProgress)
+                    item.onProgress({MessageProgress::kDisconnected, 0, 0, nullptr});
+            }
+            batch.reset();
+        }
+
         void cancelAll(MessageMap &pending) {   // either _pendingResponses or _pendingRequests
             if (!pending.empty())
                 logInfo("Notifying %zd incoming messages they're canceled", pending.size());
-            for (auto &item : pending)
+            for (auto &item : pending) {
+                item.second->stopRelay();
                 item.second->disconnected();
+            }
             pending.clear();
         }
 
@@ -579,6 +1447,12 @@ namespace litecore { namespace blip {
         }
 
 
+        void _dispatchRequest(Retained<MessageIn> request) {
+            if (_connection)
+                handleRequestReceived(request, MessageIn::kEnd);
+        }
+
+
         void handleRequestBeginning(MessageIn *request) {
             
         }
@@ -588,7 +1462,51 @@ namespace litecore { namespace blip {
                 if (state == MessageIn::kOther)
                     return;
                 bool beginning = (state == MessageIn::kBeginning);
+                if (request->_shed) {
+                    // With the abort extension the peer accepts an early error response, so
+                    // reject it as soon as its properties arrive, and stop the rest of it
+                    // coming; otherwise wait till it's complete.
+                    bool early = (_connection->extensions() & Connection::kAbortExtension) != 0;
+                    if ((early || !beginning) && !request->noReply() && !request->_responded) {
+                        MessageBuilder busy(request);
+                        busy.addProperty("Retry-After"_sl,
+                                         _connection->_admission.limits().retryAfter.count());
+                        busy.makeError({"BLIP"_sl, 503, "busy; retry later"_sl});
+                        busy.urgent = true;         // (so it goes out ahead of the ABORT)
+                        request->respond(busy);
+                    }
+                    if (early && beginning)
+                        discardIncoming(request, MessageProgress::kAborted);
+                    return;
+                }
+                if (request->_resumeFailed) {
+                    if (!beginning)
+                        request->respondWithError({"BLIP"_sl, 410,
+                                                   "resumed transfer is no longer available"_sl});
+                    return;
+                }
+                if (request->_discarding) {
+                    // It was aborted (by its handler) after this frame was decoded:
+                    return;
+                }
                 auto profile = request->property("Profile"_sl);
+                if (profile == slice(kResumeProfile) && _connection->_transferStore) {
+                    if (!beginning)
+                        handleResumeQuery(request);
+                    return;
+                }
+                if (profile == slice(kBatchProfile)
+                        && (_connection->extensions() & Connection::kBatchExtension)) {
+                    // Deliver each request in a batch individually, once it's complete:
+                    if (!beginning) {
+                        Retained<BatchResponder> responder;
+                        for (auto &item : MessageBatch::unpack(request, responder))
+                            handleRequestReceived(item, MessageIn::kEnd);
+                    }
+                    return;
+                }
+                if (!beginning)
+                    request->startedHandling();
                 if (profile) {
                     auto i = _requestHandlers.find({profile.asString(), beginning});
                     if (i != _requestHandlers.end()) {
@@ -626,13 +1544,70 @@ namespace litecore { namespace blip {
         else
             logInfo("Opening connection...");
 
+        auto protocolP = options.get(kAcceptedProtocolOption);
+        if (protocolP.isString())
+            setProtocol(protocolP.asString());
+
         _compressionLevel = kDefaultCompressionLevel;
         auto levelP = options.get(kCompressionLevelOption);
         if (levelP.isInteger())
             _compressionLevel = (int8_t)levelP.asInt();
+        else if (levelP.asString() == slice(kAutoCompressionLevel))
+            _autoCompressionLevel = true;
+        auto windowBitsP = options.get(kCompressionWindowBitsOption);
+        if (windowBitsP.isInteger())
+            _compressionWindowBits = (int8_t)min(max(windowBitsP.asInt(), int64_t(9)),
+                                                 int64_t(15));
+        auto memLevelP = options.get(kCompressionMemLevelOption);
+        if (memLevelP.isInteger())
+            _compressionMemLevel = (int8_t)min(max(memLevelP.asInt(), int64_t(1)), int64_t(9));
+
+        _hibernateAfter = kDefaultHibernateAfter;
+        auto hibernateP = options.get(kHibernateAfterOption);
+        if (hibernateP)
+            _hibernateAfter = chrono::milliseconds(int64_t(hibernateP.asDouble() * 1000.0));
+
+        auto timeoutP = options.get(kRequestTimeoutOption);
+        if (timeoutP)
+            _requestTimeout = chrono::milliseconds(int64_t(timeoutP.asDouble() * 1000.0));
+
+        AdmissionController::Limits limits;
+        auto maxHandlingP = options.get(kMaxHandlingRequestsOption);
+        if (maxHandlingP.isInteger())
+            limits.maxHandling = (unsigned)maxHandlingP.asInt();
+        auto maxDelayP = options.get(kMaxHandlingDelayOption);
+        if (maxDelayP)
+            limits.maxDelay = chrono::milliseconds(int64_t(maxDelayP.asDouble() * 1000.0));
+        _admission.setLimits(limits);
 
         // Now connect the websocket:
-        _io = new BLIPIO(this, webSocket, (Deflater::CompressionLevel)_compressionLevel);
+        _io = new BLIPIO(this, webSocket, (Codec::CompressionLevel)_compressionLevel.load());
+    }
+
+
+    bool Connection::overloaded() const {
+        return _admission.overloaded() || AdmissionController::processWide().overloaded();
+    }
+
+
+    void Connection::recordCompression(const string &profile, const CompressionStats &stats) {
+        lock_guard<mutex> lock(_compressionStatsMutex);
+        _compressionStats[profile] += stats;
+    }
+
+
+    CompressionStats Connection::compressionStats() const {
+        lock_guard<mutex> lock(_compressionStatsMutex);
+        CompressionStats total;
+        for (auto &entry : _compressionStats)
+            total += entry.second;
+        return total;
+    }
+
+
+    unordered_map<string, CompressionStats> Connection::compressionStatsByProfile() const {
+        lock_guard<mutex> lock(_compressionStatsMutex);
+        return _compressionStats;
     }
 
 
@@ -649,17 +1624,294 @@ namespace litecore { namespace blip {
     }
 
 
+    using ResponseProvider = Retained<actor::AsyncProvider<Retained<MessageIn>>>;
+
+    // Returns a progress callback that calls `onProgress` and resolves `provider` to the reply
+    // when the request finishes.
+    static MessageProgressCallback resolvingCallback(ResponseProvider provider,
+                                                     MessageProgressCallback onProgress)
+    {
+        return [provider, onProgress](const MessageProgress &progress) {
+            if (onProgress)
+                onProgress(progress);
+            // (The final notification may be raced by another, e.g. a timeout, on another
+            // thread; trySetResult makes sure only the first resolves the provider.)
+            if (progress.state == MessageProgress::kComplete
+                        || progress.state == MessageProgress::kDisconnected
+                        || progress.state == MessageProgress::kTimedOut
+                        || progress.state == MessageProgress::kAborted)
+                provider->trySetResult(progress.reply);
+        };
+    }
+
+
+    // Returns the key identifying requests that may share a response: the coalescingKey, or
+    // else the whole encoded request, prefixed with the settings that apply to the request as
+    // a whole (its flags, timeout and progress granularity), which coalescing couldn't honor
+    // if they differed.
+    string Connection::coalescingKeyFor(MessageBuilder &mb) {
+        char settings[64];
+        snprintf(settings, sizeof(settings), "%x/%lld/%d/%u/",
+                 unsigned(mb.flags()), (long long)mb.timeout.count(),
+                 int(mb.progressGranularity.mode), mb.progressGranularity.interval);
+        string key = settings;
+        if (!mb.coalescingKey.empty())
+            key += mb.coalescingKey;
+        else
+            key += slice(mb.finish()).asString();
+        return key;
+    }
+
+
     /** Public API to send a new request. */
-    void Connection::sendRequest(MessageBuilder &mb) {
+    actor::Async<Retained<MessageIn>> Connection::sendRequest(MessageBuilder &mb) {
+        auto provider = actor::Async<Retained<MessageIn>>::provider();
+        if (!mb.onProgress)
+            mb.progressGranularity = ProgressGranularity::kCompletionOnly;
+        if (!mb.noreply && !mb.dataSource && (!mb.coalescingKey.empty() || mb.coalesceIdentical)) {
+            if (coalesce(coalescingKeyFor(mb), mb, provider))
+                return provider;
+        }
+        mb.onProgress = resolvingCallback(provider, move(mb.onProgress));
+
         Retained<MessageOut> message = new MessageOut(this, mb, 0);
         DebugAssert(message->type() == kRequestType);
         send(message);
+        return provider;
+    }
+
+
+    // The requests waiting for an in-flight request's response (see MessageBuilder::coalescingKey)
+    struct Connection::CoalescedRequest {
+        vector<MessageProgressCallback> followers;
+    };
+
+
+    // If a request with the same coalescing key is in flight, attaches the new request to it
+    // and returns true; the new request will be notified only when the other one finishes.
+    // Otherwise makes the new request the one in flight, and returns false.
+    bool Connection::coalesce(const string &key, MessageBuilder &mb,
+                              Retained<actor::AsyncProvider<Retained<MessageIn>>> provider)
+    {
+        lock_guard<mutex> lock(_coalesceMutex);
+        auto i = _coalescedRequests.find(key);
+        if (i != _coalescedRequests.end()) {
+            i->second->followers.push_back(resolvingCallback(provider, move(mb.onProgress)));
+            logVerbose("Coalesced request with an identical one in flight (%zu waiting)",
+                       i->second->followers.size());
+            return true;
+        }
+
+        auto request = make_shared<CoalescedRequest>();
+        _coalescedRequests.emplace(key, request);
+        Retained<Connection> self = this;
+        auto onProgress = move(mb.onProgress);
+        mb.onProgress = [self, key, request, onProgress](const MessageProgress &progress) {
+            bool final = (progress.state >= MessageProgress::kComplete);
+            vector<MessageProgressCallback> followers;
+            {
+                lock_guard<mutex> lock(self->_coalesceMutex);
+                if (final) {
+                    auto i = self->_coalescedRequests.find(key);
+                    if (i != self->_coalescedRequests.end() && i->second == request)
+                        self->_coalescedRequests.erase(i);
+                    followers = move(request->followers);
+                } else {
+                    followers = request->followers;
+                }
+            }
+            // Each follower gets its own MessageIn of the reply, made before any callback can
+            // extract the body; an incomplete reply isn't passed on at all.
+            vector<Retained<MessageIn>> replies(followers.size());
+            if (final && progress.reply) {
+                for (auto &reply : replies)
+                    reply = progress.reply->copy();
+            }
+            if (onProgress)
+                onProgress(progress);
+            for (size_t i = 0; i < followers.size(); ++i) {
+                MessageProgress followerProgress = progress;
+                followerProgress.reply = replies[i];
+                followers[i](followerProgress);
+            }
+        };
+        return false;
+    }
+
+
+    // Returns a copy of a request's encoded payload without the first `offset` bytes of its
+    // body, adding a Transfer-Offset property; or null if the body is too short.
+    static alloc_slice resumedPayload(slice payload, uint64_t offset) {
+        uint32_t propertiesSize;
+        if (!ReadUVarInt32(&payload, &propertiesSize) || propertiesSize > payload.size)
+            return {};
+        slice properties(payload.buf, propertiesSize);
+        slice body(properties.end(), payload.end());
+        if (offset > body.size)
+            return {};
+        body.moveStart((size_t)offset);
+
+        string extra = string(kTransferOffsetProperty) + '\0' + to_string(offset) + '\0';
+        size_t newPropertiesSize = propertiesSize + extra.size();
+        alloc_slice result(SizeOfVarInt(newPropertiesSize) + newPropertiesSize + body.size);
+        auto dst = (uint8_t*)result.buf;
+        dst += PutUVarInt(dst, newPropertiesSize);
+        memcpy(dst, properties.buf, properties.size);
+        memcpy(dst + properties.size, extra.data(), extra.size());
+        memcpy(dst + newPropertiesSize, body.buf, body.size);
+        return result;
+    }
+
+
+    /** Public API to resume an interrupted request. */
+    actor::Async<Retained<MessageIn>> Connection::resumeRequest(MessageBuilder &mb) {
+        alloc_slice payload = mb.finish();
+        slice properties = payload;
+        uint32_t propertiesSize;
+        const char *transferID = nullptr;
+        if (ReadUVarInt32(&properties, &propertiesSize) && propertiesSize <= properties.size)
+            transferID = Message::findProperty(slice(properties.buf, propertiesSize),
+                                               kTransferIDProperty);
+        Assert(transferID, "resumeRequest called without a transfer ID");
+        Assert(!mb.dataSource);
+
+        auto provider = actor::Async<Retained<MessageIn>>::provider();
+        auto flags = mb.flags();
+        auto granularity = mb.progressGranularity;
+        auto timeout = mb.timeout;
+        auto onProgress = move(mb.onProgress);
+
+        // First ask the peer how much of the body it has:
+        slice profile(kResumeProfile);
+        MessageBuilder query(profile);
+        query.addProperty(slice(kTransferIDProperty), slice(transferID));
+        query.urgent = true;
+        query.progressGranularity = ProgressGranularity::kCompletionOnly;
+        Retained<Connection> self = this;
+        query.onProgress = [=](const MessageProgress &progress) {
+            if (progress.state < MessageProgress::kComplete)
+                return;
+            if (progress.state != MessageProgress::kComplete) {
+                if (onProgress)
+                    onProgress({progress.state, 0, 0, nullptr});
+                provider->setResult(nullptr);
+                return;
+            }
+            // ...then send the rest. (A peer that doesn't support resuming will return an
+            // error, so the entire message gets sent.)
+            alloc_slice resumed;
+            if (MessageIn *reply = progress.reply; reply && !reply->isError()) {
+                long offset = reply->intProperty(slice(kTransferOffsetProperty), 0);
+                if (offset > 0)
+                    resumed = resumedPayload(payload, offset);
+            }
+            if (resumed)
+                self->logInfo("Resuming transfer %s: skipping %zu bytes already sent",
+                              transferID, payload.size - resumed.size);
+            Retained<MessageOut> message = new MessageOut(self, flags,
+                                                          (resumed ? resumed : payload),
+                                                          nullptr, 0);
+            message->_progressGranularity = granularity;
+            message->_timeout = timeout;
+            message->_onProgress = resolvingCallback(provider, onProgress);
+            self->send(message);
+        };
+        sendRequest(query);
+        return provider;
+    }
+
+
+    /** Public API to send a batch of requests. */
+    void Connection::sendBatch(MessageBatch &batch) {
+        if (batch.count() > 1 && (_extensions & kBatchExtension)) {
+            MessageBuilder mb;
+            batch.build(mb);
+            sendRequest(mb);
+        } else {
+            for (auto &item : batch._items) {
+                Retained<MessageOut> message = new MessageOut(this, item.flags, item.payload,
+                                                              nullptr, 0);
+                message->_onProgress = move(item.onProgress);
+                send(message);
+            }
+            batch.reset();
+        }
+    }
+
+
+    void Connection::abort(MessageIn *msg) {
+        _io->abortIncoming(msg);
+    }
+
+
+    /** Delivers a complete request (that wasn't received directly as frames) to its handler. */
+    void Connection::dispatchRequest(MessageIn *request) {
+        _io->dispatchRequest(request);
+    }
+
+
+    /** Public API to relay a request to another connection. */
+    void Connection::relayRequest(MessageIn *request, Connection *target) {
+        if (request->_relay)
+            return;     // already being relayed (this is the call for the complete request)
+        auto flags = (FrameFlags)(request->flags() & (kTypeMask | kUrgent | kNoReply | kCompressed));
+        if (request->noReply()) {
+            relay(request, target, flags, 0);
+            return;
+        }
+
+        // When the target's response begins to arrive, relay it back to the sender. (This
+        // callback runs on the target's threads, so the work is posted to this connection's.)
+        Retained<MessageIn> req = request;
+        Retained<BLIPIO> io = _io;
+        auto relayedResponse = make_shared<atomic<bool>>(false);
+        auto onProgress = [req, io, relayedResponse](const MessageProgress &progress) {
+            if (progress.reply && (progress.state == MessageProgress::kReceivingReply
+                                   || progress.state == MessageProgress::kComplete)) {
+                if (!relayedResponse->exchange(true))
+                    io->relayResponse(req, progress.reply);
+            } else if (progress.state >= MessageProgress::kDisconnected) {
+                if (!relayedResponse->exchange(true))
+                    io->relayFailed(req);
+            }
+        };
+        relay(request, target, flags, 0, move(onProgress));
+    }
+
+
+    // Sends a MessageOut over `target` whose body is streamed from the incoming message `in`.
+    // (The progress callback has to be set before it's sent, since from then on the target's
+    // threads may call it.)
+    Retained<MessageOut> Connection::relay(MessageIn *in, Connection *target,
+                                           FrameFlags flags, MessageNo number,
+                                           MessageProgressCallback onProgress)
+    {
+        // The payload is just the properties; the body comes from the pipe:
+        size_t propertiesSize = in->_properties.size;
+        alloc_slice header(SizeOfVarInt(propertiesSize) + propertiesSize);
+        size_t n = PutUVarInt((void*)header.buf, propertiesSize);
+        memcpy((uint8_t*)header.buf + n, in->_properties.buf, propertiesSize);
+
+        Retained<RelayPipe> pipe = new RelayPipe(in);
+        Retained<MessageOut> out = new MessageOut(target, flags, header, nullptr, number);
+        out->_onProgress = move(onProgress);
+        out->setRelay(pipe);
+        Retained<BLIPIO> io = target->_io;
+        pipe->setOnAvailable([io, out] { io->relayDataAvailable(out); });
+        target->send(out);
+        in->startRelay(pipe);
+        return out;
+    }
+
+
+    void Connection::setBatching(string profile, chrono::milliseconds maxDelay, size_t maxBytes) {
+        _io->setBatching(profile, maxDelay, maxBytes);
     }
 
 
     /** Internal API to send an outgoing message (a request, response, or ACK.) */
     void Connection::send(MessageOut *msg) {
-        if (_compressionLevel == 0)
+        if (_compressionLevel == 0 && msg->_compressionLevel < 0)
             msg->dontCompress();
         if (BLIPMessagesLog.effectiveLevel() <= LogLevel::Info) {
             stringstream dump;
@@ -677,7 +1929,107 @@ namespace litecore { namespace blip {
     }
 
 
+    void Connection::setRequestHandler(string profile, RequestHandler handler,
+                                       ResponseCache *cache)
+    {
+        _io->setRequestHandler(profile, false, cache->cachingHandler(handler));
+    }
+
+
+    string Connection::protocolName(Extensions extensions, slice dictionaryID, slice codec) {
+        string name = kWSProtocolName;
+        for (auto &ext : kExtensionNames) {
+            if (extensions & ext.extension) {
+                (name += '+') += ext.name;
+                if (ext.extension == kDictionaryExtension)
+                    (name += '-') += (dictionaryID ? string(dictionaryID)
+                                                   : CompressionDictionary::kBuiltInID);
+            }
+        }
+        if (codec && codec != slice(kDefaultCodec))
+            (name += '+') += string(codec);
+        return name;
+    }
+
+
+    Connection::Extensions Connection::extensionsInProtocol(slice protocol) {
+        slice base(kWSProtocolName);
+        if (!protocol.hasPrefix(base))
+            return 0;
+        protocol.moveStart(base.size);
+        Extensions extensions = 0;
+        while (protocol.size > 0 && protocol[0] == '+') {
+            protocol.moveStart(1);
+            auto end = protocol.findByteOrEnd('+');
+            slice token(protocol.buf, end);
+            token = slice(token.buf, token.findByteOrEnd('-'));     // Strip any parameter
+            for (auto &ext : kExtensionNames) {
+                if (token == slice(ext.name))
+                    extensions |= ext.extension;
+            }
+            protocol.setStart(end);
+        }
+        return extensions;
+    }
+
+
+    string Connection::dictionaryInProtocol(slice protocol) {
+        slice prefix("Dict-");
+        while (protocol.size > 0) {
+            auto end = protocol.findByteOrEnd('+');
+            slice token(protocol.buf, end);
+            if (token.hasPrefix(prefix))
+                return string((const char*)token.buf + prefix.size, token.size - prefix.size);
+            protocol.setStart(end);
+            if (protocol.size > 0)
+                protocol.moveStart(1);
+        }
+        return "";
+    }
+
+
+    string Connection::codecInProtocol(slice protocol) {
+        if (!protocol.hasPrefix(slice(kWSProtocolName)))
+            return kDefaultCodec;
+        while (protocol.size > 0) {
+            auto end = protocol.findByteOrEnd('+');
+            slice token(protocol.buf, end);
+            if (CodecRegistry::has(token))
+                return string(token);
+            protocol.setStart(end);
+            if (protocol.size > 0)
+                protocol.moveStart(1);
+        }
+        return kDefaultCodec;
+    }
+
+
+    // Sets the extensions in use, the compression dictionary and the codec from the accepted
+    // protocol.
+    void Connection::setProtocol(slice protocol) {
+        Extensions extensions = extensionsInProtocol(protocol);
+        if (extensions & kDictionaryExtension) {
+            string id = dictionaryInProtocol(protocol);
+            _compressionDictionary = CompressionDictionary::named(id);
+            if (!_compressionDictionary) {
+                warn("Unknown compression dictionary '%s'", id.c_str());
+                extensions &= ~kDictionaryExtension;
+            }
+        }
+        _extensions = extensions;
+        _codec = codecInProtocol(protocol);
+    }
+
+
     void Connection::gotHTTPResponse(int status, const websocket::Headers &headers) {
+        slice protocol = headers["Sec-WebSocket-Protocol"_sl];
+        if (protocol) {
+            setProtocol(protocol);
+            if (_extensions)
+                logInfo("Using BLIP extensions %s", protocolName(_extensions).c_str());
+            if (_codec != kDefaultCodec)
+                logInfo("Using compression codec %s", _codec.c_str());
+        }
         delegate().onHTTPResponse(status, headers);
     }
 
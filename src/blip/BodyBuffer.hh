@@ -0,0 +1,85 @@
+//
+// BodyBuffer.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include <algorithm>
+#include <string.h>
+
+namespace litecore { namespace blip {
+
+    /** Accumulates the body of an incoming message in a single contiguous heap block, which
+        grows geometrically. The codec decodes straight into its spare capacity (see `spare`
+        and `wrote`), and `finish` hands the block over as the body without copying it. */
+    class BodyBuffer {
+    public:
+        static constexpr size_t kMinCapacity = 4096;
+
+        /** Number of bytes written. */
+        size_t size() const                         {return _size;}
+
+        /** The bytes written so far. */
+        fleece::slice contents() const              {return {_buf.buf, _size};}
+
+        /** Returns the unused space at the end of the buffer, first growing the buffer if
+            necessary so the space is at least `minSpace` bytes. Call `wrote` afterwards with
+            the number of bytes written into it. */
+        fleece::slice spare(size_t minSpace) {
+            if (_buf.size - _size < minSpace)
+                grow(_size + minSpace);
+            return {(uint8_t*)_buf.buf + _size, _buf.size - _size};
+        }
+
+        void wrote(size_t count)                    {_size += count;}
+
+        void write(fleece::slice data) {
+            memcpy((void*)spare(data.size).buf, data.buf, data.size);
+            _size += data.size;
+        }
+
+        /** Returns the bytes written, trimmed to size, and resets the buffer to empty. */
+        fleece::alloc_slice finish() {
+            fleece::alloc_slice result = std::move(_buf);
+            if (_size == 0)
+                result = {};
+            else if (_size < result.size)
+                result.resize(_size);
+            reset();
+            return result;
+        }
+
+        /** Empties the buffer but keeps its memory, for reuse. */
+        void clear()                                {_size = 0;}
+
+        /** Empties the buffer and frees its memory. */
+        void reset()                                {_buf = {}; _size = 0;}
+
+    private:
+        void grow(size_t minCapacity) {
+            size_t capacity = std::max({minCapacity, 2 * _buf.size, kMinCapacity});
+            if (_buf)
+                _buf.resize(capacity);
+            else
+                _buf = fleece::alloc_slice(capacity);
+        }
+
+        fleece::alloc_slice _buf;                   // Allocated block; its size is the capacity
+        size_t _size {0};                           // Number of bytes written to _buf
+    };
+
+} }
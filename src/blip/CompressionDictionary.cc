@@ -0,0 +1,97 @@
+//
+// CompressionDictionary.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "CompressionDictionary.hh"
+#include "Error.hh"
+#include <map>
+#include <mutex>
+#include <ctype.h>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    // The built-in dictionary. Deflate finds matches at short distances more cheaply, so the
+    // most common strings come last. Properties are NUL-separated, as they are on the wire.
+    // THIS IS PART OF THE PROTOCOL: it can never be changed; instead, add a new dictionary
+    // with a new ID.
+    static constexpr char kBuiltInDictionary[] =
+        // Attachments and blobs:
+        "\"content_type\":\"application/octet-stream\"\"content_type\":\"image/jpeg\""
+        "\"content_type\":\"text/plain\"{\"@type\":\"blob\",\"digest\":\"sha1-"
+        "{\"_attachments\":{\"blob_1\":{\"content_type\":\"application/json\",\"digest\":\"sha1-"
+        "\",\"length\":0,\"revpos\":1,\"stub\":true}}"
+        // Revision history, checkpoints, errors:
+        "\"_revisions\":{\"start\":1,\"ids\":[\"\"]}"
+        "{\"local\":1,\"remote\":\"\"}{\"error\":\"\",\"reason\":\"\"}"
+        "Error-Domain\0BLIP\0Error-Code\0"
+        "Error-Domain\0HTTP\0Error-Code\0" "404\0Error-Message\0"
+        // Replication requests:
+        "Profile\0getCheckpoint\0client\0"
+        "Profile\0setCheckpoint\0client\0rev\0"
+        "Profile\0subChanges\0since\0continuous\0true\0batch\0" "200\0activeOnly\0true\0"
+        "filter\0sync_gateway/bychannel\0channels\0"
+        "Profile\0getAttachment\0digest\0sha1-"
+        "Profile\0proveAttachment\0"
+        "Profile\0proposeChanges\0"
+        "Profile\0changes\0"
+        "Profile\0norev\0id\0error\0" "404\0reason\0"
+        "Body-Encoding\0fleece\0"
+        "Profile\0rev\0id\0rev\0sequence\0deleted\0true\0history\0noconflicts\0true\0"
+        "deltaSrc\0revocation\0true\0"
+        // Documents and change lists:
+        "\"_deleted\":true\"_removed\":true,\"channels\":[\"\"],\"type\":\""
+        "[[1,\"\",\"1-\"],[2,\"\",\"2-\",true]]"
+        "{\"_id\":\"\",\"_rev\":\"1-\"}";
+
+
+    static mutex sMutex;
+
+
+    static map<string, alloc_slice, less<>>& registry() {
+        static map<string, alloc_slice, less<>> sRegistry = {
+            {CompressionDictionary::kBuiltInID,
+             alloc_slice(kBuiltInDictionary, sizeof(kBuiltInDictionary) - 1)},
+        };
+        return sRegistry;
+    }
+
+
+    void CompressionDictionary::registerDictionary(const string &id, alloc_slice data) {
+        if (id.empty() || data.size == 0 || data.size > 32768)
+            error::_throw(error::InvalidParameter);
+        for (char c : id) {
+            if (!isalnum(c) && c != '.' && c != '_')
+                error::_throw(error::InvalidParameter);
+        }
+        lock_guard<mutex> lock(sMutex);
+        auto result = registry().emplace(id, data);
+        if (!result.second && result.first->second != data)
+            error::_throw(error::InvalidParameter);     // Can't change a dictionary
+    }
+
+
+    alloc_slice CompressionDictionary::named(slice id) {
+        lock_guard<mutex> lock(sMutex);
+        auto &reg = registry();
+        auto i = reg.find(string_view((const char*)id.buf, id.size));
+        return (i != reg.end()) ? i->second : alloc_slice();
+    }
+
+} }
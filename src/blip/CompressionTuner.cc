@@ -0,0 +1,113 @@
+//
+// CompressionTuner.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "CompressionTuner.hh"
+#include "BLIPInternal.hh"
+#include <algorithm>
+
+using namespace std;
+
+namespace litecore { namespace blip {
+
+    // The link only counts as saturated if it was blocked for this fraction of a window:
+    static constexpr double kMinBlockedFraction = 0.25;
+
+    // Raise the level if link time per byte is this many times the CPU time per byte.
+    // (Lower it if it's less than 1x.)
+    static constexpr double kRaiseThreshold = 2.0;
+
+
+    CompressionTuner::CompressionTuner(int level)
+    :_level(min(max(level, kMinLevel), kMaxLevel))
+    {
+        startWindow(clock::now());
+    }
+
+
+    void CompressionTuner::startWindow(clock::time_point now) {
+        _windowStart = now;
+        if (_blockedSince != clock::time_point())
+            _blockedSince = now;
+        _cpuTime = _blockedTime = {};
+        _inputBytes = _outputBytes = _bytesSent = 0;
+    }
+
+
+    void CompressionTuner::compressedFrame(size_t inputBytes, size_t outputBytes,
+                                           clock::duration cpuTime)
+    {
+        _inputBytes += inputBytes;
+        _outputBytes += outputBytes;
+        _cpuTime += cpuTime;
+    }
+
+
+    void CompressionTuner::linkBlocked() {
+        if (_blockedSince == clock::time_point())
+            _blockedSince = clock::now();
+    }
+
+
+    void CompressionTuner::linkUnblocked() {
+        if (_blockedSince != clock::time_point()) {
+            _blockedTime += clock::now() - _blockedSince;
+            _blockedSince = {};
+        }
+    }
+
+
+    int CompressionTuner::update() {
+        auto now = clock::now();
+        if (_inputBytes < kMinWindowBytes || now - _windowStart < kMinWindowTime)
+            return _level;
+
+        auto blockedTime = _blockedTime;
+        if (_blockedSince != clock::time_point())
+            blockedTime += now - _blockedSince;
+        double windowSecs = chrono::duration<double>(now - _windowStart).count();
+        double blockedSecs = chrono::duration<double>(blockedTime).count();
+
+        // Seconds per byte of input, to compress it and to send it:
+        double cpuPerByte = chrono::duration<double>(_cpuTime).count() / _inputBytes;
+        double linkPerByte = 0.0;   // (If the link isn't saturated, it costs nothing)
+        if (blockedSecs >= kMinBlockedFraction * windowSecs && _bytesSent > 0) {
+            double linkBytesPerSec = _bytesSent / windowSecs;
+            linkPerByte = (double(_outputBytes) / _inputBytes) / linkBytesPerSec;
+        }
+
+        int vote = 0;
+        if (linkPerByte > kRaiseThreshold * cpuPerByte)
+            vote = 1;
+        else if (linkPerByte < cpuPerByte)
+            vote = -1;
+        _votes = (vote == 0 || (vote > 0) != (_votes > 0)) ? vote : _votes + vote;
+
+        LogVerbose(BLIPLog, "CompressionTuner: level %d, ratio %.2f, CPU %.1f ns/byte, "
+                   "link %.1f ns/byte; votes=%d",
+                   _level, double(_outputBytes) / _inputBytes,
+                   cpuPerByte * 1e9, linkPerByte * 1e9, _votes);
+
+        if (abs(_votes) >= kWindowsToChange) {
+            _level = min(max(_level + vote, kMinLevel), kMaxLevel);
+            _votes = 0;
+        }
+        startWindow(now);
+        return _level;
+    }
+
+} }
@@ -0,0 +1,75 @@
+//
+// CompressionTuner.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace litecore { namespace blip {
+
+    /** Chooses the deflate level for a connection's outgoing frames, when the compression level
+        option is "auto". It measures the CPU time deflate takes per byte of input, and the
+        throughput of the link while it's saturated (i.e. while the WebSocket isn't writeable),
+        over windows of at least kMinWindowBytes and kMinWindowTime.
+
+        If sending a byte takes much more link time than CPU time, the link is the bottleneck
+        and a higher level pays off; if it takes less link time than CPU time, compression is
+        the bottleneck and a lower level is better. In between, the level stays put, and it
+        only changes after kWindowsToChange consecutive windows agree. Not thread-safe; it's
+        used on the BLIPIO's queue. */
+    class CompressionTuner {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        static constexpr int kMinLevel = 1, kMaxLevel = 9;
+
+        explicit CompressionTuner(int level);
+
+        int level() const                       {return _level;}
+
+        /** Records a compressed frame and the time it took to compress. */
+        void compressedFrame(size_t inputBytes, size_t outputBytes, clock::duration cpuTime);
+
+        /** Records that a frame (of any kind) was written to the WebSocket. */
+        void sentFrame(size_t frameBytes)       {_bytesSent += frameBytes;}
+
+        void linkBlocked();                     // WebSocket stopped being writeable
+        void linkUnblocked();                   // WebSocket became writeable again
+
+        /** Ends the current window if it's big enough, and returns the level to use now. */
+        int update();
+
+    private:
+        static constexpr size_t kMinWindowBytes = 256 * 1024;
+        static constexpr auto kMinWindowTime = std::chrono::milliseconds(250);
+        static constexpr int kWindowsToChange = 2;
+
+        void startWindow(clock::time_point);
+
+        int _level;
+        int _votes {0};                         // Consecutive windows wanting up (+) or down (-)
+        clock::time_point _windowStart;
+        clock::time_point _blockedSince;        // When link blocked; zero if it isn't blocked
+        clock::duration _cpuTime {};            // Time spent compressing, in this window
+        clock::duration _blockedTime {};        // Time the link was blocked, in this window
+        uint64_t _inputBytes {0}, _outputBytes {0}; // Compressed frames' data, in this window
+        uint64_t _bytesSent {0};                // All frames' bytes sent, in this window
+    };
+
+} }
@@ -0,0 +1,319 @@
+//
+// ConnectionPool.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "ConnectionPool.hh"
+#include "BLIPInternal.hh"
+#include "Error.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <random>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    // Upper limit on the number of parts of a striped request
+    static constexpr size_t kMaxStripeCount = 64;
+
+
+    static bool isFinal(const MessageProgress &progress) {
+        return progress.state == MessageProgress::kComplete
+            || progress.state == MessageProgress::kDisconnected
+            || progress.state == MessageProgress::kTimedOut
+            || progress.state == MessageProgress::kAborted;
+    }
+
+
+    ConnectionPool::ConnectionPool(const vector<Retained<Connection>> &connections) {
+        Assert(!connections.empty());
+        for (auto &conn : connections)
+            _connections.push_back({conn, make_shared<atomic<int64_t>>(0)});
+        // Stripe IDs must not repeat those of an earlier pool whose parts the peer may still
+        // be holding, so they start with a random prefix:
+        random_device rd;
+        char prefix[20];
+        snprintf(prefix, sizeof(prefix), "%08x%08x-", rd(), rd());
+        _stripeIDPrefix = prefix;
+        // Reassemble striped requests arriving on any of the connections:
+        _backpointer = make_shared<Backpointer>();
+        _backpointer->pool = this;
+        auto backpointer = _backpointer;
+        setRequestHandler(kStripeProfile, false, [backpointer](MessageIn *part) {
+            lock_guard<mutex> lock(backpointer->lock);
+            if (backpointer->pool)
+                backpointer->pool->receivedPart(part);
+            else
+                part->respondWithError({"BLIP"_sl, 404, "no handler for striped requests"_sl});
+        });
+    }
+
+
+    ConnectionPool::~ConnectionPool() {
+        {
+            lock_guard<mutex> lock(_backpointer->lock);
+            _backpointer->pool = nullptr;
+        }
+        setRequestHandler(kStripeProfile, false, nullptr);
+    }
+
+
+    void ConnectionPool::setRoute(string profile, size_t index) {
+        Assert(index < _connections.size());
+        lock_guard<mutex> lock(_mutex);
+        _routes[profile] = index;
+    }
+
+
+    void ConnectionPool::setRequestHandler(string profile, bool atBeginning,
+                                           Connection::RequestHandler handler) {
+        for (auto &member : _connections)
+            member.conn->setRequestHandler(profile, atBeginning, handler);
+    }
+
+
+    void ConnectionPool::close(websocket::CloseCode code, slice message) {
+        for (auto &member : _connections)
+            member.conn->close(code, message);
+    }
+
+
+#pragma mark - SENDING:
+
+
+    // Returns the index of the connection to send a (non-striped) request over.
+    size_t ConnectionPool::chooseConnection(slice payload) const {
+        // Route by profile:
+        uint32_t propertiesSize;
+        if (ReadUVarInt32(&payload, &propertiesSize) && propertiesSize <= payload.size) {
+            const char *profile = Message::findProperty(slice(payload.buf, propertiesSize),
+                                                         "Profile");
+            if (profile) {
+                lock_guard<mutex> lock(_mutex);
+                auto i = _routes.find(profile);
+                if (i != _routes.end())
+                    return i->second;
+            }
+        }
+        // Otherwise pick the connection with the fewest bytes in flight:
+        size_t best = 0;
+        int64_t bestBytes = INT64_MAX;
+        for (size_t i = 0; i < _connections.size(); ++i) {
+            int64_t bytes = *_connections[i].bytesInFlight;
+            if (bytes < bestBytes) {
+                best = i;
+                bestBytes = bytes;
+            }
+        }
+        return best;
+    }
+
+
+    actor::Async<Retained<MessageIn>> ConnectionPool::sendRequest(MessageBuilder &mb) {
+        alloc_slice payload = mb.finish();
+        size_t stripeSize = _stripeSize;
+        if (stripeSize > 0 && payload.size > stripeSize && _connections.size() > 1
+                          && !mb.dataSource)
+            return sendStriped(mb, payload);
+
+        auto &member = _connections[chooseConnection(payload)];
+        // Keep track of the bytes in flight on the connection:
+        auto bytesInFlight = member.bytesInFlight;
+        auto size = (int64_t)payload.size;
+        *bytesInFlight += size;
+        auto onProgress = move(mb.onProgress);
+        if (!onProgress)
+            mb.progressGranularity = ProgressGranularity::kCompletionOnly;
+        mb.onProgress = [=](const MessageProgress &progress) {
+            if (isFinal(progress))
+                *bytesInFlight -= size;
+            if (onProgress)
+                onProgress(progress);
+        };
+        return member.conn->sendRequest(mb);
+    }
+
+
+    namespace {
+        // State of an outgoing striped request, shared by its parts' progress callbacks.
+        struct StripedRequest {
+            mutex                               lock;
+            Retained<actor::AsyncProvider<Retained<MessageIn>>> provider;
+            MessageProgressCallback             onProgress;
+            MessageSize                         size;
+            size_t                              remaining;
+            Retained<MessageIn>                 reply;
+            MessageProgress::State              failure {MessageProgress::kComplete};
+        };
+    }
+
+
+    // Sends a large request as a set of parts, one over each connection.
+    actor::Async<Retained<MessageIn>> ConnectionPool::sendStriped(MessageBuilder &mb,
+                                                                  alloc_slice payload)
+    {
+        size_t count = min(_connections.size(), kMaxStripeCount);
+        string stripeID = _stripeIDPrefix + to_string(++_lastStripeID);
+
+        auto state = make_shared<StripedRequest>();
+        state->provider = actor::Async<Retained<MessageIn>>::provider();
+        state->onProgress = move(mb.onProgress);
+        state->size = payload.size;
+        state->remaining = count;
+
+        auto partProgress = [state](const MessageProgress &progress) {
+            if (!isFinal(progress))
+                return;
+            Retained<MessageIn> result;
+            MessageProgress::State finalState;
+            {
+                lock_guard<mutex> lock(state->lock);
+                if (progress.state != MessageProgress::kComplete) {
+                    state->failure = progress.state;
+                } else if (MessageIn *reply = progress.reply; reply) {
+                    // Interim replies just acknowledge a part; the other one is the real reply:
+                    if (reply->isError() || !reply->property("Stripe-Received"_sl))
+                        state->reply = reply;
+                }
+                if (--state->remaining > 0)
+                    return;
+                finalState = state->failure;
+                if (finalState == MessageProgress::kComplete)
+                    result = state->reply;
+            }
+            if (state->onProgress)
+                state->onProgress({finalState, state->size, 0, result});
+            state->provider->setResult(result);
+        };
+
+        slice profile(kStripeProfile), remaining = payload;
+        for (size_t i = 0; i < count; ++i) {
+            size_t partSize = remaining.size / (count - i);
+            MessageBuilder part(profile);
+            part.addProperty("Stripe-ID"_sl, slice(stripeID));
+            part.addProperty("Stripe-Index"_sl, (int64_t)i);
+            part.addProperty("Stripe-Count"_sl, (int64_t)count);
+            part.write(slice(remaining.buf, partSize));
+            remaining.moveStart(partSize);
+            part.urgent = mb.urgent;
+            part.compressed = mb.compressed;
+            part.noreply = mb.noreply;
+            part.timeout = mb.timeout;
+            part.progressGranularity = ProgressGranularity::kCompletionOnly;
+            part.onProgress = partProgress;
+            _connections[i].conn->sendRequest(part);
+        }
+        LogVerbose(BLIPLog, "Striped %zu-byte request %s across %zu connections",
+                   payload.size, stripeID.c_str(), count);
+        return state->provider;
+    }
+
+
+#pragma mark - RECEIVING:
+
+
+    // Request handler for kStripeProfile: collects the parts of a striped request, and when
+    // they're all present, dispatches the reassembled request.
+    void ConnectionPool::receivedPart(MessageIn *part) {
+        string stripeID = part->property("Stripe-ID"_sl).asString();
+        long index = part->intProperty("Stripe-Index"_sl, -1);
+        long count = part->intProperty("Stripe-Count"_sl, 0);
+        if (stripeID.empty() || count <= 0 || count > (long)kMaxStripeCount
+                             || index < 0 || index >= count) {
+            part->respondWithError({"BLIP"_sl, 400, "invalid striped request"_sl});
+            return;
+        }
+
+        alloc_slice payload;
+        {
+            lock_guard<mutex> lock(_mutex);
+            pruneReassemblies();
+            alloc_slice body = part->body();
+            Reassembly &r = _reassemblies[stripeID];
+            if (r.parts.empty()) {
+                r.parts.resize(count);
+                r.expires = chrono::steady_clock::now() + kReassemblyTimeout;
+            }
+            if (r.parts.size() != (size_t)count || r.parts[index]) {
+                _reassemblyBytes -= r.bytes;
+                _reassemblies.erase(stripeID);
+                part->respondWithError({"BLIP"_sl, 400, "invalid striped request"_sl});
+                return;
+            }
+            if (_reassemblyBytes + body.size > _maxReassemblyBytes) {
+                _reassemblyBytes -= r.bytes;
+                _reassemblies.erase(stripeID);
+                part->respondWithError({"BLIP"_sl, 413, "striped request too large"_sl});
+                return;
+            }
+            r.parts[index] = body;
+            r.bytes += body.size;
+            _reassemblyBytes += body.size;
+            if (++r.received == (size_t)count) {
+                size_t size = 0;
+                for (auto &p : r.parts)
+                    size += p.size;
+                payload = alloc_slice(size);
+                size_t pos = 0;
+                for (auto &p : r.parts) {
+                    memcpy((uint8_t*)payload.buf + pos, p.buf, p.size);
+                    pos += p.size;
+                }
+                _reassemblyBytes -= r.bytes;
+                _reassemblies.erase(stripeID);
+            }
+        }
+
+        if (!payload) {
+            // Acknowledge the part; the last part to arrive gets the real response.
+            if (!part->noReply()) {
+                MessageBuilder ack(part);
+                ack.addProperty("Stripe-Received"_sl, "1"_sl);
+                part->respond(ack);
+            }
+            return;
+        }
+
+        auto flags = (FrameFlags)(kRequestType | (part->flags() & (kNoReply | kUrgent)));
+        Retained<MessageIn> request = MessageIn::fromPayload(part->_connection, flags,
+                                                             part->number(), payload);
+        if (!request) {
+            part->respondWithError({"BLIP"_sl, 400, "invalid striped request"_sl});
+            return;
+        }
+        request->_connection->dispatchRequest(request);
+    }
+
+
+    // Drops incomplete striped requests whose parts have been waiting too long. (The parts
+    // already received have been acknowledged, so the sender gets a null response.)
+    void ConnectionPool::pruneReassemblies() {
+        auto now = chrono::steady_clock::now();
+        for (auto i = _reassemblies.begin(); i != _reassemblies.end();) {
+            if (i->second.expires <= now) {
+                LogVerbose(BLIPLog, "Dropping incomplete striped request %s (%zu of %zu parts)",
+                           i->first.c_str(), i->second.received, i->second.parts.size());
+                _reassemblyBytes -= i->second.bytes;
+                i = _reassemblies.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+} }
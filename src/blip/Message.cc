@@ -18,9 +18,14 @@
 
 #include "Message.hh"
 #include "MessageOut.hh"
+#include "MessageBatch.hh"
 #include "BLIPConnection.hh"
 #include "BLIPInternal.hh"
 #include "Codec.hh"
+#include "BodyBuffer.hh"
+#include "PropertyTable.hh"
+#include "RelayPipe.hh"
+#include "TransferStore.hh"
 #include "fleece/Fleece.hh"
 #include "Error.hh"
 #include "StringUtil.hh"
@@ -42,14 +47,50 @@ namespace litecore { namespace blip {
     static const size_t kIncomingAckThreshold = 50000;
 
 
+    CompressionStats& CompressionStats::operator+= (const CompressionStats &other) {
+        messages += other.messages;
+        compressedFrames += other.compressedFrames;
+        rawFrames += other.rawFrames;
+        inputBytes += other.inputBytes;
+        outputBytes += other.outputBytes;
+        return *this;
+    }
+
+
     void Message::sendProgress(MessageProgress::State state,
                                MessageSize bytesSent, MessageSize bytesReceived,
                                MessageIn *reply) {
-        if (_onProgress)
+        if (_onProgress && progressDue(state, bytesSent + bytesReceived))
             _onProgress({state, bytesSent, bytesReceived, reply});
     }
 
 
+    // Returns true if a progress notification should be sent now, according to the granularity.
+    bool Message::progressDue(MessageProgress::State state, MessageSize bytes) {
+        if (state != MessageProgress::kSending && state != MessageProgress::kReceivingReply)
+            return true;
+        switch (_progressGranularity.mode) {
+            case ProgressGranularity::kEveryFrame:
+                return true;
+            case ProgressGranularity::kCompletionOnly:
+                return false;
+            case ProgressGranularity::kEveryNBytes:
+                if (bytes < _lastProgressBytes + _progressGranularity.interval)
+                    return false;
+                _lastProgressBytes = bytes;
+                return true;
+            case ProgressGranularity::kEveryNMilliseconds: {
+                auto now = chrono::steady_clock::now();
+                if (now < _lastProgressTime + chrono::milliseconds(_progressGranularity.interval))
+                    return false;
+                _lastProgressTime = now;
+                return true;
+            }
+        }
+        return true;
+    }
+
+
     void Message::disconnected() {
         sendProgress(MessageProgress::kDisconnected, 0, 0, nullptr);
     }
@@ -88,7 +129,7 @@ namespace litecore { namespace blip {
 
     void Message::dump(slice payload, slice body, std::ostream& out) {
         dumpHeader(out);
-        if (type() != kAckRequestType && type() != kAckResponseType) {
+        if (!isControl()) {
             out << " {";
             auto key = (const char*)payload.buf;
             auto end = (const char*)payload.end();
@@ -133,8 +174,14 @@ namespace litecore { namespace blip {
 #pragma mark - MESSAGEIN:
     
 
-    MessageIn::~MessageIn()
-    { }
+    MessageIn::~MessageIn() {
+        if (_batchResponder && !_responded) {
+            // Don't make the rest of the batch wait for a response that will never come:
+            _batchResponder->respondWithError(_batchIndex,
+                                              {"BLIP"_sl, 500, "request was not handled"_sl});
+        }
+        finishedHandling();
+    }
 
 
     MessageIn::MessageIn(Connection *connection, FrameFlags flags, MessageNo n,
@@ -147,12 +194,43 @@ namespace litecore { namespace blip {
     }
 
 
+    MessageIn::MessageIn(Connection *connection, FrameFlags flags, MessageNo n,
+                         alloc_slice properties, alloc_slice body)
+    :Message(flags, n)
+    ,_connection(connection)
+    ,_propertiesSize((uint32_t)properties.size)
+    ,_properties(properties)
+    ,_body(body)
+    ,_complete(true)
+    { }
+
+
+    // Creates a complete MessageIn from a payload as produced by MessageBuilder::finish(), i.e.
+    // a properties-length varint, properties and body. Returns nullptr if it's invalid.
+    Retained<MessageIn> MessageIn::fromPayload(Connection *connection, FrameFlags flags,
+                                               MessageNo n, slice payload)
+    {
+        uint32_t propertiesSize;
+        if (!ReadUVarInt32(&payload, &propertiesSize) || propertiesSize > payload.size)
+            return nullptr;
+        if (propertiesSize > 0 && payload[propertiesSize - 1] != 0)
+            return nullptr;
+        alloc_slice properties(payload.buf, propertiesSize);
+        payload.moveStart(propertiesSize);
+        alloc_slice body;
+        if (payload.size > 0)
+            body = alloc_slice(payload);
+        return new MessageIn(connection, flags, n, properties, body);
+    }
+
+
     MessageIn::ReceiveState MessageIn::receivedFrame(Codec &codec,
                                                      slice frame,
-                                                     FrameFlags frameFlags)
+                                                     FrameFlags frameFlags,
+                                                     PendingProgress &pendingProgress,
+                                                     PropertyDecoder *propertyDecoder)
     {
         ReceiveState state = kOther;
-        MessageSize bodyBytesReceived;
         {
             // First, lock the mutex:
             lock_guard<mutex> lock(_receiveMutex);
@@ -167,12 +245,12 @@ namespace litecore { namespace blip {
             uint8_t checksum[Codec::kChecksumSize];
             auto trailer = (void*)&frame[frame.size - Codec::kChecksumSize];
             memcpy(checksum, trailer, Codec::kChecksumSize);
-            if (mode == Codec::Mode::SyncFlush) {
-                // Replace checksum with the untransmitted deflate empty-block trailer,
+            slice flushTrailer = codec.flushTrailer();
+            if (mode == Codec::Mode::SyncFlush && flushTrailer.size > 0) {
+                // Replace checksum with the untransmitted flush trailer (deflate's empty block),
                 // which is conveniently the same size:
-                static_assert(Codec::kChecksumSize == 4,
-                              "Checksum not same size as deflate trailer");
-                memcpy(trailer, "\x00\x00\xFF\xFF", 4);
+                Assert(flushTrailer.size == Codec::kChecksumSize);
+                memcpy(trailer, flushTrailer.buf, flushTrailer.size);
             } else {
                 // In uncompressed message, just trim off the checksum:
                 frame.setSize(frame.size - Codec::kChecksumSize);
@@ -184,7 +262,7 @@ namespace litecore { namespace blip {
                 // Update my flags and allocate the Writer:
                 DebugAssert(_number > 0);
                 _flags = (FrameFlags)(frameFlags & ~kMoreComing);
-                _in.reset(new fleece::JSONEncoder);
+                _in.reset(new BodyBuffer);
 
                 // Read just a few bytes to get the length of the properties (a varint at the
                 // start of the frame):
@@ -205,7 +283,7 @@ namespace litecore { namespace blip {
                     justFinishedProperties = true;
                 // And anything left over after that becomes the start of the body:
                 if (dst.size > 0)
-                    _in->writeRaw(dst);
+                    _in->write(dst);
             }
 
             if (_propertiesRemaining.size > 0) {
@@ -216,6 +294,10 @@ namespace litecore { namespace blip {
             }
             if (justFinishedProperties) {
                 // Finished reading properties:
+                if (propertyDecoder) {
+                    _properties = propertyDecoder->decode(_properties);
+                    _propertiesSize = (uint32_t)_properties.size;
+                }
                 if (_propertiesSize > 0 && _properties[_propertiesSize - 1] != 0)
                     throw std::runtime_error("message properties not null-terminated");
 #if DEBUG
@@ -228,6 +310,9 @@ namespace litecore { namespace blip {
                 if (_connection->willLog(LogLevel::Verbose))
                     _connection->_logVerbose("Receiving %s", description().c_str());
 
+                if (type() == kRequestType && _connection->_transferStore)
+                    resumeTransfer();
+
                 if (!isError())
                     state = kBeginning;
             }
@@ -240,7 +325,7 @@ namespace litecore { namespace blip {
             slice checksumSlice{checksum, Codec::kChecksumSize};
             codec.readAndVerifyChecksum(checksumSlice);
 
-            bodyBytesReceived = _in->bytesWritten();
+            MessageSize bodyBytesReceived = _in->size();
 
             if (!(frameFlags & kMoreComing)) {
                 // Completed!
@@ -249,21 +334,33 @@ namespace litecore { namespace blip {
                 _body = _in->finish();
                 _in.reset();
                 _complete = true;
+                if (_relay)
+                    _relay->close();
 
                 if (_connection->willLog(LogLevel::Verbose))
                     _connection->_logVerbose("Finished receiving %s", description().c_str());
                 state = kEnd;
             }
+
+            // Get the progress callback, if progress is due, while locked. (This runs on the
+            // connection's decoder thread, while discard() and disconnected() run on its I/O
+            // thread.) After the final state it's cleared, so that's only delivered once.
+            // The caller delivers it, on the I/O thread.
+            // ("kReceivingReply" is somewhat misleading if this isn't a reply.)
+            // Include a pointer to myself when my properties are available, _unless_ I'm an
+            // incomplete error. (We need the error body first since it contains the message.)
+            auto progressState = (state == kEnd) ? MessageProgress::kComplete
+                                                 : MessageProgress::kReceivingReply;
+            if (_onProgress && progressDue(progressState, _outgoingSize + bodyBytesReceived)) {
+                bool includeThis = (state == kEnd || (_properties && !isError()));
+                pendingProgress.callback = (state == kEnd) ? takeProgressCallback()
+                                                           : _onProgress;
+                pendingProgress.progress = {progressState, _outgoingSize, bodyBytesReceived,
+                                            (includeThis ? this : nullptr)};
+            }
         }
         // ...mutex is now unlocked
 
-        // Send progress. ("kReceivingReply" is somewhat misleading if this isn't a reply.)
-        // Include a pointer to myself when my properties are available, _unless_ I'm an
-        // incomplete error. (We need the error body first since it contains the message.)
-        bool includeThis = (state == kEnd || (_properties && !isError()));
-        sendProgress(state == kEnd ? MessageProgress::kComplete : MessageProgress::kReceivingReply,
-                     _outgoingSize, bodyBytesReceived,
-                     (includeThis ? this : nullptr));
         if (state == kEnd)
             Signpost::mark(Signpost::blipReceived, 0, static_cast<uintptr_t>(number()));
         return state;
@@ -272,7 +369,7 @@ namespace litecore { namespace blip {
 
     void MessageIn::acknowledge(uint32_t frameSize) {
         _unackedBytes += frameSize;
-        if (_unackedBytes >= kIncomingAckThreshold) {
+        if (_unackedBytes >= kIncomingAckThreshold && !(_relay && _relay->full())) {
             // Send an ACK after enough data has been received of this message:
             MessageType msgType = isResponse() ? kAckResponseType : kAckRequestType;
             uint8_t buf[kMaxVarintLen64];
@@ -288,14 +385,126 @@ namespace litecore { namespace blip {
     }
 
 
+    // Decodes the frame straight into the spare capacity at the end of _in. A raw frame is
+    // copied once; for a compressed one, room is reserved for a few times its size, so a single
+    // inflate call usually decodes all of it. (If not, _in grows and it goes around again.)
     void MessageIn::readFrame(Codec &codec, int mode, slice &frame, bool finalFrame) {
-        uint8_t buffer[4096];
-        while (frame.size > 0) {
-            slice output {buffer, sizeof(buffer)};
+        static constexpr size_t kExpectedInflateRatio = 4;
+        bool compressed = (Codec::Mode(mode) != Codec::Mode::Raw);
+        size_t reserve = std::max(frame.size, size_t(1));
+        if (compressed)
+            reserve *= kExpectedInflateRatio;
+        // (Some decoders consume input faster than they can output it, so keep going till
+        // they're empty too.)
+        while (frame.size > 0 || (compressed && codec.unflushedBytes() > 0)) {
+            slice output = _in->spare(reserve);
+            auto start = output.buf;
             codec.write(frame, output, Codec::Mode(mode));
-            if (output.buf > buffer)
-                _in->writeRaw(slice(buffer, output.buf));
+            _in->wrote((uint8_t*)output.buf - (uint8_t*)start);
+        }
+        if (_discarding) {
+            _in->clear();
+        } else if (_relay && _in->size() > 0) {
+            _relay->write(_in->contents());
+            _in->clear();
+        }
+    }
+
+
+    // Called when the properties of a request have arrived, if the connection has a
+    // TransferStore. If the request is the continuation of a resumable request, inserts the
+    // saved start of its body ahead of whatever has been received so far.
+    void MessageIn::resumeTransfer() {
+        long offset = intProperty(slice(kTransferOffsetProperty), 0);
+        if (offset <= 0)
+            return;
+        string transferID = property(slice(kTransferIDProperty)).asString();
+        alloc_slice saved = _connection->_transferStore->take(_connection->_peerIdentity,
+                                                              transferID);
+        if (saved.size != (size_t)offset) {
+            // The saved data expired, or doesn't match; the request can't be completed:
+            _connection->warn("Can't resume transfer %s: have %zu bytes of it, not %ld",
+                              transferID.c_str(), saved.size, offset);
+            _resumeFailed = _discarding = true;
+            _in->reset();
+            return;
+        }
+        if (_connection->willLog(LogLevel::Verbose))
+            _connection->_logVerbose("Resuming transfer %s at offset %ld",
+                                     transferID.c_str(), offset);
+        alloc_slice received;
+        if (_in->size() > 0) {
+            received = _in->finish();
         }
+        _in->write(saved);
+        if (received)
+            _in->write(received);
+    }
+
+
+    // Called when the connection closes before the message is complete. Returns the part of
+    // the body received so far (if the properties are complete), so it can be saved.
+    alloc_slice MessageIn::extractPartialBody() {
+        lock_guard<mutex> lock(_receiveMutex);
+        if (_complete || !_in || _propertiesRemaining.size > 0 || _discarding)
+            return {};
+        alloc_slice body = _in->finish();
+        _in.reset();
+        return body;
+    }
+
+
+    // Returns a new complete MessageIn with the same properties and body (shared, not copied),
+    // for another recipient of the same response (see Connection::coalesce.)
+    Retained<MessageIn> MessageIn::copy() {
+        lock_guard<mutex> lock(_receiveMutex);
+        return new MessageIn(_connection, _flags, _number, _properties, _body);
+    }
+
+
+    void MessageIn::abort() {
+        _connection->abort(this);
+    }
+
+
+    // Called when a response doesn't arrive in time, or the message is aborted.
+    // The MessageIn stays registered with the BLIPIO, so that any frames that do arrive can
+    // still be decoded (keeping the codec and property tables in sync), but their data is
+    // thrown away. The progress callback is notified with `state` and then released.
+    void MessageIn::discard(MessageProgress::State state) {
+        MessageProgressCallback onProgress;
+        {
+            lock_guard<mutex> lock(_receiveMutex);
+            _discarding = true;
+            if (_in)
+                _in->reset();
+            if (_relay)
+                _relay->fail();
+            onProgress = takeProgressCallback();
+        }
+        if (onProgress)
+            onProgress({state, _outgoingSize, 0, nullptr});
+    }
+
+
+    // Called when the connection closes before the message is complete.
+    void MessageIn::disconnected() {
+        MessageProgressCallback onProgress;
+        {
+            lock_guard<mutex> lock(_receiveMutex);
+            onProgress = takeProgressCallback();
+        }
+        if (onProgress)
+            onProgress({MessageProgress::kDisconnected, 0, 0, nullptr});
+    }
+
+
+    // Removes and returns the progress callback, when delivering a final state. (Must be
+    // called with _receiveMutex locked.)
+    MessageProgressCallback MessageIn::takeProgressCallback() {
+        MessageProgressCallback onProgress = move(_onProgress);
+        _onProgress = nullptr;
+        return onProgress;
     }
 
 
@@ -305,6 +514,12 @@ namespace litecore { namespace blip {
     }
 
 
+    void MessageIn::setProgressGranularity(ProgressGranularity granularity) {
+        lock_guard<mutex> lock(_receiveMutex);
+        _progressGranularity = granularity;
+    }
+
+
     bool MessageIn::isComplete() const {
         lock_guard<mutex> lock(_receiveMutex);
         return _complete;
@@ -321,6 +536,8 @@ namespace litecore { namespace blip {
 
 
     fleece::Value MessageIn::JSONBody() {
+        if (hasFleeceBody())
+            return fleeceBody();
         lock_guard<mutex> lock(_receiveMutex);
         if (!_bodyAsFleece) {
             if (_body.size == 0)
@@ -333,6 +550,27 @@ namespace litecore { namespace blip {
     }
 
 
+    bool MessageIn::hasFleeceBody() const {
+        return property(slice(kBodyEncodingProperty)) == slice(kFleeceBodyEncoding);
+    }
+
+
+    fleece::Value MessageIn::fleeceBody() {
+        if (!hasFleeceBody())
+            return nullptr;
+        lock_guard<mutex> lock(_receiveMutex);
+        if (!_fleeceValidated && _body.size > 0) {
+            // The body came from the network, so it has to be validated; but that's much
+            // cheaper than parsing JSON, and doesn't allocate. It only needs to be done once.
+            _fleeceRoot = FLValue_FromData({_body.buf, _body.size}, kFLUntrusted);
+            if (!_fleeceRoot)
+                Warn("MessageIn::fleeceBody: Body does not contain valid Fleece");
+            _fleeceValidated = true;
+        }
+        return _fleeceRoot;
+    }
+
+
     alloc_slice MessageIn::extractBody() {
         lock_guard<mutex> lock(_receiveMutex);
         alloc_slice body = _body;
@@ -340,8 +578,10 @@ namespace litecore { namespace blip {
             _body = nullslice;
         } else if (_in) {
             body = _in->finish();
-            _in->reset();
         }
+        // The Fleece root pointed into the body that's now the caller's:
+        _fleeceRoot = nullptr;
+        _fleeceValidated = false;
         return body;
     }
 
@@ -356,13 +596,92 @@ namespace litecore { namespace blip {
         }
         Assert(!_responded);
         _responded = true;
+        finishedHandling();
         if (mb.type == kRequestType)
             mb.type = kResponseType;
+        if (_onRespond && mb.type == kResponseType && !mb.dataSource)
+            _onRespond(mb.finish(), mb.flags());
+        if (_batchResponder) {
+            _batchResponder->respond(_batchIndex, mb);
+            return;
+        }
         Retained<MessageOut> message = new MessageOut(_connection, mb, _number);
         _connection->send(message);
     }
 
 
+    // Called when the request is delivered to its handler; counts it against the admission
+    // controllers' limits until it's responded to (or, if noreply, freed.)
+    void MessageIn::startedHandling() {
+        if (_handlingStarted != chrono::steady_clock::time_point())
+            return;
+        _handlingStarted = chrono::steady_clock::now();
+        _connection->_admission.started();
+        AdmissionController::processWide().started();
+    }
+
+
+    void MessageIn::finishedHandling() {
+        if (_handlingStarted == chrono::steady_clock::time_point())
+            return;
+        auto elapsed = chrono::steady_clock::now() - _handlingStarted;
+        _handlingStarted = {};
+        _connection->_admission.finished(elapsed);
+        AdmissionController::processWide().finished(elapsed);
+    }
+
+
+    // Sends the body to `pipe` instead of storing it: whatever has arrived so far, and then
+    // the rest as it arrives (see Connection::relayRequest.)
+    void MessageIn::startRelay(RelayPipe *pipe) {
+        lock_guard<mutex> lock(_receiveMutex);
+        _relay = pipe;
+        if (_complete) {
+            pipe->write(_body);
+            _body = nullslice;
+            _fleeceRoot = nullptr;
+            _fleeceValidated = false;
+            pipe->close();
+        } else if (_discarding) {
+            pipe->fail();
+        } else if (_in && _in->size() > 0) {
+            pipe->write(_in->finish());
+        }
+    }
+
+
+    // Called by the RelayPipe when it has room again; sends any ACK that was held back.
+    void MessageIn::relayDrained() {
+        lock_guard<mutex> lock(_receiveMutex);
+        if (!_complete)
+            acknowledge(0);
+    }
+
+
+    // Called when the connection closes; tells the relay's reader that no more data will come.
+    void MessageIn::stopRelay() {
+        lock_guard<mutex> lock(_receiveMutex);
+        if (_relay && !_complete)
+            _relay->fail();
+    }
+
+
+    // Sends a response whose payload is already encoded (by ResponseCache.)
+    void MessageIn::respondWithPayload(alloc_slice payload, FrameFlags flags) {
+        Assert(!_responded);
+        _responded = true;
+        finishedHandling();
+        flags = (FrameFlags)((flags & ~kUrgent) | (_flags & kUrgent));
+        if (_batchResponder) {
+            _batchResponder->respond(_batchIndex, (MessageType)(flags & kTypeMask), payload);
+            return;
+        }
+        Retained<MessageOut> message = new MessageOut(_connection, flags, payload, nullptr,
+                                                      _number);
+        _connection->send(message);
+    }
+
+
     void MessageIn::respondWithError(Error err) {
         if (!noReply()) {
             MessageBuilder mb(this);
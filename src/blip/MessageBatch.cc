@@ -0,0 +1,274 @@
+//
+// MessageBatch.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "MessageBatch.hh"
+#include "BLIPInternal.hh"
+#include "Timer.hh"
+#include "Error.hh"
+#include "varint.hh"
+#include <memory>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+
+    // Reads one item (flags, and payload) from a batch body.
+    static bool readItem(slice &body, FrameFlags &flags, slice &payload) {
+        uint64_t flagsInt, size;
+        if (!ReadUVarInt(&body, &flagsInt) || !ReadUVarInt(&body, &size) || size > body.size)
+            return false;
+        flags = (FrameFlags)flagsInt;
+        payload = slice(body.buf, size);
+        body.moveStart(size);
+        return true;
+    }
+
+
+    static void writeItem(MessageBuilder &mb, FrameFlags flags, slice payload) {
+        uint8_t buf[2 * kMaxVarintLen64];
+        size_t n = PutUVarInt(buf, flags);
+        n += PutUVarInt(buf + n, payload.size);
+        mb.write(slice(buf, n));
+        mb.write(payload);
+    }
+
+
+#pragma mark - SENDING:
+
+
+    MessageBatch& MessageBatch::add(MessageBuilder &mb) {
+        Assert(!mb.dataSource);
+        add(mb.finish(), mb.flags(), move(mb.onProgress));
+        return *this;
+    }
+
+
+    void MessageBatch::add(alloc_slice payload, FrameFlags flags, MessageProgressCallback cb) {
+        _size += payload.size;
+        _items.push_back({move(payload), flags, move(cb)});
+    }
+
+
+    // State of a sent batch, shared by its progress callback.
+    struct MessageBatch::Sent {
+        vector<Item> items;
+        bool notifiedSent {false};
+    };
+
+
+    // Creates a MessageIn from a batch item's payload, or returns nullptr if it's invalid.
+    Retained<MessageIn> MessageBatch::newMessage(MessageIn *batch, FrameFlags flags,
+                                                 slice payload)
+    {
+        return MessageIn::fromPayload(batch->_connection, flags, batch->number(), payload);
+    }
+
+
+    // Dispatches a batch's progress notifications to the progress callbacks of its items.
+    void MessageBatch::sentProgress(Sent &batch, const MessageProgress &progress) {
+        auto notify = [](const Item &item, MessageProgress::State state,
+                         MessageIn *reply) {
+            if (item.onProgress)
+                item.onProgress({state, item.payload.size, 0, reply});
+        };
+
+        switch (progress.state) {
+            case MessageProgress::kAwaitingReply:
+            case MessageProgress::kComplete:
+                // Batch has been sent, so the noreply requests are complete:
+                if (!batch.notifiedSent) {
+                    batch.notifiedSent = true;
+                    for (auto &item : batch.items)
+                        if (item.flags & kNoReply)
+                            notify(item, MessageProgress::kComplete, nullptr);
+                }
+                if (progress.state == MessageProgress::kComplete && progress.reply) {
+                    MessageIn *reply = progress.reply;
+                    alloc_slice body = reply->body();
+                    slice in = body;
+                    for (auto &item : batch.items) {
+                        if (item.flags & kNoReply)
+                            continue;
+                        Retained<MessageIn> itemReply = reply;   // an error applies to all
+                        if (!reply->isError()) {
+                            FrameFlags flags;
+                            slice payload;
+                            itemReply = nullptr;
+                            if (readItem(in, flags, payload))
+                                itemReply = newMessage(reply, (FrameFlags)(flags & kTypeMask),
+                                                       payload);
+                            if (!itemReply)
+                                Warn("Invalid response to BLIP batch request #%" PRIu64,
+                                     reply->number());
+                        }
+                        notify(item, (itemReply ? MessageProgress::kComplete
+                                                : MessageProgress::kDisconnected), itemReply);
+                    }
+                }
+                break;
+            case MessageProgress::kDisconnected:
+            case MessageProgress::kTimedOut:
+            case MessageProgress::kAborted:
+                for (auto &item : batch.items) {
+                    if (!(batch.notifiedSent && (item.flags & kNoReply)))
+                        notify(item, progress.state, nullptr);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+
+    // Writes the batch into a MessageBuilder, and clears the batch.
+    void MessageBatch::build(MessageBuilder &mb) {
+        mb.addProperty("Profile"_sl, slice(kBatchProfile));
+        bool noreply = true, urgent = false, compressed = false;
+        for (auto &item : _items) {
+            noreply = noreply && (item.flags & kNoReply);
+            urgent = urgent || (item.flags & kUrgent);
+            compressed = compressed || (item.flags & kCompressed);
+            writeItem(mb, (FrameFlags)(item.flags & (kTypeMask | kNoReply)), item.payload);
+        }
+        mb.noreply = noreply;
+        mb.urgent = urgent;
+        mb.compressed = compressed;
+
+        mb.progressGranularity = ProgressGranularity::kCompletionOnly;
+        auto sent = make_shared<Sent>();
+        sent->items = move(_items);
+        mb.onProgress = [sent](const MessageProgress &progress) {
+            sentProgress(*sent, progress);
+        };
+        reset();
+    }
+
+
+#pragma mark - RECEIVING:
+
+
+    vector<Retained<MessageIn>> MessageBatch::unpack(MessageIn *batch,
+                                                     Retained<BatchResponder> &responder)
+    {
+        vector<Retained<MessageIn>> requests;
+        alloc_slice body = batch->body();
+        slice in = body;
+        size_t replies = 0;
+        while (in.size > 0) {
+            FrameFlags flags;
+            slice payload;
+            Retained<MessageIn> request;
+            if (readItem(in, flags, payload)) {
+                flags = (FrameFlags)(kRequestType | (flags & kNoReply)
+                                                  | (batch->flags() & kUrgent));
+                request = newMessage(batch, flags, payload);
+            }
+            if (!request)
+                throw runtime_error("Invalid BLIP batch request");
+            if (!(flags & kNoReply))
+                request->_batchIndex = replies++;
+            requests.push_back(request);
+        }
+
+        responder = nullptr;
+        if (!batch->noReply()) {
+            responder = new BatchResponder(batch, replies);
+            for (auto &request : requests)
+                if (!request->noReply())
+                    request->_batchResponder = responder;
+        }
+        return requests;
+    }
+
+
+    BatchResponder::BatchResponder(MessageIn *batch, size_t count)
+    :_batch(batch)
+    ,_responses(count)
+    ,_remaining(count)
+    {
+        if (count == 0) {
+            _batch->respond();
+            _batch = nullptr;
+        } else {
+            _timer.reset(new actor::Timer(bind(&BatchResponder::expire, this)));
+            _timer->fireAfter(kTimeout);
+        }
+    }
+
+
+    BatchResponder::~BatchResponder() {
+    }
+
+
+    void BatchResponder::respond(size_t index, MessageBuilder &mb) {
+        Assert(!mb.dataSource);     // batched responses must be built in memory
+        respond(index, mb.type, mb.finish());
+    }
+
+
+    void BatchResponder::respond(size_t index, MessageType type, alloc_slice payload) {
+        lock_guard<mutex> lock(_mutex);
+        if (!_batch)
+            return;     // Too late; the batch's response has already been sent by expire()
+        Assert(index < _responses.size() && !_responses[index].second);
+        _responses[index] = {type, payload};
+        if (--_remaining == 0)
+            sendResponse();
+    }
+
+
+    void BatchResponder::respondWithError(size_t index, Error err) {
+        MessageBuilder mb;
+        mb.makeError(err);
+        respond(index, mb);
+    }
+
+
+    void BatchResponder::expire() {
+        lock_guard<mutex> lock(_mutex);
+        if (!_batch)
+            return;
+        Warn("Handlers didn't respond to %zu of the requests in BLIP batch #%" PRIu64
+             " in time; sending the batch's response without them",
+             _remaining, _batch->number());
+        MessageBuilder mb;
+        mb.makeError({"BLIP"_sl, 504, "batched request timed out"_sl});
+        alloc_slice error = mb.finish();
+        for (auto &r : _responses) {
+            if (!r.second)
+                r = {kErrorType, error};
+        }
+        sendResponse();
+    }
+
+
+    // Sends the batch's response. Must be called with _mutex locked.
+    void BatchResponder::sendResponse() {
+        MessageBuilder response(_batch);
+        for (auto &r : _responses)
+            writeItem(response, (FrameFlags)r.first, r.second);
+        _responses.clear();
+        _remaining = 0;
+        _batch->respond(response);
+        _batch = nullptr;
+        _timer->stop();
+    }
+
+} }
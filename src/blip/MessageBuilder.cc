@@ -17,12 +17,15 @@
 //
 
 #include "MessageBuilder.hh"
+#include "MessageTemplate.hh"
 #include "BLIPInternal.hh"
 #include "Codec.hh"
 #include "Error.hh"
 #include "Logging.hh"
 #include "StringUtil.hh"
 #include "varint.hh"
+#include <algorithm>
+#include <cstring>
 #include <ostream>
 
 using namespace std;
@@ -30,16 +33,62 @@ using namespace fleece;
 
 namespace litecore { namespace blip {
 
+#pragma mark - ARENA POOL:
+
+
+    // Room reserved at the start of the arena for the properties-length varint
+    static constexpr size_t kHeadroom = kMaxVarintLen64;
+
+    // Initial capacity of a new arena; enough for a typical replication message
+    static constexpr size_t kInitialArenaCapacity = 1024;
+
+    // Limits on the per-thread pool of arenas. Arenas that have grown bigger than this
+    // (from building a message with a large body) are freed rather than pooled.
+    static constexpr size_t kMaxPooledArenas = 4;
+    static constexpr size_t kMaxPooledArenaCapacity = 64 * 1024;
+
+    static thread_local vector<vector<uint8_t>> sArenaPool;
+
+
+    static vector<uint8_t> acquireArena() {
+        vector<uint8_t> arena;
+        if (!sArenaPool.empty()) {
+            arena = move(sArenaPool.back());
+            sArenaPool.pop_back();
+        } else {
+            arena.reserve(kInitialArenaCapacity);
+        }
+        arena.resize(kHeadroom);
+        return arena;
+    }
+
+
+    static void releaseArena(vector<uint8_t> &&arena) {
+        if (arena.capacity() > 0 && arena.capacity() <= kMaxPooledArenaCapacity
+                                 && sArenaPool.size() < kMaxPooledArenas) {
+            arena.clear();
+            sArenaPool.push_back(move(arena));
+        }
+    }
+
+
 #pragma mark - MESSAGE BUILDER:
 
     
     MessageBuilder::MessageBuilder(slice profile)
+    :_arena(acquireArena())
+    ,_start(kHeadroom)
     {
         if (profile)
             addProperty("Profile"_sl, profile);
     }
 
 
+    MessageBuilder::~MessageBuilder() {
+        releaseArena(move(_arena));
+    }
+
+
     MessageBuilder::MessageBuilder(MessageIn *inReplyTo)
     :MessageBuilder()
     {
@@ -75,23 +124,30 @@ namespace litecore { namespace blip {
     FrameFlags MessageBuilder::flags() const {
         int flags = type & kTypeMask;
         if (urgent)     flags |= kUrgent;
-        if (compressed) flags |= kCompressed;
+        if (compressed && compressionLevel != 0) flags |= kCompressed;
         if (noreply)    flags |= kNoReply;
         return (FrameFlags)flags;
     }
 
 
+    void MessageBuilder::append(slice data) {
+        auto bytes = (const uint8_t*)data.buf;
+        _arena.insert(_arena.end(), bytes, bytes + data.size);
+    }
+
+
     // Abbreviates certain special strings as a single byte
-    void MessageBuilder::writeTokenizedString(ostream &out, slice str) {
+    void MessageBuilder::writeTokenizedString(slice str) {
         Assert(str.findByte('\0') == nullptr);
-        out << str << '\0';
+        append(str);
+        _arena.push_back(0);
     }
 
 
     MessageBuilder& MessageBuilder::addProperty(slice name, slice value) {
-        DebugAssert(!_wroteProperties);
-        writeTokenizedString(_properties, name);
-        writeTokenizedString(_properties, value);
+        Assert(!_wroteProperties);      // properties must come before the body
+        writeTokenizedString(name);
+        writeTokenizedString(value);
         return *this;
     }
 
@@ -104,40 +160,187 @@ namespace litecore { namespace blip {
 
     void MessageBuilder::finishProperties() {
         if (!_wroteProperties) {
-            string properties = _properties.str();
-            _properties.clear();
-            size_t propertiesSize = properties.size();
+            // Write the properties-length varint into the headroom just before the properties:
+            size_t propertiesSize = _arena.size() - kHeadroom;
             if (propertiesSize > kMaxPropertiesSize)
                 throw std::runtime_error("properties excessively large");
-            char buf[kMaxVarintLen64];
-            slice encodedSize(buf, PutUVarInt(buf, propertiesSize));
-            _out.writeRaw(encodedSize);
-            _out.writeRaw(slice(properties));
+            _start = kHeadroom - SizeOfVarInt(propertiesSize);
+            PutUVarInt(&_arena[_start], propertiesSize);
             _wroteProperties = true;
         }
     }
 
 
+    fleece::JSONEncoder& MessageBuilder::jsonBody() {
+        finishProperties();
+        if (!_jsonOut)
+            _jsonOut.reset(new fleece::JSONEncoder);
+        return *_jsonOut;
+    }
+
+
+    fleece::Encoder& MessageBuilder::fleeceBody() {
+        if (!_fleeceOut) {
+            addProperty(slice(kBodyEncodingProperty), slice(kFleeceBodyEncoding));
+            finishProperties();
+            _fleeceOut.reset(new fleece::Encoder);
+        }
+        return *_fleeceOut;
+    }
+
+
+    // Appends any JSON written to jsonBody() to the body.
+    void MessageBuilder::flushJSON() {
+        if (_jsonOut && _jsonOut->bytesWritten() > 0) {
+            alloc_slice json = _jsonOut->finish();
+            _jsonOut->reset();
+            append(json);
+        }
+    }
+
+
     MessageBuilder& MessageBuilder::write(slice data) {
+        Assert(!_fleeceOut);    // can't append to a Fleece body
         if(!_wroteProperties)
             finishProperties();
-        _out.writeRaw(data);
+        flushJSON();
+        append(data);
         return *this;
     }
 
 
     alloc_slice MessageBuilder::finish() {
         finishProperties();
-        return _out.finish();
+        flushJSON();
+        if (_fleeceOut) {
+            append(_fleeceOut->finish());
+            _fleeceOut.reset();
+        }
+        return alloc_slice(&_arena[_start], _arena.size() - _start);
     }
 
 
     void MessageBuilder::reset() {
         onProgress = nullptr;
-        urgent = compressed = noreply = false;
-        _out.reset();
-        _properties.clear();
+        progressGranularity = {};
+        timeout = {};
+        coalescingKey.clear();
+        urgent = compressed = noreply = coalesceIdentical = false;
+        compressionLevel = -1;
+        compressionStrategy = kDefaultStrategy;
+        if (_jsonOut)
+            _jsonOut->reset();
+        _fleeceOut.reset();
+        _arena.resize(kHeadroom);
+        _start = kHeadroom;
         _wroteProperties = false;
     }
 
+
+
+#pragma mark - MESSAGE TEMPLATE:
+
+
+    MessageTemplateBase::MessageTemplateBase(slice profile, const slice names[], size_t count) {
+        // The encoded form is: [Profile\0<profile>\0] name0\0 (value0) \0name1\0 (value1) ... \0
+        // The segment preceding each value ends at _segmentEnds[i].
+        if (profile) {
+            _encoded.append("Profile\0", 8);
+            _encoded.append((const char*)profile.buf, profile.size);
+            _encoded.push_back('\0');
+        }
+        vector<size_t> nameOffsets;
+        for (size_t i = 0; i < count; ++i) {
+            Assert(names[i] && names[i].findByte('\0') == nullptr);
+            if (i > 0)
+                _encoded.push_back('\0');
+            nameOffsets.push_back(_encoded.size());
+            _encoded.append((const char*)names[i].buf, names[i].size);
+            _encoded.push_back('\0');
+            _segmentEnds.push_back(_encoded.size());
+        }
+        if (count > 0)
+            _encoded.push_back('\0');
+        // Now that _encoded won't be reallocated, point the names into it:
+        for (size_t i = 0; i < count; ++i)
+            _names.emplace_back(&_encoded[nameOffsets[i]], names[i].size);
+    }
+
+
+    void MessageTemplateBase::build(MessageBuilder &builder, const slice values[]) const {
+        DebugAssert(!builder._wroteProperties);
+        auto encoded = _encoded.data();
+        size_t pos = 0;
+        for (size_t i = 0; i < _segmentEnds.size(); ++i) {
+            builder.append(slice(&encoded[pos], _segmentEnds[i] - pos));
+            Assert(values[i].findByte('\0') == nullptr);
+            builder.append(values[i]);
+            pos = _segmentEnds[i];
+        }
+        builder.append(slice(&encoded[pos], _encoded.size() - pos));
+    }
+
+
+    void MessageTemplateBase::read(const MessageIn *msg, slice values[]) const {
+        if (readSlots(msg->_properties, values))
+            return;
+
+        // Otherwise the properties were built some other way, or other properties precede the
+        // template's, so look the names up. Each key is still expected to match the next name;
+        // only if it doesn't is a search needed.
+        // (As in MessageIn::property, using strlen is safe because the properties are known
+        // to end with a zero byte.)
+        const size_t count = _names.size();
+        for (size_t i = 0; i < count; ++i)
+            values[i] = nullslice;
+        auto key = (const char*)msg->_properties.buf;
+        auto end = (const char*)msg->_properties.end();
+        size_t expected = 0;
+        while (key < end) {
+            auto endOfKey = key + strlen(key);
+            auto val = endOfKey + 1;
+            if (val >= end)
+                break;  // illegal: missing value
+            auto endOfVal = val + strlen(val);
+            slice keySlice(key, endOfKey);
+            if (expected < count && keySlice == _names[expected]) {
+                values[expected++] = slice(val, endOfVal);
+            } else {
+                for (size_t i = 0; i < count; ++i) {
+                    if (keySlice == _names[i]) {
+                        values[i] = slice(val, endOfVal);
+                        expected = i + 1;
+                        break;
+                    }
+                }
+            }
+            key = endOfVal + 1;
+        }
+    }
+
+
+    // Reads the values of properties that begin with this template's encoding, as written by
+    // build(): each fixed segment is expected right after the previous value, so it's checked
+    // with one memcmp and the value found with one memchr, without parsing or comparing keys.
+    // Returns false if the properties don't have that layout.
+    bool MessageTemplateBase::readSlots(slice properties, slice values[]) const {
+        auto encoded = _encoded.data();
+        auto p = (const uint8_t*)properties.buf;
+        auto end = (const uint8_t*)properties.end();
+        size_t pos = 0;
+        for (size_t i = 0; i < _segmentEnds.size(); ++i) {
+            size_t segmentSize = _segmentEnds[i] - pos;
+            if (size_t(end - p) < segmentSize || memcmp(p, &encoded[pos], segmentSize) != 0)
+                return false;
+            p += segmentSize;
+            auto endOfVal = (const uint8_t*)memchr(p, 0, end - p);
+            if (!endOfVal)
+                return false;
+            values[i] = slice(p, endOfVal);
+            p = endOfVal;
+            pos = _segmentEnds[i];
+        }
+        return true;
+    }
+
 } }
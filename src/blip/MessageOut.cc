@@ -20,9 +20,12 @@
 #include "BLIPConnection.hh"
 #include "BLIPInternal.hh"
 #include "Codec.hh"
+#include "PropertyTable.hh"
+#include "RelayPipe.hh"
 #include "Error.hh"
 #include "varint.hh"
 #include <algorithm>
+#include <sstream>
 
 using namespace std;
 using namespace fleece;
@@ -44,8 +47,8 @@ namespace litecore { namespace blip {
 
     void MessageOut::nextFrameToSend(Codec &codec, slice &dst, FrameFlags &outFlags) {
         outFlags = flags();
-        if (isAck()) {
-            // Acks have no checksum and don't go through the codec
+        if (isControl()) {
+            // Acks and aborts have no checksum and don't go through the codec
             slice &data = _contents.dataToSend();
             dst.writeFrom(data);
             _bytesSent += (uint32_t)data.size;
@@ -55,8 +58,18 @@ namespace litecore { namespace blip {
         size_t frameSize = dst.size;
         dst.setSize(dst.size - Codec::kChecksumSize);          // Reserve room for checksum at end
 
-        // Write the frame:
-        auto mode = hasFlag(kCompressed) ? Codec::Mode::SyncFlush : Codec::Mode::Raw;
+        // Write the frame, compressing it if it's worthwhile. (The compressed flag applies to
+        // each frame individually; see the BLIP spec, section 3.6.)
+        bool compressible = hasFlag(kCompressed);
+        if (compressible && _bytesSent == 0) {
+            if (const char *profile = findProperty("Profile"); profile)
+                _profile = profile;
+        }
+        bool compress = compressible && shouldCompressFrame(_contents.dataToSend());
+        if (!compress)
+            outFlags = (FrameFlags)(outFlags & ~kCompressed);
+        auto mode = compress ? Codec::Mode::SyncFlush : Codec::Mode::Raw;
+        auto uncompressedBytesBefore = _uncompressedBytesSent;
         do {
             slice &data = _contents.dataToSend();
             if (data.size == 0)
@@ -71,14 +84,18 @@ namespace litecore { namespace blip {
 
         if (mode == Codec::Mode::SyncFlush) {
             size_t bytesWritten = (frameSize - Codec::kChecksumSize) - dst.size;
-            if (bytesWritten > 0) {
-                // SyncFlush always ends the output with the 4 bytes 00 00 FF FF.
-                // We can remove those, then add them when reading the data back in.
-                Assert(bytesWritten >= 4 &&
-                       memcmp((const char*)dst.buf - 4, "\x00\x00\xFF\xFF", 4) == 0);
-                dst.moveStart(-4);
+            slice trailer = codec.flushTrailer();
+            if (bytesWritten > 0 && trailer.size > 0) {
+                // SyncFlush always ends the output with the trailer (for deflate, the 4 bytes
+                // 00 00 FF FF.) We can remove those, then add them when reading the data back in.
+                Assert(bytesWritten >= trailer.size &&
+                       memcmp((const char*)dst.buf - trailer.size, trailer.buf, trailer.size) == 0);
+                dst.moveStart(-(long)trailer.size);
             }
         }
+        if (compressible)
+            recordFrame(compress, _uncompressedBytesSent - uncompressedBytesBefore,
+                        (frameSize - Codec::kChecksumSize) - dst.size);
 
         // Write the checksum:
         dst.setSize(dst.size + Codec::kChecksumSize);           // Undo "Reserve room..." above
@@ -89,17 +106,45 @@ namespace litecore { namespace blip {
         _bytesSent += (uint32_t)frameSize;
         _unackedBytes += (uint32_t)frameSize;
 
-        // Update flags & state:
-        MessageProgress::State state;
-        if (_contents.hasMoreDataToSend()) {
+        // Update flags. (The connection sends the progress notification, on its I/O thread.)
+        if (_contents.hasMoreDataToSend())
             outFlags = (FrameFlags)(outFlags | kMoreComing);
-            state = MessageProgress::kSending;
-        } else if (noReply()) {
-            state = MessageProgress::kComplete;
+    }
+
+
+    // Decides whether to compress the next frame, whose data starts with `data`. Data that's
+    // already compressed (like JPEG) or encrypted won't shrink, so deflating it just wastes CPU.
+    // Such frames are sent raw when a sample of the data has high entropy, and for a few frames
+    // after compressing one didn't pay; then compression is tried again.
+    bool MessageOut::shouldCompressFrame(slice data) {
+        if (_rawFramesBeforeRetry > 0) {
+            --_rawFramesBeforeRetry;
+            return false;
+        }
+        return _compressionStrategy == MessageBuilder::kTextJSON
+            || Codec::worthCompressing(data);
+    }
+
+
+    void MessageOut::recordFrame(bool compressed, size_t inputBytes, size_t outputBytes) {
+        // A compressed frame that saved less than this (as a percentage) didn't pay:
+        static constexpr size_t kMinSavingsPercent = 3;
+        // ...unless it was this small, in which case it proves little:
+        static constexpr size_t kMinSignificantSize = 1024;
+        // Number of frames to send raw after one didn't pay:
+        static constexpr uint8_t kRawFramesBeforeRetry = 8;
+
+        if (compressed) {
+            ++_compressionStats.compressedFrames;
+            if (inputBytes >= kMinSignificantSize
+                    && outputBytes * 100 > inputBytes * (100 - kMinSavingsPercent))
+                _rawFramesBeforeRetry = kRawFramesBeforeRetry;
         } else {
-            state = MessageProgress::kAwaitingReply;
+            ++_compressionStats.rawFrames;
         }
-        sendProgress(state, _uncompressedBytesSent, 0, nullptr);
+        _compressionStats.messages = 1;
+        _compressionStats.inputBytes += inputBytes;
+        _compressionStats.outputBytes += outputBytes;
     }
 
 
@@ -110,17 +155,25 @@ namespace litecore { namespace blip {
 
 
     MessageIn* MessageOut::createResponse() {
-        if (type() != kRequestType || noReply())
+        if (type() != kRequestType || noReply() || _responseCreated.exchange(true))
             return nullptr;
         // Note: The MessageIn's flags will be updated when the 1st frame of the response arrives;
         // the type might become kErrorType, and kUrgent or kCompressed might be set.
-        return new MessageIn(_connection, (FrameFlags)kResponseType, _number,
-                             _onProgress, _uncompressedBytesSent);
+        auto response = new MessageIn(_connection, (FrameFlags)kResponseType, _number,
+                                      _onProgress, _uncompressedBytesSent);
+        // Carry on the request's progress cadence, so the reply's first frame isn't
+        // automatically due (progressDue counts the reply's bytes on top of the request's):
+        response->_progressGranularity = _progressGranularity;
+        response->_lastProgressBytes = _uncompressedBytesSent;
+        response->_lastProgressTime = _lastProgressTime;
+        return response;
     }
 
 
     void MessageOut::disconnected() {
-        if (type() != kRequestType || noReply())
+        _contents.abandonRelay();
+        // (A noreply request that's still queued is reported too, since it was never delivered.)
+        if (type() != kRequestType)
             return;
         Message::disconnected();
     }
@@ -163,13 +216,35 @@ namespace litecore { namespace blip {
     }
 
 
+    // Replaces the properties with an encoded form, to be sent instead.
+    // Must be called before any data is sent.
+    void MessageOut::Contents::encodeProperties(PropertyEncoder &encoder) {
+        slice props, body;
+        getPropsAndBody(props, body);
+        if (!props.buf)
+            return;
+        DebugAssert(_unsentPayload.buf == _payload.buf);
+        alloc_slice encoded = encoder.encode(props);
+        _encodedProperties.reset(kMaxVarintLen64 + encoded.size);
+        slice out = _encodedProperties;
+        WriteUVarInt(&out, encoded.size);
+        out.writeFrom(encoded);
+        _encodedProperties.shorten(_encodedProperties.size - out.size);
+        _unsentEncodedProperties = _encodedProperties;
+        _unsentPayload.setStart(body.buf);
+    }
+
+
     // Returns the next message-body data to send (as a slice _reference_)
     slice& MessageOut::Contents::dataToSend() {
+        if (_unsentEncodedProperties.size > 0)
+            return _unsentEncodedProperties;
+        _encodedProperties.reset();
         if (_unsentPayload.size > 0) {
             return _unsentPayload;
         } else {
             _payload.reset();
-            if (_unsentDataBuffer.size == 0 && _dataSource) {
+            if (_unsentDataBuffer.size == 0 && (_dataSource || _relay)) {
                 readFromDataSource();
                 if (_unsentDataBuffer.size == 0)
                     _dataBuffer.reset();
@@ -181,7 +256,28 @@ namespace litecore { namespace blip {
 
     // Is there more data to send?
     bool MessageOut::Contents::hasMoreDataToSend() const {
-        return _unsentPayload.size > 0 || _unsentDataBuffer.size > 0 || _dataSource != nullptr;
+        return _unsentEncodedProperties.size > 0 || _unsentPayload.size > 0 || _unsentDataBuffer.size > 0 || _dataSource != nullptr || _relay;
+    }
+
+
+    // Is the message waiting for more data from the message it relays?
+    bool MessageOut::Contents::relayStalled() const {
+        return _relay && _unsentEncodedProperties.size == 0 && _unsentPayload.size == 0
+                      && _unsentDataBuffer.size == 0 && _relay->stalled();
+    }
+
+
+    // Stops the relayed message from sending any more data here.
+    void MessageOut::Contents::abandonRelay() {
+        if (_relay) {
+            _relay->fail();
+            _relay = nullptr;
+        }
+    }
+
+
+    bool MessageOut::Contents::relayFailed() const {
+        return _relay && _relay->failed();
     }
 
 
@@ -189,6 +285,14 @@ namespace litecore { namespace blip {
     void MessageOut::Contents::readFromDataSource() {
         if (!_dataBuffer)
             _dataBuffer.reset(kDataBufferSize);
+        if (_relay) {
+            bool eof;
+            size_t bytesRead = _relay->read((void*)_dataBuffer.buf, _dataBuffer.size, eof);
+            _unsentDataBuffer = slice(_dataBuffer.buf, bytesRead);
+            if (eof && !_relay->failed())
+                _relay = nullptr;
+            return;
+        }
         auto bytesWritten = _dataSource((void*)_dataBuffer.buf, _dataBuffer.size);
         _unsentDataBuffer = _dataBuffer.upTo(bytesWritten);
         if (bytesWritten < _dataBuffer.size) {
@@ -18,10 +18,13 @@
 
 #pragma once
 #include "MessageBuilder.hh"
+#include "RelayPipe.hh"
+#include <atomic>
 #include <ostream>
 
 namespace litecore { namespace blip {
     class Codec;
+    class PropertyEncoder;
 
     /** An outgoing message that's been constructed by a MessageBuilder. */
     class MessageOut : public Message {
@@ -29,6 +32,9 @@ namespace litecore { namespace blip {
         friend class MessageIn;
         friend class Connection;
         friend class BLIPIO;
+        friend class FrameEncoder;
+        friend class MessageQueue;
+        friend class TopicShard;
 
         MessageOut(Connection *connection,
                    FrameFlags flags,
@@ -43,9 +49,28 @@ namespace litecore { namespace blip {
         {
             _flags = builder.flags();   // finish() may update the flags, so set them after
             _onProgress = std::move(builder.onProgress);
+            _progressGranularity = builder.progressGranularity;
+            _timeout = builder.timeout;
+            _compressionLevel = builder.compressionLevel;
+            _compressionStrategy = builder.compressionStrategy;
+            // A batch is sent as one message, so a request with settings of its own can't be
+            // auto-batched without losing them; and an urgent one shouldn't wait for a batch:
+            auto granularity = builder.progressGranularity.mode;
+            _batchable = builder.timeout.count() == 0 && !builder.urgent
+                      && builder.compressionLevel < 0
+                      && builder.compressionStrategy == MessageBuilder::kDefaultStrategy
+                      && (granularity == ProgressGranularity::kEveryFrame
+                          || granularity == ProgressGranularity::kCompletionOnly)
+                      && builder.coalescingKey.empty() && !builder.coalesceIdentical;
         }
 
         void dontCompress()                     {_flags = (FrameFlags)(_flags & ~kCompressed);}
+        void encodeProperties(PropertyEncoder &encoder) {_contents.encodeProperties(encoder);}
+        const alloc_slice& payload() const      {return _contents.payload();}
+        bool hasDataSource() const              {return _contents.hasDataSource();}
+        void setRelay(RelayPipe *pipe)          {_contents.setRelay(pipe);}
+        bool relayStalled() const               {return _contents.relayStalled();}
+        bool relayFailed() const                {return _contents.relayFailed();}
         void nextFrameToSend(Codec &codec, slice &dst, FrameFlags &outFlags);
         void receivedAck(uint32_t byteCount);
         bool needsAck()                         {return _unackedBytes >= kMaxUnackedBytes;}
@@ -60,19 +85,32 @@ namespace litecore { namespace blip {
     private:
         static const uint32_t kMaxUnackedBytes = 128000;
 
+        bool shouldCompressFrame(slice data);
+        void recordFrame(bool compressed, size_t inputBytes, size_t outputBytes);
+
         /** Manages the data (properties, body, data source) of a MessageOut. */
         class Contents {
         public:
             Contents(alloc_slice payload, MessageDataSource dataSource);
+            void encodeProperties(PropertyEncoder&);
             slice& dataToSend();
             bool hasMoreDataToSend() const;
             void getPropsAndBody(slice &props, slice &body) const;
+            const alloc_slice& payload() const  {return _payload;}
+            bool hasDataSource() const          {return _dataSource != nullptr || _relay;}
+            void setRelay(RelayPipe *pipe)      {_relay = pipe;}
+            bool relayStalled() const;
+            bool relayFailed() const;
+            void abandonRelay();
         private:
             void readFromDataSource();
 
             alloc_slice _payload;               // Message data (uncompressed)
             slice _unsentPayload;               // Unsent subrange of _payload
+            alloc_slice _encodedProperties;     // Replaces properties at start of _payload
+            slice _unsentEncodedProperties;     // Unsent subrange of _encodedProperties
             MessageDataSource _dataSource;      // Callback that produces more data to send
+            Retained<RelayPipe> _relay;         // Incoming message being relayed, if any
             alloc_slice _dataBuffer;            // Data read from _dataSource
             slice _unsentDataBuffer;            // Unsent subrange of _dataBuffer
         };
@@ -82,6 +120,14 @@ namespace litecore { namespace blip {
         uint32_t _uncompressedBytesSent {0};    // Number of bytes of the data sent so far
         uint32_t _bytesSent {0};                // Number of bytes transmitted (after compression)
         uint32_t _unackedBytes {0};             // Bytes transmitted for which no ack received yet
+        std::chrono::milliseconds _timeout {0}; // Reply timeout (see MessageBuilder::timeout)
+        CompressionStats _compressionStats;     // Totals for my frames, if compressed
+        std::string _profile;                   // My profile, if compressed (for stats)
+        uint8_t _rawFramesBeforeRetry {0};      // Frames to send raw before trying to compress
+        int8_t _compressionLevel {-1};          // Level, or -1 for the connection's
+        MessageBuilder::CompressionStrategy _compressionStrategy {MessageBuilder::kDefaultStrategy};
+        bool _batchable {true};                 // May be auto-batched (see Connection::setBatching)
+        std::atomic<bool> _responseCreated {false}; // Response object exists; it reports progress
     };
 
 } }
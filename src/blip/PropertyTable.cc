@@ -0,0 +1,196 @@
+//
+// PropertyTable.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "PropertyTable.hh"
+#include "BLIPProtocol.hh"
+#include "Error.hh"
+#include <stdexcept>
+#include <string.h>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    enum : uint8_t {
+        kStaticRef = 0x01,
+        kDynamicRef,
+        kDefineLiteral,
+        kEscapedLiteral,
+    };
+
+    // Well-known property keys and values. The index of a string is its position here plus 1.
+    // THIS IS PART OF THE PROTOCOL: strings can be appended, but never removed or reordered.
+    // (Strings shorter than 2 bytes aren't worth including.)
+    static const char* const kStaticTable[] = {
+        // BLIP:
+        "Profile", "Error-Domain", "Error-Code", "BLIP", "HTTP", "Body-Encoding", "fleece",
+        "true", "false",
+        // Couchbase Mobile replication protocol:
+        "getCheckpoint", "setCheckpoint", "subChanges", "changes", "proposeChanges",
+        "rev", "norev", "getAttachment", "proveAttachment", "client", "id", "sequence",
+        "Sequence", "deleted", "history", "since", "continuous", "batch", "activeOnly",
+        "filter", "channels", "docIDs", "revocations", "noconflicts", "deltaSrc", "digest",
+        "maxHistory", "blobs", "noRevs", "versioning", "checkpoint",
+    };
+
+    static constexpr size_t kStaticTableSize = sizeof(kStaticTable) / sizeof(kStaticTable[0]);
+    static_assert(kStaticTableSize < 256, "Static property table is too large");
+
+    // Number of entries in the dynamic table:
+    static constexpr size_t kDynamicTableSize = 128;
+
+    // Strings longer than this are never added to the dynamic table. Values are usually
+    // unique (docIDs, revIDs...), so only short ones are worth adding.
+    static constexpr size_t kMaxDynamicKeySize = 64;
+    static constexpr size_t kMaxDynamicValueSize = 16;
+
+    // Property blocks larger than this don't use the dynamic table, since they might not fit
+    // in a single frame. (The smallest frame has about 4KB of space.)
+    static constexpr size_t kMaxDynamicPropertiesSize = 1024;
+
+
+    static const unordered_map<string_view, uint8_t>& staticIndex() {
+        static const unordered_map<string_view, uint8_t> sIndex = [] {
+            unordered_map<string_view, uint8_t> index;
+            for (size_t i = 0; i < kStaticTableSize; ++i)
+                index.emplace(kStaticTable[i], uint8_t(i + 1));
+            return index;
+        }();
+        return sIndex;
+    }
+
+
+#pragma mark - ENCODER:
+
+
+    PropertyEncoder::PropertyEncoder()
+    :_entries(kDynamicTableSize)
+    {
+        _index.reserve(kDynamicTableSize);
+    }
+
+
+    alloc_slice PropertyEncoder::encode(slice properties) {
+        bool useDynamic = (properties.size <= kMaxDynamicPropertiesSize);
+        string out;
+        out.reserve(properties.size);
+        auto str = (const char*)properties.buf;
+        auto end = (const char*)properties.end();
+        bool isValue = false;
+        while (str < end) {
+            auto endOfStr = (const char*)memchr(str, 0, end - str);
+            Assert(endOfStr);   // MessageBuilder always NUL-terminates
+            writeString(out, slice(str, endOfStr), isValue, useDynamic);
+            str = endOfStr + 1;
+            isValue = !isValue;
+        }
+        return alloc_slice(out.data(), out.size());
+    }
+
+
+    void PropertyEncoder::writeString(string &out, slice str, bool isValue, bool useDynamic) {
+        string_view key((const char*)str.buf, str.size);
+        auto &statics = staticIndex();
+        if (auto i = statics.find(key); i != statics.end()) {
+            out.push_back(kStaticRef);
+            out.push_back(char(i->second));
+            return;
+        }
+
+        if (useDynamic && str.size >= 2) {
+            if (auto i = _index.find(key); i != _index.end()) {
+                out.push_back(kDynamicRef);
+                out.push_back(char(i->second));
+                return;
+            }
+            if (str.size <= (isValue ? kMaxDynamicValueSize : kMaxDynamicKeySize)) {
+                // Add to the dynamic table, evicting the oldest entry:
+                string &entry = _entries[_next];
+                if (!entry.empty())
+                    _index.erase(string_view(entry));
+                entry.assign(key);
+                _index.emplace(string_view(entry), _next);
+                _next = uint8_t((_next + 1) % kDynamicTableSize);
+                out.push_back(kDefineLiteral);
+                out.append(key);
+                out.push_back('\0');
+                return;
+            }
+        }
+
+        if (str.size > 0 && str[0] <= kEscapedLiteral)
+            out.push_back(kEscapedLiteral);
+        out.append(key);
+        out.push_back('\0');
+    }
+
+
+#pragma mark - DECODER:
+
+
+    PropertyDecoder::PropertyDecoder()
+    :_entries(kDynamicTableSize)
+    { }
+
+
+    alloc_slice PropertyDecoder::decode(slice encoded) {
+        string out;
+        out.reserve(2 * encoded.size);
+        auto p = (const uint8_t*)encoded.buf;
+        auto end = (const uint8_t*)encoded.end();
+        while (p < end) {
+            uint8_t tag = *p;
+            if (tag == kStaticRef || tag == kDynamicRef) {
+                if (p + 1 >= end)
+                    throw runtime_error("truncated property token");
+                uint8_t index = p[1];
+                if (tag == kStaticRef) {
+                    if (index == 0 || index > kStaticTableSize)
+                        throw runtime_error("invalid static property token");
+                    out.append(kStaticTable[index - 1]);
+                } else {
+                    if (index >= kDynamicTableSize || _entries[index].empty())
+                        throw runtime_error("invalid dynamic property token");
+                    out.append(_entries[index]);
+                }
+                p += 2;
+            } else {
+                if (tag == kDefineLiteral || tag == kEscapedLiteral)
+                    ++p;
+                auto endOfStr = (const uint8_t*)memchr(p, 0, end - p);
+                if (!endOfStr)
+                    throw runtime_error("message properties not null-terminated");
+                string_view str((const char*)p, endOfStr - p);
+                if (tag == kDefineLiteral) {
+                    if (str.size() < 2 || str.size() > kMaxDynamicKeySize)
+                        throw runtime_error("invalid dynamic property definition");
+                    _entries[_next].assign(str);
+                    _next = uint8_t((_next + 1) % kDynamicTableSize);
+                }
+                out.append(str);
+                p = endOfStr + 1;
+            }
+            out.push_back('\0');
+            if (out.size() > kMaxPropertiesSize)
+                throw runtime_error("properties excessively large");
+        }
+        return alloc_slice(out.data(), out.size());
+    }
+
+} }
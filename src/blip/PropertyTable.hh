@@ -0,0 +1,70 @@
+//
+// PropertyTable.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace litecore { namespace blip {
+
+    /*  Property compression, used when the kPropertyTableExtension has been negotiated.
+        Each string (key or value) in an encoded property block is one of:
+            01 nn           -- entry #nn of the static table of well-known strings
+            02 nn           -- entry #nn of the connection's dynamic table
+            03 <string> 00  -- literal string, which is also added to the dynamic table
+            04 <string> 00  -- literal string that begins with a byte in the range 01...04
+            <string> 00     -- any other literal string
+        Dynamic-table entries are assigned sequentially, wrapping around, in the order in which
+        the receiver decodes them. To keep that order the same on both ends, a property block
+        may only use the dynamic table if it's small enough to be sent in a single frame. */
+
+
+    /** Compresses outgoing property blocks. Not thread-safe; owned by the BLIPIO. */
+    class PropertyEncoder {
+    public:
+        PropertyEncoder();
+
+        /** Encodes a property block (NUL-terminated keys and values.) */
+        fleece::alloc_slice encode(fleece::slice properties);
+
+    private:
+        void writeString(std::string &out, fleece::slice str, bool isValue, bool useDynamic);
+
+        std::vector<std::string> _entries;                      // Dynamic table
+        std::unordered_map<std::string_view, uint8_t> _index;   // Maps _entries to indexes
+        uint8_t _next {0};                                      // Next dynamic index to assign
+    };
+
+
+    /** Expands incoming property blocks. Not thread-safe; owned by the BLIPIO. */
+    class PropertyDecoder {
+    public:
+        PropertyDecoder();
+
+        /** Decodes a property block, returning the standard form. Throws on invalid data. */
+        fleece::alloc_slice decode(fleece::slice encoded);
+
+    private:
+        std::vector<std::string> _entries;                      // Dynamic table
+        uint8_t _next {0};                                      // Next dynamic index to assign
+    };
+
+} }
@@ -0,0 +1,137 @@
+//
+// RelayPipe.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "RelayPipe.hh"
+#include "Message.hh"
+#include <algorithm>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    RelayPipe::RelayPipe(MessageIn *source)
+    :_source(source)
+    { }
+
+
+    RelayPipe::~RelayPipe() =default;
+
+
+    void RelayPipe::setOnAvailable(function<void()> onAvailable) {
+        unique_lock<mutex> lock(_mutex);
+        _onAvailable = move(onAvailable);
+        if (_buffered > 0 || _closed || _failed) {
+            auto callback = _onAvailable;
+            lock.unlock();
+            callback();
+        }
+    }
+
+
+    void RelayPipe::write(slice data) {
+        if (data.size == 0)
+            return;
+        unique_lock<mutex> lock(_mutex);
+        if (_closed || _failed)
+            return;
+        _chunks.emplace_back(data);
+        _buffered += data.size;
+        auto callback = _onAvailable;
+        lock.unlock();
+        if (callback)
+            callback();
+    }
+
+
+    void RelayPipe::close() {
+        unique_lock<mutex> lock(_mutex);
+        _closed = true;
+        ended(lock);
+    }
+
+
+    void RelayPipe::fail() {
+        unique_lock<mutex> lock(_mutex);
+        if (_closed)
+            return;
+        _failed = true;
+        _chunks.clear();
+        _buffered = 0;
+        ended(lock);
+    }
+
+
+    // Notifies the reader one last time, and breaks the reference cycles.
+    void RelayPipe::ended(unique_lock<mutex> &lock) {
+        auto callback = move(_onAvailable);
+        _onAvailable = nullptr;
+        Retained<MessageIn> source = move(_source);
+        _source = nullptr;
+        lock.unlock();
+        if (callback)
+            callback();
+    }
+
+
+    size_t RelayPipe::read(void *buf, size_t capacity, bool &eof) {
+        unique_lock<mutex> lock(_mutex);
+        bool wasFull = (_buffered > kMaxBuffered);
+        size_t n = 0;
+        while (n < capacity && !_chunks.empty()) {
+            slice chunk = _chunks.front();
+            chunk.moveStart(_chunkOffset);
+            size_t count = min(chunk.size, capacity - n);
+            memcpy((uint8_t*)buf + n, chunk.buf, count);
+            n += count;
+            _chunkOffset += count;
+            if (_chunkOffset == _chunks.front().size) {
+                _chunks.pop_front();
+                _chunkOffset = 0;
+            }
+        }
+        _buffered -= n;
+        eof = _chunks.empty() && (_closed || _failed);
+        Retained<MessageIn> source;
+        if (wasFull && _buffered <= kMaxBuffered)
+            source = _source;
+        lock.unlock();
+        if (source)
+            source->relayDrained();     // Send any ACK that was held back
+        return n;
+    }
+
+
+    bool RelayPipe::stalled() const {
+        lock_guard<mutex> lock(_mutex);
+        return _chunks.empty() && !_closed && !_failed;
+    }
+
+
+    bool RelayPipe::failed() const {
+        lock_guard<mutex> lock(_mutex);
+        return _failed;
+    }
+
+
+    bool RelayPipe::full() const {
+        lock_guard<mutex> lock(_mutex);
+        return _buffered > kMaxBuffered;
+    }
+
+} }
@@ -0,0 +1,73 @@
+//
+// RelayPipe.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "RefCounted.hh"
+#include "fleece/slice.hh"
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace litecore { namespace blip {
+    class MessageIn;
+
+    /** Carries the body of an incoming message, as it's decoded, to an outgoing message on
+        another Connection (see Connection::relayRequest.) It's written to on the source
+        connection's I/O thread and read from on the target's, so it's thread-safe.
+
+        Backpressure: while the pipe holds more than kMaxBuffered bytes, the source MessageIn
+        withholds its ACKs, so its sender soon stops sending; as the target reads the data,
+        the ACKs are released. */
+    class RelayPipe : public fleece::RefCounted {
+    public:
+        static constexpr size_t kMaxBuffered = 256 * 1024;
+
+        explicit RelayPipe(MessageIn *source);
+
+        /** Sets a callback to be called (on any thread) when data arrives or the pipe ends. */
+        void setOnAvailable(std::function<void()> onAvailable);
+
+        // Writer side:
+        void write(fleece::slice data);
+        void close();                   // All data has been written
+        void fail();                    // Source failed; no more data will come
+
+        // Reader side:
+        /** Reads up to `capacity` bytes without blocking. Sets `eof` when there's no more. */
+        size_t read(void *buf, size_t capacity, bool &eof);
+        bool stalled() const;           // True if no data is available yet
+        bool failed() const;
+
+        bool full() const;
+
+    protected:
+        virtual ~RelayPipe();
+
+    private:
+        void ended(std::unique_lock<std::mutex>&);
+
+        mutable std::mutex _mutex;
+        fleece::Retained<MessageIn> _source;    // Cleared when the pipe ends
+        std::deque<fleece::alloc_slice> _chunks;
+        size_t _chunkOffset {0};                // Bytes already read from _chunks.front()
+        size_t _buffered {0};
+        bool _closed {false}, _failed {false};
+        std::function<void()> _onAvailable;
+    };
+
+} }
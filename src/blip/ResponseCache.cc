@@ -0,0 +1,157 @@
+//
+// ResponseCache.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "ResponseCache.hh"
+#include "BLIPInternal.hh"
+#include <string_view>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    ResponseCache::ResponseCache(chrono::milliseconds ttl, size_t maxBytes)
+    :_ttl(ttl)
+    ,_maxBytes(maxBytes)
+    { }
+
+
+    // FNV-1a, continuing from the hash `h`
+    static uint64_t fnv1a(uint64_t h, slice data) {
+        for (size_t i = 0; i < data.size; ++i) {
+            h ^= data[i];
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+
+    ResponseCache::Key ResponseCache::keyFor(MessageIn *request) const {
+        // Two independent 64-bit hashes, to make collisions vanishingly unlikely:
+        slice properties = request->_properties, body = request->_body;
+        auto h = hash<string_view>();
+        uint64_t h1 = h(string_view((const char*)properties.buf, properties.size));
+        h1 = h1 * 31 + h(string_view((const char*)body.buf, body.size));
+        uint64_t h2 = fnv1a(fnv1a(0xcbf29ce484222325ull, properties), body);
+        return {h1, h2};
+    }
+
+
+    Connection::RequestHandler ResponseCache::cachingHandler(Connection::RequestHandler handler) {
+        Retained<ResponseCache> self = this;
+        return [self, handler](MessageIn *request) {
+            if (request->noReply()) {
+                handler(request);
+                return;
+            }
+            Key key = self->keyFor(request);
+            if (self->respondFromCache(key, request))
+                return;
+            alloc_slice properties = request->_properties, body = request->_body;
+            request->_onRespond = [self, key, properties, body](alloc_slice payload,
+                                                               FrameFlags flags) {
+                self->store(key, properties, body, payload, flags);
+            };
+            handler(request);
+        };
+    }
+
+
+    bool ResponseCache::respondFromCache(const Key &key, MessageIn *request) {
+        alloc_slice payload;
+        FrameFlags flags;
+        {
+            lock_guard<mutex> lock(_mutex);
+            auto i = _entries.find(key);
+            if (i != _entries.end() && i->second.expires <= clock::now()) {
+                remove(i);
+                ++_evictions;
+                i = _entries.end();
+            }
+            if (i != _entries.end() && (i->second.properties != request->_properties
+                                        || i->second.body != request->_body)) {
+                i = _entries.end();     // Hash collision; not the same request
+            }
+            if (i == _entries.end()) {
+                ++_misses;
+                return false;
+            }
+            ++_hits;
+            _lru.splice(_lru.end(), _lru, i->second.lru);
+            payload = i->second.payload;
+            flags = i->second.flags;
+        }
+        request->respondWithPayload(payload, flags);
+        return true;
+    }
+
+
+    size_t ResponseCache::sizeOf(const Entry &e) {
+        return e.properties.size + e.body.size + e.payload.size;
+    }
+
+
+    void ResponseCache::store(const Key &key, alloc_slice properties, alloc_slice body,
+                              alloc_slice payload, FrameFlags flags)
+    {
+        Entry entry {properties, body, payload, flags, clock::now() + _ttl, {}};
+        if (sizeOf(entry) > _maxBytes)
+            return;
+        lock_guard<mutex> lock(_mutex);
+        auto i = _entries.find(key);
+        if (i != _entries.end())
+            remove(i);
+        _lru.push_back(key);
+        entry.lru = prev(_lru.end());
+        _bytes += sizeOf(entry);
+        _entries[key] = move(entry);
+
+        // Evict least recently used entries while they're expired or the size is too big.
+        // (Other expired entries are removed when they're looked up.)
+        auto now = clock::now();
+        while (!_lru.empty()) {
+            auto e = _entries.find(_lru.front());
+            if (_bytes <= _maxBytes && e->second.expires > now)
+                break;
+            remove(e);
+            ++_evictions;
+        }
+    }
+
+
+    void ResponseCache::remove(unordered_map<Key, Entry, KeyHash>::iterator i) {
+        _bytes -= sizeOf(i->second);
+        _lru.erase(i->second.lru);
+        _entries.erase(i);
+    }
+
+
+    ResponseCache::Stats ResponseCache::stats() const {
+        lock_guard<mutex> lock(_mutex);
+        return {_hits, _misses, _evictions, _entries.size(), _bytes};
+    }
+
+
+    void ResponseCache::clear() {
+        lock_guard<mutex> lock(_mutex);
+        _entries.clear();
+        _lru.clear();
+        _bytes = 0;
+    }
+
+} }
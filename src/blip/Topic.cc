@@ -0,0 +1,191 @@
+//
+// Topic.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "Topic.hh"
+#include "MessageOut.hh"
+#include "BLIPInternal.hh"
+#include "Actor.hh"
+#include "Error.hh"
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    /** Delivers a Topic's messages to a subset of its subscribers. */
+    class TopicShard : public actor::Actor {
+    public:
+        TopicShard(const string &name, shared_ptr<Topic::Counters> counters,
+                   unsigned maxPending, Topic::SlowSubscriberPolicy policy)
+        :Actor(name)
+        ,_counters(counters)
+        ,_maxPending(maxPending)
+        ,_policy(policy)
+        { }
+
+        size_t count() const                    {return _count;}
+
+        void add(Retained<Connection> conn)     {enqueue(&TopicShard::_add, conn);}
+        void remove(Retained<Connection> conn)  {enqueue(&TopicShard::_remove, conn);}
+
+        void publish(alloc_slice payload, FrameFlags flags) {
+            enqueue(&TopicShard::_publish, payload, flags);
+        }
+
+    private:
+        struct Subscriber {
+            Retained<Connection> conn;
+            unsigned pending {0};               // # of my messages in its outbox
+            alloc_slice coalesced;              // Latest message held back, if any
+            FrameFlags coalescedFlags;
+        };
+
+        void _add(Retained<Connection> conn) {
+            _subscribers[conn.get()].conn = conn;
+            _count = _subscribers.size();
+        }
+
+        void _remove(Retained<Connection> conn) {
+            _subscribers.erase(conn.get());
+            _count = _subscribers.size();
+        }
+
+        void _publish(alloc_slice payload, FrameFlags flags) {
+            for (auto i = _subscribers.begin(); i != _subscribers.end(); ) {
+                Subscriber &sub = i->second;
+                auto state = sub.conn->state();
+                if (state != Connection::kConnecting && state != Connection::kConnected) {
+                    i = _subscribers.erase(i);
+                    continue;
+                }
+                if (sub.pending < _maxPending) {
+                    send(sub, payload, flags);
+                } else if (_policy == Topic::kCoalesceMessages) {
+                    if (sub.coalesced)
+                        ++_counters->coalesced;
+                    sub.coalesced = payload;
+                    sub.coalescedFlags = flags;
+                } else {
+                    ++_counters->skipped;
+                }
+                ++i;
+            }
+            _count = _subscribers.size();
+        }
+
+        // Queues a message on a subscriber's connection. The payload is shared, not copied.
+        void send(Subscriber &sub, alloc_slice payload, FrameFlags flags) {
+            ++sub.pending;
+            ++_counters->sent;
+            Retained<MessageOut> msg = new MessageOut(sub.conn, flags, payload, nullptr, 0);
+            msg->_progressGranularity = ProgressGranularity::kCompletionOnly;
+            Retained<TopicShard> self = this;
+            Retained<Connection> conn = sub.conn;
+            msg->_onProgress = [self, conn](const MessageProgress &progress) {
+                if (progress.state >= MessageProgress::kComplete)
+                    self->enqueue(&TopicShard::_sent, conn);
+            };
+            sub.conn->send(msg);
+        }
+
+        // Called when a message has left a subscriber's outbox (or been canceled.)
+        void _sent(Retained<Connection> conn) {
+            auto i = _subscribers.find(conn.get());
+            if (i == _subscribers.end())
+                return;
+            Subscriber &sub = i->second;
+            --sub.pending;
+            if (sub.coalesced && sub.pending < _maxPending)
+                send(sub, move(sub.coalesced), sub.coalescedFlags);
+        }
+
+        shared_ptr<Topic::Counters> const _counters;
+        unsigned const _maxPending;
+        Topic::SlowSubscriberPolicy const _policy;
+        unordered_map<Connection*, Subscriber> _subscribers;
+        atomic<size_t> _count {0};
+    };
+
+
+    Topic::Topic(string name, unsigned maxPendingPerSubscriber, SlowSubscriberPolicy policy)
+    :_name(move(name))
+    ,_counters(make_shared<Counters>())
+    {
+        Assert(maxPendingPerSubscriber > 0);
+        // One shard per scheduler thread, so the fan-out can run on all of them at once:
+        unsigned nShards = max(1u, thread::hardware_concurrency());
+        for (unsigned i = 0; i < nShards; ++i) {
+            _shards.emplace_back(new TopicShard(_name + "#" + to_string(i), _counters,
+                                                maxPendingPerSubscriber, policy));
+        }
+    }
+
+
+    Topic::~Topic() =default;
+
+
+    // Connections are heap blocks, so the low bits of their addresses are always zero (and
+    // std::hash of a pointer is usually just the address); a plain modulus would put most of
+    // them in the same few shards. So mix the bits with a multiplicative (Fibonacci) hash.
+    TopicShard* Topic::shardFor(Connection *conn) const {
+        uint64_t h = (uint64_t(uintptr_t(conn)) >> 4) * 0x9E3779B97F4A7C15ull;
+        return _shards[(h >> 32) % _shards.size()];
+    }
+
+
+    void Topic::subscribe(Connection *conn) {
+        shardFor(conn)->add(conn);
+    }
+
+
+    void Topic::unsubscribe(Connection *conn) {
+        shardFor(conn)->remove(conn);
+    }
+
+
+    size_t Topic::subscriberCount() const {
+        size_t count = 0;
+        for (auto &shard : _shards)
+            count += shard->count();
+        return count;
+    }
+
+
+    void Topic::publish(MessageBuilder &mb) {
+        Assert(!mb.dataSource);
+        mb.noreply = true;
+        alloc_slice payload = mb.finish();
+        FrameFlags flags = mb.flags();
+        mb.reset();
+        ++_counters->published;
+        LogVerbose(BLIPLog, "Topic %s: publishing %zu-byte message",
+                   _name.c_str(), payload.size);
+        for (auto &shard : _shards)
+            shard->publish(payload, flags);
+    }
+
+
+    Topic::Stats Topic::stats() const {
+        return {_counters->published, _counters->sent, _counters->skipped,
+                _counters->coalesced};
+    }
+
+} }
@@ -0,0 +1,84 @@
+//
+// TransferStore.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "TransferStore.hh"
+
+using namespace std;
+using namespace fleece;
+
+namespace litecore { namespace blip {
+
+    TransferStore::TransferStore(clock::duration gracePeriod, size_t maxBytes)
+    :_gracePeriod(gracePeriod)
+    ,_maxBytes(maxBytes)
+    { }
+
+
+    void TransferStore::save(const string &peer, const string &transferID, alloc_slice body) {
+        if (!isValidTransferID(transferID))
+            return;
+        lock_guard<mutex> lock(_mutex);
+        if (body.size > _maxBytes)
+            return;
+        auto &entry = _entries[{peer, transferID}];
+        _totalBytes += body.size - entry.body.size;
+        entry.body = body;
+        entry.expires = clock::now() + _gracePeriod;
+        purge();
+    }
+
+
+    uint64_t TransferStore::savedSize(const string &peer, const string &transferID) {
+        lock_guard<mutex> lock(_mutex);
+        purge();
+        auto i = _entries.find({peer, transferID});
+        return (i != _entries.end()) ? i->second.body.size : 0;
+    }
+
+
+    alloc_slice TransferStore::take(const string &peer, const string &transferID) {
+        lock_guard<mutex> lock(_mutex);
+        purge();
+        auto i = _entries.find({peer, transferID});
+        if (i == _entries.end())
+            return {};
+        alloc_slice body = move(i->second.body);
+        _totalBytes -= body.size;
+        _entries.erase(i);
+        return body;
+    }
+
+
+    // Removes expired entries, then the oldest entries until the total size is within bounds.
+    void TransferStore::purge() {
+        auto now = clock::now();
+        while (true) {
+            auto oldest = _entries.end();
+            for (auto i = _entries.begin(); i != _entries.end(); ++i) {
+                if (oldest == _entries.end() || i->second.expires < oldest->second.expires)
+                    oldest = i;
+            }
+            if (oldest == _entries.end()
+                    || (oldest->second.expires > now && _totalBytes <= _maxBytes))
+                break;
+            _totalBytes -= oldest->second.body.size;
+            _entries.erase(oldest);
+        }
+    }
+
+} }
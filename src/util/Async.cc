@@ -49,8 +49,16 @@ namespace litecore { namespace actor {
     }
 
     void AsyncContext::setObserver(AsyncContext *p) {
-        assert(!_observer);
-        _observer = p;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            assert(!_observer);
+            if (!_ready) {
+                _observer = p;
+                return;
+            }
+        }
+        // The result arrived (on another thread) after the observer checked ready():
+        p->wakeUp(this);
     }
 
     void AsyncContext::start() {
@@ -77,9 +85,16 @@ namespace litecore { namespace actor {
     }
 
     void AsyncContext::_gotResult() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _gotResult(lock);
+    }
+
+    // Marks the result as ready and wakes the observer. Must be called with _mutex locked;
+    // unlocks it before calling the observer.
+    void AsyncContext::_gotResult(std::unique_lock<std::mutex> &lock) {
         _ready = true;
-        auto observer = _observer;
-        _observer = nullptr;
+        fleece::Retained<AsyncContext> observer = std::move(_observer);
+        lock.unlock();
         if (observer)
             observer->wakeUp(this);
         _waitingSelf = nullptr;
@@ -20,6 +20,7 @@
 #include "RefCounted.hh"
 #include <cassert>
 #include <functional>
+#include <mutex>
 
 namespace litecore { namespace actor {
     class Actor;
@@ -129,6 +130,9 @@ namespace litecore { namespace actor {
      on that Actor's execution context. This ensures that the Actor's code runs single-threaded, as
      expected.
 
+     An AsyncProvider's result may be set on a different thread than the one waiting for it. If
+     more than one thread might try to set it, use `trySetResult`, which sets it only once.
+
      */
 
 #define BEGIN_ASYNC_RETURNING(T) \
@@ -181,7 +185,10 @@ namespace litecore { namespace actor {
     // Abstract base class of AsyncProvider<T>.
     class AsyncContext : public fleece::RefCounted, protected AsyncState {
     public:
-        bool ready() const                                  {return _ready;}
+        bool ready() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _ready;
+        }
         void setObserver(AsyncContext *p);
         void wakeUp(AsyncContext *async);
 
@@ -191,9 +198,11 @@ namespace litecore { namespace actor {
         void start();
         void _wait();
         void _gotResult();
+        void _gotResult(std::unique_lock<std::mutex>&);
 
         virtual void next() =0;
 
+        mutable std::mutex _mutex;                          // Guards _ready, _observer, result
         bool _ready {false};                                // True when result is ready
         fleece::Retained<AsyncContext> _observer;           // Dependent context waiting on me
         Actor *_actor;                                      // Owning actor, if any
@@ -229,17 +238,30 @@ namespace litecore { namespace actor {
         }
 
         void setResult(const T &result) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            assert(!_ready);
+            _result = result;
+            _gotResult(lock);
+        }
+
+        /** Sets the result, unless it's already been set; returns true if it set it.
+            Use this if there's a chance that more than one thread may set the result. */
+        bool trySetResult(const T &result) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_ready)
+                return false;
             _result = result;
-            _gotResult();
+            _gotResult(lock);
+            return true;
         }
 
         const T& result() const {
-            assert(_ready);
+            assert(ready());
             return _result;
         }
 
         T&& extractResult() {
-            assert(_ready);
+            assert(ready());
             return std::move(_result);
         }
 
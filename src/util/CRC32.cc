@@ -0,0 +1,299 @@
+//
+// CRC32.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "CRC32.hh"
+#include <zlib.h>
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define CRC32_PCLMUL 1
+    #include <immintrin.h>
+    #define CRC32_TARGET __attribute__((target("pclmul,sse4.1")))
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+    #define CRC32_ARM 1
+    #include <arm_acle.h>
+    #if defined(__clang__)
+        #define CRC32_TARGET __attribute__((target("crc")))
+    #else
+        #define CRC32_TARGET __attribute__((target("+crc")))
+    #endif
+    #if !defined(__ARM_FEATURE_CRC32) && defined(__linux__)
+        #include <sys/auxv.h>
+        #include <asm/hwcap.h>
+    #endif
+#endif
+
+namespace litecore { namespace blip {
+
+    // Scalar fallback: zlib's own implementation. (Its length parameter is only 32 bits.)
+    static uint32_t zlibCRC(uint32_t crc, const uint8_t *data, size_t size) noexcept {
+        while (size > 0) {
+            auto n = (uInt)std::min(size, size_t(UINT_MAX));
+            crc = (uint32_t)::crc32(crc, data, n);
+            data += n;
+            size -= n;
+        }
+        return crc;
+    }
+
+
+    static uint32_t scalarUpdate(uint32_t crc, const uint8_t *data, size_t size) noexcept {
+        return zlibCRC(crc, data, size);
+    }
+
+
+    static uint32_t scalarCopy(uint32_t crc, uint8_t *dst, const uint8_t *src,
+                               size_t size) noexcept
+    {
+        // Copy a chunk at a time, and checksum each chunk while it's still in the L1 cache.
+        static constexpr size_t kChunkSize = 8192;
+        while (size > 0) {
+            size_t n = std::min(size, kChunkSize);
+            memcpy(dst, src, n);
+            crc = zlibCRC(crc, dst, n);
+            dst += n;
+            src += n;
+            size -= n;
+        }
+        return crc;
+    }
+
+
+#if CRC32_PCLMUL
+
+    // Folds 64-byte blocks in parallel using carry-less multiplication, as described in
+    // Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+    // (Gopal et al, 2009), then reduces to 32 bits with a Barrett reduction. The constants
+    // are the bit-reflected ones for the zlib polynomial 0x04C11DB7, from that paper.
+    // `size` must be a multiple of 16 and at least 64; `crc` is in the un-inverted domain.
+    // If `Copy` is true, the data is also stored to `dst` as it's loaded.
+
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t kPoly[] = {0x01db710641, 0x01f7011641};
+
+    static constexpr size_t kMinPclmulSize = 64;
+
+    template <bool Copy>
+    CRC32_TARGET
+    static inline __m128i load(const uint8_t *buf, uint8_t *dst, size_t offset) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + offset));
+        if (Copy)
+            _mm_storeu_si128((__m128i*)(dst + offset), x);
+        return x;
+    }
+
+    template <bool Copy>
+    CRC32_TARGET
+    static uint32_t pclmulFold(uint32_t crc, uint8_t *dst, const uint8_t *buf, size_t size) {
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+        x1 = load<Copy>(buf, dst, 0x00);
+        x2 = load<Copy>(buf, dst, 0x10);
+        x3 = load<Copy>(buf, dst, 0x20);
+        x4 = load<Copy>(buf, dst, 0x30);
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+        x0 = _mm_load_si128((const __m128i*)k1k2);
+        buf += 64;
+        dst += 64;
+        size -= 64;
+
+        // Fold 64-byte blocks into the four accumulators:
+        while (size >= 64) {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+            x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+            x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), load<Copy>(buf, dst, 0x00));
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), load<Copy>(buf, dst, 0x10));
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), load<Copy>(buf, dst, 0x20));
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), load<Copy>(buf, dst, 0x30));
+            buf += 64;
+            dst += 64;
+            size -= 64;
+        }
+
+        // Fold the accumulators into one:
+        x0 = _mm_load_si128((const __m128i*)k3k4);
+        for (__m128i next : {x2, x3, x4}) {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+        }
+
+        // Fold any remaining 16-byte blocks:
+        while (size >= 16) {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, load<Copy>(buf, dst, 0)), x5);
+            buf += 16;
+            dst += 16;
+            size -= 16;
+        }
+
+        // Fold 128 bits to 64:
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+        x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, x3);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        // Barrett reduction to 32 bits:
+        x0 = _mm_load_si128((const __m128i*)kPoly);
+        x2 = _mm_and_si128(x1, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        return (uint32_t)_mm_extract_epi32(x1, 1);
+    }
+
+
+    static uint32_t pclmulUpdate(uint32_t crc, const uint8_t *data, size_t size) noexcept {
+        if (size >= kMinPclmulSize) {
+            size_t n = size & ~size_t(15);
+            crc = ~pclmulFold<false>(~crc, const_cast<uint8_t*>(data), data, n);
+            data += n;
+            size -= n;
+        }
+        return zlibCRC(crc, data, size);
+    }
+
+
+    static uint32_t pclmulCopy(uint32_t crc, uint8_t *dst, const uint8_t *src,
+                               size_t size) noexcept
+    {
+        if (size >= kMinPclmulSize) {
+            size_t n = size & ~size_t(15);
+            crc = ~pclmulFold<true>(~crc, dst, src, n);
+            dst += n;
+            src += n;
+            size -= n;
+        }
+        memcpy(dst, src, size);
+        return zlibCRC(crc, dst, size);
+    }
+
+
+    static bool hardwareSupported() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    }
+
+    #define hardwareUpdate  pclmulUpdate
+    #define hardwareCopy    pclmulCopy
+
+#elif CRC32_ARM
+
+    // The ARMv8 CRC32 instructions use the zlib polynomial, and process 8 bytes at a time.
+    // `crc` is in the un-inverted domain. If `Copy` is true, the data is also stored to `dst`.
+    template <bool Copy>
+    CRC32_TARGET
+    static uint32_t armCRC(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size) {
+        while (size >= 8) {
+            uint64_t word;
+            memcpy(&word, src, 8);
+            if (Copy) {
+                memcpy(dst, &word, 8);
+                dst += 8;
+            }
+            crc = __crc32d(crc, word);
+            src += 8;
+            size -= 8;
+        }
+        while (size > 0) {
+            if (Copy)
+                *dst++ = *src;
+            crc = __crc32b(crc, *src++);
+            --size;
+        }
+        return crc;
+    }
+
+
+    static uint32_t armUpdate(uint32_t crc, const uint8_t *data, size_t size) noexcept {
+        return ~armCRC<false>(~crc, const_cast<uint8_t*>(data), data, size);
+    }
+
+
+    static uint32_t armCopy(uint32_t crc, uint8_t *dst, const uint8_t *src,
+                            size_t size) noexcept
+    {
+        return ~armCRC<true>(~crc, dst, src, size);
+    }
+
+
+    static bool hardwareSupported() {
+    #if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+        return true;            // Every Apple arm64 CPU has it
+    #elif defined(__linux__)
+        return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+    #else
+        return false;
+    #endif
+    }
+
+    #define hardwareUpdate  armUpdate
+    #define hardwareCopy    armCopy
+
+#else
+
+    static bool hardwareSupported()     {return false;}
+
+    #define hardwareUpdate  scalarUpdate
+    #define hardwareCopy    scalarCopy
+
+#endif
+
+
+    using UpdateFn = uint32_t (*)(uint32_t, const uint8_t*, size_t) noexcept;
+    using CopyFn   = uint32_t (*)(uint32_t, uint8_t*, const uint8_t*, size_t) noexcept;
+
+    struct Implementation {
+        UpdateFn update;
+        CopyFn copy;
+    };
+
+    static const Implementation& implementation() {
+        static const Implementation sImpl = hardwareSupported()
+                                                ? Implementation{hardwareUpdate, hardwareCopy}
+                                                : Implementation{scalarUpdate, scalarCopy};
+        return sImpl;
+    }
+
+
+    uint32_t crc32Update(uint32_t crc, const void *data, size_t size) noexcept {
+        return implementation().update(crc, (const uint8_t*)data, size);
+    }
+
+
+    uint32_t crc32Copy(uint32_t crc, void *dst, const void *src, size_t size) noexcept {
+        return implementation().copy(crc, (uint8_t*)dst, (const uint8_t*)src, size);
+    }
+
+} }
@@ -0,0 +1,35 @@
+//
+// CRC32.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace litecore { namespace blip {
+
+    /** Updates a CRC32 checksum with `size` bytes of data. This computes exactly the same
+        function as zlib's `crc32` (the same polynomial and pre/post conditioning), so the
+        initial value is 0, but uses the CPU's carry-less-multiply (x86 PCLMULQDQ) or CRC32
+        (ARMv8) instructions when they're available at runtime. */
+    uint32_t crc32Update(uint32_t crc, const void *data, size_t size) noexcept;
+
+    /** Copies `size` bytes from `src` to `dst` (which must not overlap), and returns the CRC32
+        of the bytes updated from `crc`. This makes one pass over the data instead of two. */
+    uint32_t crc32Copy(uint32_t crc, void *dst, const void *src, size_t size) noexcept;
+
+} }
@@ -21,11 +21,16 @@
 
 
 #include "Codec.hh"
+#include "CRC32.hh"
+#include "ZstdCodec.hh"
 #include "Error.hh"
 #include "Logging.hh"
 #include "Endian.hh"
 #include <algorithm>
+#include <cmath>
+#include <map>
 #include <mutex>
+#include <ctype.h>
 
 namespace litecore { namespace blip {
     using namespace fleece;
@@ -40,20 +45,28 @@ namespace litecore { namespace blip {
 
     // "The memLevel parameter specifies how much memory should be allocated for the internal
     // compression state." Default is 8; we bump it to 9, which uses 256KB.
+    // (In all, deflate uses (1 << (windowBits+2)) + (1 << (memLevel+9)) bytes, i.e. 384KB.)
     static constexpr int kZlibDeflateMemLevel = 9;
 
+    // Smallest values deflateInit2 accepts for raw deflate:
+    static constexpr int kZlibMinWindowSize = 9, kZlibMinMemLevel = 1;
+
+
+    // Flushing a deflate stream always ends the output with an empty stored block:
+    static constexpr uint8_t kDeflateTrailer[4] = {0x00, 0x00, 0xFF, 0xFF};
+
 
     LogDomain Zip("Zip", LogLevel::Warning);
 
 
     Codec::Codec()
     :Logging(Zip)
-    ,_checksum((uint32_t)crc32(0, nullptr, 0))    // the required initial value
+    ,_checksum(0)                   // the required initial value
     { }
 
 
     void Codec::addToChecksum(slice data) {
-        _checksum = (uint32_t)crc32(_checksum, (const Bytef*)data.buf, (int)data.size);
+        _checksum = crc32Update(_checksum, data.buf, data.size);
     }
 
     void Codec::writeChecksum(slice &output) const {
@@ -79,8 +92,7 @@ namespace litecore { namespace blip {
         logInfo("Copying %zu bytes into %zu-byte buf (no compression)", input.size, output.size);
         Assert(output.size > 0);
         size_t count = std::min(input.size, output.size);
-        addToChecksum({input.buf, count});
-        memcpy((void*)output.buf, input.buf, count);
+        _checksum = crc32Copy(_checksum, (void*)output.buf, input.buf, count);
         input.moveStart(count);
         output.moveStart(count);
     }
@@ -120,26 +132,85 @@ namespace litecore { namespace blip {
 #pragma mark - DEFLATER:
 
 
-    Deflater::Deflater(CompressionLevel level)
+    Deflater::Deflater(CompressionLevel level, ContextParams params)
     :ZlibCodec(::deflate)
-    {
+    ,_level(level)
+    ,_params(params)
+    { }
+
+
+    Deflater::~Deflater() {
+        if (_initialized)
+            ::deflateEnd(&_z);
+    }
+
+
+    // Allocates the zlib context, when there's first something to compress.
+    void Deflater::init() {
+        int windowBits = kZlibWindowSize, memLevel = kZlibDeflateMemLevel;
+        if (_params.windowBits > 0)
+            windowBits = std::min(std::max(int(_params.windowBits), kZlibMinWindowSize),
+                                  kZlibWindowSize);
+        if (_params.memLevel > 0)
+            memLevel = std::min(std::max(int(_params.memLevel), kZlibMinMemLevel),
+                                int(MAX_MEM_LEVEL));
         check(::deflateInit2(&_z,
-                             level,
+                             _level,
                              Z_DEFLATED,
-                             kZlibWindowSize * (kZlibRawDeflate ? -1 : 1),
-                             kZlibDeflateMemLevel,
-                             Z_DEFAULT_STRATEGY));
+                             windowBits * (kZlibRawDeflate ? -1 : 1),
+                             memLevel,
+                             _strategy));
+        _initialized = true;
+        logVerbose("Initialized deflate context (level %d, windowBits %d, memLevel %d)",
+                   _level, windowBits, memLevel);
+        if (_dictionary) {
+            check(::deflateSetDictionary(&_z, (const Bytef*)_dictionary.buf,
+                                         (uInt)_dictionary.size));
+            _dictionary = nullslice;
+        }
     }
 
 
-    Deflater::~Deflater() {
-        ::deflateEnd(&_z);
+    void Deflater::setParams(CompressionLevel level, Strategy strategy) {
+        if (level == _level && strategy == _strategy)
+            return;
+        if (!_initialized) {
+            _level = level;                 // init() will use these
+            _strategy = strategy;
+            return;
+        }
+        // deflateParams first compresses any pending input with the old level; there is none,
+        // since everything's been flushed, but it still needs valid buffers to look at.
+        uint8_t scratch[16];
+        _z.next_in = nullptr;
+        _z.avail_in = 0;
+        _z.next_out = scratch;
+        _z.avail_out = sizeof(scratch);
+        check(::deflateParams(&_z, level, strategy));
+        Assert(_z.avail_out == sizeof(scratch));
+        logVerbose("Compression level changed from %d to %d, strategy %d to %d",
+                   _level, level, _strategy, strategy);
+        _level = level;
+        _strategy = strategy;
+    }
+
+
+    void Deflater::setDictionary(alloc_slice dictionary) {
+        Assert(!_initialized);
+        _dictionary = dictionary;           // init() will apply it
+    }
+
+
+    slice Deflater::flushTrailer() const {
+        return {kDeflateTrailer, sizeof(kDeflateTrailer)};
     }
 
 
     void Deflater::write(slice &input, slice &output, Mode mode) {
         if (mode == Mode::Raw)
             return _writeRaw(input, output);
+        if (!_initialized)
+            init();
 
         slice origInput = input;
         size_t origOutputSize = output.size;
@@ -192,6 +263,8 @@ namespace litecore { namespace blip {
 
 
     unsigned Deflater::unflushedBytes() const {
+        if (!_initialized)
+            return 0;
 #ifdef __APPLE__
         // zlib's deflatePending() is only available in iOS 10+ / macOS 10.12+,
         // even though <zlib.h> claims it's available in iOS 8 / macOS 10.10. (#471)
@@ -209,24 +282,81 @@ namespace litecore { namespace blip {
     }
 
 
+    // Sample size, as a number of runs of consecutive bytes, spread across the data:
+    static constexpr size_t kEntropySampleRuns = 4, kEntropySampleRunSize = 256;
+    static constexpr size_t kEntropySampleSize = kEntropySampleRuns * kEntropySampleRunSize;
+
+    // Entropy (bits per byte) above which data is judged not worth compressing. Text and JSON
+    // are typically 4-6; compressed or encrypted data is close to 8, and samples of it this
+    // size come out around 7.8.
+    static constexpr double kIncompressibleEntropy = 7.2;
+
+
+    bool Codec::worthCompressing(slice data) {
+        if (data.size < kEntropySampleSize)
+            return true;    // Too small to judge, and cheap to compress anyway
+        uint32_t counts[256] = { };
+        size_t stride = (data.size - kEntropySampleRunSize) / (kEntropySampleRuns - 1);
+        for (size_t run = 0; run < kEntropySampleRuns; ++run) {
+            auto bytes = (const uint8_t*)data.buf + run * stride;
+            for (size_t i = 0; i < kEntropySampleRunSize; ++i)
+                ++counts[bytes[i]];
+        }
+        double entropy = 0.0;
+        for (uint32_t count : counts) {
+            if (count > 0) {
+                double p = double(count) / kEntropySampleSize;
+                entropy -= p * std::log2(p);
+            }
+        }
+        return entropy < kIncompressibleEntropy;
+    }
+
+
 #pragma mark - INFLATER:
 
 
     Inflater::Inflater()
     :ZlibCodec(::inflate)
-    {
+    { }
+
+
+    Inflater::~Inflater() {
+        if (_initialized)
+            ::inflateEnd(&_z);
+    }
+
+
+    // Allocates the zlib context, when there's first something to decompress. The window has
+    // to be the maximum size, since the peer's deflater may use that.
+    void Inflater::init() {
         check(::inflateInit2(&_z, kZlibRawDeflate ? (-kZlibWindowSize) : (kZlibWindowSize + 32)));
+        _initialized = true;
+        logVerbose("Initialized inflate context");
+        if (_dictionary) {
+            check(::inflateSetDictionary(&_z, (const Bytef*)_dictionary.buf,
+                                         (uInt)_dictionary.size));
+            _dictionary = nullslice;
+        }
     }
 
 
-    Inflater::~Inflater() {
-        ::inflateEnd(&_z);
+    void Inflater::setDictionary(alloc_slice dictionary) {
+        Assert(!_initialized);
+        _dictionary = dictionary;           // init() will apply it
+    }
+
+
+    slice Inflater::flushTrailer() const {
+        return {kDeflateTrailer, sizeof(kDeflateTrailer)};
     }
 
 
     void Inflater::write(slice &input, slice &output, Mode mode) {
         if (mode == Mode::Raw)
             return _writeRaw(input, output);
+        if (!_initialized)
+            init();
 
         logInfo("Decompressing %zu bytes into %zu-byte buf", input.size, output.size);
         auto outStart = (uint8_t*)output.buf;
@@ -239,4 +369,78 @@ namespace litecore { namespace blip {
                    (int)((uint8_t*)output.buf - outStart), outStart);
     }
 
+
+
+#pragma mark - CODEC REGISTRY:
+
+
+    namespace {
+        struct CodecFactories {
+            CodecRegistry::EncoderFactory newEncoder;
+            CodecRegistry::DecoderFactory newDecoder;
+        };
+    }
+
+    static std::mutex sRegistryMutex;
+
+
+    static std::map<std::string, CodecFactories, std::less<>>& codecRegistry() {
+        static std::map<std::string, CodecFactories, std::less<>> sRegistry = {
+            {CodecRegistry::kDeflate, {
+                [](Codec::CompressionLevel level, Codec::ContextParams params) {
+                    return std::make_unique<Deflater>(level, params); },
+                []() {return std::make_unique<Inflater>();} }},
+#if BLIP_ZSTD
+            {CodecRegistry::kZstd, {
+                [](Codec::CompressionLevel level, Codec::ContextParams params) {
+                    return std::make_unique<ZstdEncoder>(level, params); },
+                []() {return std::make_unique<ZstdDecoder>();} }},
+#endif
+        };
+        return sRegistry;
+    }
+
+
+    static CodecFactories codecNamed(slice name) {
+        std::lock_guard<std::mutex> lock(sRegistryMutex);
+        auto &reg = codecRegistry();
+        auto i = reg.find(std::string_view((const char*)name.buf, name.size));
+        if (i == reg.end())
+            error::_throw(error::InvalidParameter, "Unknown codec '%.*s'", SPLAT(name));
+        return i->second;
+    }
+
+
+    void CodecRegistry::registerCodec(const std::string &name,
+                                      EncoderFactory newEncoder, DecoderFactory newDecoder)
+    {
+        if (name.empty() || !newEncoder || !newDecoder)
+            error::_throw(error::InvalidParameter);
+        for (char c : name) {
+            if (!isalnum(c) && c != '.' && c != '_')
+                error::_throw(error::InvalidParameter);
+        }
+        std::lock_guard<std::mutex> lock(sRegistryMutex);
+        codecRegistry()[name] = {newEncoder, newDecoder};
+    }
+
+
+    bool CodecRegistry::has(slice name) {
+        std::lock_guard<std::mutex> lock(sRegistryMutex);
+        auto &reg = codecRegistry();
+        return reg.find(std::string_view((const char*)name.buf, name.size)) != reg.end();
+    }
+
+
+    std::unique_ptr<Codec> CodecRegistry::newEncoder(slice name, Codec::CompressionLevel level,
+                                                     Codec::ContextParams params)
+    {
+        return codecNamed(name).newEncoder(level, params);
+    }
+
+
+    std::unique_ptr<Codec> CodecRegistry::newDecoder(slice name) {
+        return codecNamed(name).newDecoder();
+    }
+
 } }
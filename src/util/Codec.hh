@@ -20,6 +20,9 @@
 #include "fleece/slice.hh"
 #include "fleece/Fleece.hh"
 #include "Logging.hh"
+#include <functional>
+#include <memory>
+#include <string>
 #include <zlib.h>
 
 namespace litecore { namespace blip {
@@ -33,6 +36,27 @@ namespace litecore { namespace blip {
         Codec();
         virtual ~Codec() { }
 
+        /** Compression levels are on deflate's scale; other codecs map them onto their own. */
+        enum CompressionLevel : int8_t {
+            NoCompression       =  0,
+            FastestCompression  =  1,
+            BestCompression     =  9,
+            DefaultCompression  = -1,
+        };
+        enum Strategy : int8_t {
+            DefaultStrategy     = Z_DEFAULT_STRATEGY,
+            Filtered            = Z_FILTERED,
+            HuffmanOnly         = Z_HUFFMAN_ONLY,
+            RLE                 = Z_RLE,
+        };
+
+        /** Memory parameters of an encoder's compression context; zero means the default.
+            Smaller values use less memory but compress less well. */
+        struct ContextParams {
+            int8_t windowBits {0};  // Base-2 log of the history window size (deflate: 9-15)
+            int8_t memLevel {0};    // Size of the match-finding state (deflate: 1-9)
+        };
+
         // See https://zlib.net/manual.html#Basic for info about modes
         enum class Mode : int {
             Raw = -1,               // not a zlib mode; means copy bytes w/o compression
@@ -57,6 +81,27 @@ namespace litecore { namespace blip {
             the output yet for lack of space. */
         virtual unsigned unflushedBytes() const         {return 0;}
 
+        /** The bytes that output flushed with SyncFlush always ends with, if any, e.g. deflate's
+            empty stored block `00 00 FF FF`. The sender of a frame strips them, and the receiver
+            appends them again before decoding it. */
+        virtual slice flushTrailer() const              {return fleece::nullslice;}
+
+        /** The compression level of an encoder (DefaultCompression if it doesn't have one.) */
+        virtual CompressionLevel level() const          {return DefaultCompression;}
+
+        /** Changes an encoder's compression level and strategy, affecting data written from
+            now on. Must be called between flushes, i.e. when unflushedBytes() is zero.
+            Codecs ignore parameters they don't support. */
+        virtual void setParams(CompressionLevel, Strategy =DefaultStrategy)  { }
+
+        /** Primes the context with a preset dictionary (see CompressionDictionary), as though
+            its contents had preceded the data. Must be called before anything is written. */
+        virtual void setDictionary(fleece::alloc_slice) { }
+
+        /** Estimates whether compressing `data` will make it significantly smaller, from the
+            entropy of a sample of its bytes. Already-compressed or encrypted data won't be. */
+        static bool worthCompressing(slice data);
+
         static constexpr size_t kChecksumSize = 4;
 
         /** Writes the codec's current checksum to the output slice.
@@ -75,7 +120,9 @@ namespace litecore { namespace blip {
     };
 
 
-    /** Abstract base class of Zlib-based codecs Deflater and Inflater */
+    /** Abstract base class of Zlib-based codecs Deflater and Inflater. The zlib context, which
+        is most of their memory, isn't allocated until data is first compressed/decompressed;
+        raw (uncompressed) writes only need the checksum. */
     class ZlibCodec : public Codec {
     protected:
         using FlateFunc = int (*)(z_stream*, int);
@@ -90,26 +137,34 @@ namespace litecore { namespace blip {
 
         mutable ::z_stream _z { };
         FlateFunc const _flate;
+        fleece::alloc_slice _dictionary;    // Preset dictionary to apply when initialized
+        bool _initialized {false};          // Has the zlib context been allocated?
     };
 
 
     /** Compressing codec that performs a zlib/gzip "deflate". */
     class Deflater : public ZlibCodec {
     public:
-        enum CompressionLevel : int8_t {
-            NoCompression       =  0,
-            FastestCompression  =  1,
-            BestCompression     =  9,
-            DefaultCompression  = -1,
-        };
-        Deflater(CompressionLevel = DefaultCompression);
+        Deflater(CompressionLevel = DefaultCompression, ContextParams = {});
         ~Deflater();
 
+        CompressionLevel level() const override         {return _level;}
+        Strategy strategy() const                       {return _strategy;}
+
+        void setParams(CompressionLevel, Strategy =DefaultStrategy) override;
+        void setDictionary(fleece::alloc_slice) override;
+        slice flushTrailer() const override;
+
         void write(slice &input, slice &output, Mode =Mode::Default) override;
         unsigned unflushedBytes() const override;
 
     private:
+        void init();
         void _writeAndFlush(slice &input, slice &output);
+
+        CompressionLevel _level;
+        Strategy _strategy {DefaultStrategy};
+        ContextParams const _params;
     };
 
 
@@ -119,7 +174,38 @@ namespace litecore { namespace blip {
         Inflater();
         ~Inflater();
 
+        void setDictionary(fleece::alloc_slice) override;
+        slice flushTrailer() const override;
+
         void write(slice &input, slice &output, Mode =Mode::Default) override;
+
+    private:
+        void init();
+    };
+
+
+    /** Process-wide registry of the compression formats a connection can negotiate, by name:
+        "deflate" (the default), "zstd" if built with BLIP_ZSTD, and any an app registers.
+        The methods are thread-safe. */
+    class CodecRegistry {
+    public:
+        using EncoderFactory = std::function<std::unique_ptr<Codec>(Codec::CompressionLevel,
+                                                                    Codec::ContextParams)>;
+        using DecoderFactory = std::function<std::unique_ptr<Codec>()>;
+
+        static constexpr const char *kDeflate = "deflate";
+        static constexpr const char *kZstd = "zstd";
+
+        /** Registers a codec. Its name may contain only letters, digits, '.' and '_'. */
+        static void registerCodec(const std::string &name, EncoderFactory, DecoderFactory);
+
+        /** True if a codec with this name is registered. */
+        static bool has(fleece::slice name);
+
+        /** Creates a codec; throws InvalidParameter if there's none with that name. */
+        static std::unique_ptr<Codec> newEncoder(fleece::slice name, Codec::CompressionLevel,
+                                                 Codec::ContextParams = {});
+        static std::unique_ptr<Codec> newDecoder(fleece::slice name);
     };
 
 } }
@@ -0,0 +1,235 @@
+//
+// ZstdCodec.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+// For zstd API documentation, see: https://facebook.github.io/zstd/zstd_manual.html
+
+
+#include "ZstdCodec.hh"
+
+#if BLIP_ZSTD
+
+#include "Error.hh"
+#include <algorithm>
+#include <zstd.h>
+
+namespace litecore { namespace blip {
+    using namespace fleece;
+
+
+    // Base-2 log of the window size. 128KB is plenty for BLIP messages, and the decoder's
+    // memory use is proportional to it; a peer that uses a bigger window is rejected.
+    // (An encoder may be configured to use a smaller one.)
+    static constexpr int kZstdWindowLog = 17, kZstdMinWindowLog = 10;
+
+    // Base-2 log of the encoder's hash and chain table sizes (in entries), relative to the window.
+    static constexpr int kZstdTableLogBelowWindow = 2;
+
+    // zstd levels corresponding to deflate levels 0-9. (zstd's own default is 3.)
+    static constexpr int kZstdLevels[10] = {1, 1, 1, 2, 2, 3, 3, 5, 8, 12};
+
+    // A flushed zstd block holding n bytes of input (n < 128KB) is at most this much bigger
+    // than n: a 3-byte block header, and up to 18 bytes of frame header if it's the first.
+    // ZSTD_COMPRESSBOUND adds a larger margin; this is derived from it.
+    static constexpr size_t kFlushHeadroom = 96;
+
+
+    static int zstdLevel(Codec::CompressionLevel level) {
+        if (level < 0)
+            return ZSTD_CLEVEL_DEFAULT;
+        return kZstdLevels[std::min(int(level), int(Codec::BestCompression))];
+    }
+
+
+    static size_t check(size_t result) {
+        if (ZSTD_isError(result))
+            error::_throw(error::CorruptData, "zstd error: %s", ZSTD_getErrorName(result));
+        return result;
+    }
+
+
+#pragma mark - ENCODER:
+
+
+    ZstdEncoder::ZstdEncoder(CompressionLevel level, ContextParams params)
+    :_level(level)
+    ,_params(params)
+    { }
+
+
+    ZstdEncoder::~ZstdEncoder() {
+        ZSTD_freeCCtx(_ctx);
+    }
+
+
+    // Allocates the zstd context, when there's first something to compress.
+    void ZstdEncoder::init() {
+        _ctx = ZSTD_createCCtx();
+        if (!_ctx)
+            throw std::bad_alloc();
+        int windowLog = kZstdWindowLog;
+        if (_params.windowBits > 0)
+            windowLog = std::min(std::max(int(_params.windowBits), kZstdMinWindowLog),
+                                 kZstdWindowLog);
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_compressionLevel, zstdLevel(_level)));
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_windowLog, windowLog));
+        // The higher levels' match-finder tables are sized for multi-megabyte windows, and
+        // would take up to 40MB per connection; tables the size of the window do as well here.
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_hashLog, windowLog - kZstdTableLogBelowWindow));
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_chainLog, windowLog - kZstdTableLogBelowWindow));
+        // BLIP frames have their own CRC32, and the stream's length isn't known:
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_checksumFlag, 0));
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_contentSizeFlag, 0));
+        check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_dictIDFlag, 0));
+        if (_dictionary) {
+            check(ZSTD_CCtx_loadDictionary(_ctx, _dictionary.buf, _dictionary.size));
+            _dictionary = nullslice;
+        }
+        logVerbose("Initialized zstd compression context (level %d, windowLog %d)",
+                   zstdLevel(_level), windowLog);
+    }
+
+
+    void ZstdEncoder::setParams(CompressionLevel level, Strategy) {
+        // (zstd's strategies don't correspond to deflate's, so the strategy is ignored.)
+        if (zstdLevel(level) != zstdLevel(_level) && _ctx) {
+            logVerbose("Compression level changed from %d to %d", _level, level);
+            _levelChanged = true;
+        }
+        _level = level;
+    }
+
+
+    void ZstdEncoder::setDictionary(alloc_slice dictionary) {
+        Assert(!_ctx);
+        _dictionary = dictionary;           // init() will apply it
+    }
+
+
+    void ZstdEncoder::write(slice &input, slice &output, Mode mode) {
+        if (mode == Mode::Raw)
+            return _writeRaw(input, output);
+        if (!_ctx)
+            init();
+
+        slice origInput = input;
+        size_t origOutputSize = output.size;
+        logInfo("Compressing %zu bytes into %zu-byte buf", input.size, origOutputSize);
+
+        switch (mode) {
+            case Mode::NoFlush:
+                compress(input, output, ZSTD_e_continue);
+                break;
+            case Mode::SyncFlush:
+                if (output.size <= kFlushHeadroom)
+                    break;
+                if (_levelChanged) {
+                    // End the frame (this emits an empty last block), then start a new one at
+                    // the new level. The dictionary is sticky, so the new frame uses it too.
+                    slice none;
+                    compress(none, output, ZSTD_e_end);
+                    Assert(_unflushed == 0);
+                    check(ZSTD_CCtx_reset(_ctx, ZSTD_reset_session_only));
+                    check(ZSTD_CCtx_setParameter(_ctx, ZSTD_c_compressionLevel,
+                                                 zstdLevel(_level)));
+                    _levelChanged = false;
+                    if (output.size <= kFlushHeadroom)
+                        break;
+                }
+                // The flush has to complete within `output`, or the frame couldn't be decoded
+                // on its own; so write only as much input as is certain to fit, compressed:
+                compress(input, output, ZSTD_e_flush,
+                         (output.size - kFlushHeadroom) / 256 * 255);
+                break;
+            default:
+                error::_throw(error::InvalidParameter);
+        }
+
+        logInfo("    compressed %zu bytes to %zu (%.0f%%), %u unflushed",
+            (origInput.size-input.size), (origOutputSize-output.size),
+            (origOutputSize-output.size) * 100.0 / (origInput.size-input.size),
+            unflushedBytes());
+    }
+
+
+    void ZstdEncoder::compress(slice &input, slice &output, int endOp, size_t maxInput) {
+        ZSTD_inBuffer in = {input.buf, std::min(input.size, maxInput), 0};
+        ZSTD_outBuffer out = {(void*)output.buf, output.size, 0};
+        size_t remaining = check(ZSTD_compressStream2(_ctx, &out, &in,
+                                                      ZSTD_EndDirective(endOp)));
+        logInfo("    ZSTD_compressStream2(in %zu, out %zu, op %d)-> %zu; read %zu bytes, "
+                "wrote %zu bytes", in.size, out.size, endOp, remaining, in.pos, out.pos);
+        addToChecksum({input.buf, in.pos});
+        input.moveStart(in.pos);
+        output.moveStart(out.pos);
+        _unflushed = (unsigned)remaining;
+    }
+
+
+#pragma mark - DECODER:
+
+
+    ZstdDecoder::ZstdDecoder()
+    { }
+
+
+    ZstdDecoder::~ZstdDecoder() {
+        ZSTD_freeDCtx(_ctx);
+    }
+
+
+    // Allocates the zstd context, when there's first something to decompress.
+    void ZstdDecoder::init() {
+        _ctx = ZSTD_createDCtx();
+        if (!_ctx)
+            throw std::bad_alloc();
+        check(ZSTD_DCtx_setParameter(_ctx, ZSTD_d_windowLogMax, kZstdWindowLog));
+        if (_dictionary) {
+            check(ZSTD_DCtx_loadDictionary(_ctx, _dictionary.buf, _dictionary.size));
+            _dictionary = nullslice;
+        }
+        logVerbose("Initialized zstd decompression context");
+    }
+
+
+    void ZstdDecoder::setDictionary(alloc_slice dictionary) {
+        Assert(!_ctx);
+        _dictionary = dictionary;           // init() will apply it
+    }
+
+
+    void ZstdDecoder::write(slice &input, slice &output, Mode mode) {
+        if (mode == Mode::Raw)
+            return _writeRaw(input, output);
+        if (!_ctx)
+            init();
+
+        logInfo("Decompressing %zu bytes into %zu-byte buf", input.size, output.size);
+        ZSTD_inBuffer in = {input.buf, input.size, 0};
+        ZSTD_outBuffer out = {(void*)output.buf, output.size, 0};
+        check(ZSTD_decompressStream(_ctx, &out, &in));
+        addToChecksum({output.buf, out.pos});
+        logDebug("    decompressed %zu bytes: %.*s", out.pos, (int)out.pos, (char*)output.buf);
+        input.moveStart(in.pos);
+        output.moveStart(out.pos);
+        _outputFull = (out.pos == out.size);
+    }
+
+} }
+
+#endif // BLIP_ZSTD
@@ -0,0 +1,83 @@
+//
+// ZstdCodec.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "Codec.hh"
+
+#if BLIP_ZSTD
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+namespace litecore { namespace blip {
+
+    /** Compressing codec that writes a Zstandard stream (RFC 8878). The connection's data is a
+        single zstd frame; each SyncFlush ends a block, so every BLIP frame decodes completely.
+        zstd can't change the level in mid-frame, so after setParams changes it the current
+        frame is ended and a new one begun, which loses the compression history.
+        Like the zlib codecs, the zstd contexts aren't allocated until they're first needed. */
+    class ZstdEncoder : public Codec {
+    public:
+        explicit ZstdEncoder(CompressionLevel = DefaultCompression, ContextParams = {});
+        ~ZstdEncoder();
+
+        CompressionLevel level() const override         {return _level;}
+        void setParams(CompressionLevel, Strategy =DefaultStrategy) override;
+        void setDictionary(fleece::alloc_slice) override;
+
+        void write(slice &input, slice &output, Mode =Mode::Default) override;
+        unsigned unflushedBytes() const override        {return _unflushed;}
+
+    private:
+        void init();
+        void compress(slice &input, slice &output, int endOp, size_t maxInput =SIZE_MAX);
+
+        ZSTD_CCtx_s* _ctx {nullptr};
+        CompressionLevel _level;
+        ContextParams const _params;
+        fleece::alloc_slice _dictionary;    // Preset dictionary to apply when initialized
+        unsigned _unflushed {0};            // Bytes left in the context after the last write
+        bool _levelChanged {false};         // Must end the frame before writing more
+    };
+
+
+    /** Decompressing codec that reads a stream written by ZstdEncoder. */
+    class ZstdDecoder : public Codec {
+    public:
+        ZstdDecoder();
+        ~ZstdDecoder();
+
+        void setDictionary(fleece::alloc_slice) override;
+
+        void write(slice &input, slice &output, Mode =Mode::Default) override;
+
+        /** zstd doesn't say how much decoded data it's holding, so this is 1 if the last write
+            filled the output (and there may be more), else 0. */
+        unsigned unflushedBytes() const override        {return _outputFull;}
+
+    private:
+        void init();
+
+        ZSTD_DCtx_s* _ctx {nullptr};
+        fleece::alloc_slice _dictionary;    // Preset dictionary to apply when initialized
+        bool _outputFull {false};
+    };
+
+} }
+
+#endif // BLIP_ZSTD
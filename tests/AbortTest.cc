@@ -0,0 +1,110 @@
+//
+// AbortTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+
+using namespace blip_test;
+
+
+// The receiver of a large request aborts it as soon as its properties arrive. Returns the
+// number of bytes the sender sent; checks that the request is never delivered as complete,
+// and that the connection still works afterwards.
+static uint64_t sendAbortedRequest(const std::string &protocol, bool expectAborted) {
+    static constexpr size_t kBodySize = 8 * 1024 * 1024;
+    PairOptions opts;
+    opts.protocol = protocol;
+    LoopbackPair pair(opts);
+    pair.serverDelegate.onBeginning = [](MessageIn *request) {
+        if (request->property("Profile"_sl) == "upload"_sl)
+            request->abort();
+    };
+
+    uint64_t bytesBefore = pair.clientSocket->bytesSent;
+    MessageBuilder msg("upload"_sl);
+    msg << replicationLikeBody(kBodySize);
+    Latch done;
+    MessageProgress::State finalState = MessageProgress::kQueued;
+    msg.onProgress = [&](const MessageProgress &progress) {
+        if (progress.state >= MessageProgress::kComplete) {
+            finalState = progress.state;
+            done.countDown();
+        }
+    };
+    pair.client->sendRequest(msg);
+
+    if (expectAborted) {
+        CHECK(done.wait());
+        CHECK(finalState == MessageProgress::kAborted);
+    } else {
+        // Without the extension the sender finishes sending, and then gets no reply; so wait
+        // for all of it to be sent:
+        CHECK(waitUntil([&]{return pair.clientSocket->bytesSent - bytesBefore >= kBodySize;}));
+    }
+    uint64_t bytesSent = pair.clientSocket->bytesSent - bytesBefore;
+
+    // The aborted request mustn't have been delivered, and the connection must still work:
+    MessageBuilder echo("echo"_sl);
+    echo << "still alive"_sl;
+    Retained<MessageIn> reply = sendAndWait(pair.client, echo);
+    CHECK(reply && reply->body() == "still alive"_sl);
+    CHECK(pair.serverDelegate.requestsReceived == 1);
+    pair.close();       // (before `done` goes away, since the upload may still be waiting)
+    return bytesSent;
+}
+
+
+BLIP_TEST(abortStopsSender) {
+    uint64_t withAbort = sendAbortedRequest(Connection::protocolName(
+                                                        Connection::kAbortExtension), true);
+    uint64_t withoutAbort = sendAbortedRequest(Connection::kWSProtocolName, false);
+    CHECK(withAbort < withoutAbort);
+    logBenchmark("Abort: bytes sent of an 8MB request, with ABORT", double(withAbort), "bytes");
+    logBenchmark("Abort: bytes sent of an 8MB request, without", double(withoutAbort), "bytes");
+}
+
+
+// A response that's aborted after some of it has arrived must not break the connection
+// when its remaining frames (already in transit) arrive.
+BLIP_TEST(abortResponseInTransit) {
+    PairOptions opts;
+    opts.protocol = Connection::protocolName(Connection::kAbortExtension);
+    opts.latency = actor::delay_t(0.020);
+    LoopbackPair pair(opts);
+
+    MessageBuilder msg("echo"_sl);
+    msg << replicationLikeBody(2 * 1024 * 1024);
+    Latch done;
+    MessageProgress::State finalState = MessageProgress::kQueued;
+    msg.onProgress = [&](const MessageProgress &progress) {
+        if (progress.state == MessageProgress::kReceivingReply && progress.reply)
+            progress.reply->abort();
+        else if (progress.state >= MessageProgress::kComplete) {
+            finalState = progress.state;
+            done.countDown();
+        }
+    };
+    pair.client->sendRequest(msg);
+    CHECK(done.wait());
+    CHECK(finalState == MessageProgress::kAborted);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));   // let in-transit frames land
+    MessageBuilder echo("echo"_sl);
+    echo << "still alive"_sl;
+    Retained<MessageIn> reply = sendAndWait(pair.client, echo);
+    CHECK(reply && reply->body() == "still alive"_sl);
+}
@@ -0,0 +1,69 @@
+//
+// AdmissionTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+
+using namespace blip_test;
+
+
+// Sends a large request to a server that's already handling as many requests as it allows.
+// Returns the number of bytes the client sent; checks that the reply is a 503 with Retry-After.
+static uint64_t sendShedRequest(const std::string &protocol) {
+    static constexpr size_t kBodySize = 8 * 1024 * 1024;
+    PairOptions opts;
+    opts.protocol = protocol;
+    opts.serverOptions = [](Encoder &enc) {
+        enc.writeKey(slice(Connection::kMaxHandlingRequestsOption));
+        enc.writeInt(1);
+    };
+    LoopbackPair pair(opts);
+    Retained<MessageIn> held;
+    Latch holding;
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        held = request;             // never responds, so the server stays at its limit
+        holding.countDown();
+    };
+    MessageBuilder first("hold"_sl);
+    pair.client->sendRequest(first);
+    CHECK(holding.wait());
+
+    uint64_t bytesBefore = pair.clientSocket->bytesSent;
+    MessageBuilder big("upload"_sl);
+    big << replicationLikeBody(kBodySize);
+    Retained<MessageIn> reply = sendAndWait(pair.client, big);
+    CHECK(reply && reply->isError());
+    if (reply) {
+        CHECK(reply->getError().code == 503);
+        CHECK(reply->intProperty("Retry-After"_sl) > 0);
+    }
+    uint64_t bytesSent = pair.clientSocket->bytesSent - bytesBefore;
+    CHECK(pair.serverDelegate.requestsReceived == 1);
+    held->respond();
+    return bytesSent;
+}
+
+
+// With the abort extension, a shed request is rejected as soon as it starts to arrive.
+BLIP_TEST(shedRequestRejectedEarly) {
+    uint64_t early = sendShedRequest(Connection::protocolName(Connection::kAbortExtension));
+    uint64_t late = sendShedRequest(Connection::kWSProtocolName);
+    CHECK(early < late / 2);
+    logBenchmark("Admission: bytes sent of a shed 8MB request, with ABORT", double(early),
+                 "bytes");
+    logBenchmark("Admission: bytes sent of a shed 8MB request, without", double(late), "bytes");
+}
@@ -0,0 +1,56 @@
+//
+// AsyncTest.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "Async.hh"
+
+using namespace blip_test;
+
+
+// Results set on one thread while another starts waiting must never be missed, and
+// trySetResult must set a result only once even when threads race to set it.
+BLIP_TEST(asyncResultsAcrossThreads) {
+    static constexpr int kCount = 20000;
+    std::vector<Retained<AsyncProvider<int>>> providers;
+    for (int i = 0; i < kCount; ++i)
+        providers.push_back(Async<int>::provider());
+
+    std::atomic<int> setCount {0};
+    auto setter = [&] {
+        for (int i = 0; i < kCount; ++i) {
+            if (providers[i]->trySetResult(i))
+                ++setCount;
+        }
+    };
+    std::thread setter1(setter), setter2(setter);
+
+    std::atomic<int> received {0}, wrong {0};
+    for (int i = 0; i < kCount; ++i) {
+        Async<int>(providers[i]).wait([&, i](int result) {
+            if (result != i)
+                ++wrong;
+            ++received;
+        });
+    }
+    setter1.join();
+    setter2.join();
+
+    CHECK(waitUntil([&]{return received == kCount;}, std::chrono::seconds(10)));
+    CHECK(setCount == kCount);
+    CHECK(wrong == 0);
+}
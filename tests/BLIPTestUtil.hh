@@ -0,0 +1,309 @@
+//
+// BLIPTestUtil.hh
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "LoopbackProvider.hh"
+#include "BLIPConnection.hh"
+#include "MessageBuilder.hh"
+#include "Actor.hh"
+#include "Logging.hh"
+#include "Stopwatch.hh"
+#include "fleece/Fleece.hh"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Minimal test support for bliptest: tests register themselves with BLIP_TEST, and main()
+// (in BLIPTest.cc) runs them in order. Most tests run over a LoopbackPair, two Connections
+// joined by in-process WebSockets, on the shared Scheduler's threads.
+
+namespace blip_test {
+    using namespace litecore;
+    using namespace litecore::actor;
+    using namespace litecore::blip;
+    using namespace litecore::websocket;
+    using namespace fleece;
+
+
+#pragma mark - TEST REGISTRY:
+
+
+    struct TestCase {
+        const char *name;
+        void (*fn)();
+    };
+
+    inline std::vector<TestCase>& testCases() {
+        static std::vector<TestCase> sTests;
+        return sTests;
+    }
+
+    struct RegisterTest {
+        RegisterTest(const char *name, void (*fn)())    {testCases().push_back({name, fn});}
+    };
+
+    #define BLIP_TEST(NAME) \
+        static void NAME(); \
+        static blip_test::RegisterTest NAME##_registration(#NAME, NAME); \
+        static void NAME()
+
+    inline std::atomic<int>& failureCount() {
+        static std::atomic<int> sFailures {0};
+        return sFailures;
+    }
+
+    inline void checkFailed(const char *expr, const char *file, int line) {
+        ++failureCount();
+        Warn("CHECK FAILED: %s  (%s:%d)", expr, file, line);
+    }
+
+    #define CHECK(COND) ((COND) ? (void)0 : blip_test::checkFailed(#COND, __FILE__, __LINE__))
+
+
+    /** Logs a benchmark result in a consistent format, so runs can be compared. */
+    inline void logBenchmark(const char *what, double value, const char *units) {
+        Log("BENCHMARK  %-50s %12.3f %s", what, value, units);
+    }
+
+
+#pragma mark - WAITING:
+
+
+    /** Lets a test wait for callbacks made on other threads. */
+    class Latch {
+    public:
+        explicit Latch(int count =1)                    :_count(count) { }
+
+        void countDown() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_count > 0 && --_count == 0)
+                _cond.notify_all();
+        }
+
+        /** Waits until countDown() has been called `count` times; returns false on timeout. */
+        bool wait(std::chrono::milliseconds timeout = std::chrono::seconds(30)) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _cond.wait_for(lock, timeout, [&]{return _count == 0;});
+        }
+
+        void reset(int count) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _count = count;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        int _count;
+    };
+
+
+    /** Polls `condition` until it's true; returns false on timeout. */
+    template <class FN>
+    bool waitUntil(FN condition, std::chrono::milliseconds timeout = std::chrono::seconds(30)) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!condition()) {
+            if (std::chrono::steady_clock::now() >= deadline)
+                return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return true;
+    }
+
+
+#pragma mark - LOOPBACK CONNECTIONS:
+
+
+    /** A LoopbackWebSocket that counts the bytes sent through it. */
+    class CountingWebSocket : public LoopbackWebSocket {
+    public:
+        CountingWebSocket(const URL &url, Role role, actor::delay_t latency)
+        :LoopbackWebSocket(url, role, latency)
+        { }
+
+        virtual bool send(fleece::slice msg, bool binary) override {
+            bytesSent += msg.size;
+            ++framesSent;
+            return LoopbackWebSocket::send(msg, binary);
+        }
+
+        std::atomic<uint64_t> bytesSent {0};
+        std::atomic<uint64_t> framesSent {0};
+    };
+
+
+    /** ConnectionDelegate that calls `onRequest` for incoming requests (by default, echoing
+        them), and `onBeginning` when they start to arrive; and lets a test wait for the
+        connection to open and close. */
+    class TestDelegate : public ConnectionDelegate {
+    public:
+        std::function<void(MessageIn*)> onRequest, onBeginning;
+        Latch connected, closed;
+        std::atomic<int> requestsReceived {0};
+        Connection::CloseStatus closeStatus;
+
+        virtual void onConnect() override {
+            connected.countDown();
+        }
+
+        virtual void onClose(Connection::CloseStatus status, Connection::State) override {
+            closeStatus = status;
+            closed.countDown();
+        }
+
+        virtual void onRequestBeginning(MessageIn *request) override {
+            if (onBeginning)
+                onBeginning(request);
+        }
+
+        virtual void onRequestReceived(MessageIn *request) override {
+            ++requestsReceived;
+            if (onRequest) {
+                onRequest(request);
+            } else if (!request->noReply()) {
+                MessageBuilder reply(request);
+                reply << request->body();
+                request->respond(reply);
+            }
+        }
+    };
+
+
+    /** Options for a LoopbackPair. */
+    struct PairOptions {
+        std::string protocol = Connection::kWSProtocolName;     // Accepted WebSocket protocol
+        actor::delay_t latency = actor::delay_t::zero();
+        std::function<void(Encoder&)> clientOptions, serverOptions; // Add more option keys
+        std::function<void(Connection *client, Connection *server)> beforeStart;
+    };
+
+
+    /** Two BLIP Connections joined by loopback WebSockets. The constructor waits for both to
+        open; the destructor closes them and waits for both to close. */
+    class LoopbackPair {
+    public:
+        explicit LoopbackPair(const PairOptions &opts = {}) {
+            clientSocket = new CountingWebSocket(alloc_slice("ws://server/db"_sl),
+                                                 Role::Client, opts.latency);
+            serverSocket = new CountingWebSocket(alloc_slice("ws://client/db"_sl),
+                                                 Role::Server, opts.latency);
+            Headers responseHeaders;
+            responseHeaders.add("Sec-WebSocket-Protocol"_sl, slice(opts.protocol));
+            LoopbackWebSocket::bind(clientSocket, serverSocket, responseHeaders);
+
+            client = new Connection(clientSocket, makeOptions(nullptr, opts.clientOptions),
+                                    clientDelegate);
+            server = new Connection(serverSocket, makeOptions(&opts.protocol, opts.serverOptions),
+                                    serverDelegate);
+            if (opts.beforeStart)
+                opts.beforeStart(client, server);
+            server->start();
+            client->start();
+            CHECK(clientDelegate.connected.wait());
+            CHECK(serverDelegate.connected.wait());
+        }
+
+        ~LoopbackPair() {
+            close();
+        }
+
+        void close() {
+            if (_closed)
+                return;
+            _closed = true;
+            client->close();
+            CHECK(clientDelegate.closed.wait());
+            CHECK(serverDelegate.closed.wait());
+        }
+
+        /** Total bytes sent in both directions. */
+        uint64_t bytesSent() const {
+            return clientSocket->bytesSent + serverSocket->bytesSent;
+        }
+
+        Retained<CountingWebSocket> clientSocket, serverSocket;
+        TestDelegate clientDelegate, serverDelegate;
+        Retained<Connection> client, server;
+
+    private:
+        static AllocedDict makeOptions(const std::string *acceptedProtocol,
+                                       const std::function<void(Encoder&)> &more)
+        {
+            Encoder enc;
+            enc.beginDict();
+            if (acceptedProtocol) {
+                enc.writeKey(slice(Connection::kAcceptedProtocolOption));
+                enc.writeString(slice(*acceptedProtocol));
+            }
+            if (more)
+                more(enc);
+            enc.endDict();
+            return AllocedDict(enc.finish());
+        }
+
+        bool _closed {false};
+    };
+
+
+    /** Sends a request and waits for its reply; returns it, or null on timeout/failure. */
+    inline Retained<MessageIn> sendAndWait(Connection *conn, MessageBuilder &request,
+                                           std::chrono::milliseconds timeout
+                                                                = std::chrono::seconds(30))
+    {
+        Latch done;
+        Retained<MessageIn> reply;
+        auto onProgress = std::move(request.onProgress);
+        request.onProgress = [&, onProgress](const MessageProgress &progress) {
+            if (onProgress)
+                onProgress(progress);
+            if (progress.state >= MessageProgress::kComplete) {
+                reply = progress.reply;
+                done.countDown();
+            }
+        };
+        conn->sendRequest(request);
+        if (!done.wait(timeout))
+            return nullptr;
+        return reply;
+    }
+
+
+    /** Returns `size` bytes of JSON-ish text that compresses about as well as replication
+        traffic (revision bodies with repeated keys and varying values). */
+    inline alloc_slice replicationLikeBody(size_t size, unsigned seed =1) {
+        std::string str;
+        str.reserve(size + 200);
+        unsigned n = seed;
+        while (str.size() < size) {
+            n = n * 1103515245 + 12345;
+            str += "{\"_id\":\"doc-" + std::to_string(n % 100000)
+                 + "\",\"_rev\":\"" + std::to_string(n % 7 + 1) + "-" + std::to_string(n)
+                 + "\",\"type\":\"order\",\"customer\":\"c" + std::to_string(n % 997)
+                 + "\",\"total\":" + std::to_string(n % 10000) + ",\"channels\":[\"ch"
+                 + std::to_string(n % 13) + "\"]}\n";
+        }
+        str.resize(size);
+        return alloc_slice(str.data(), str.size());
+    }
+
+}
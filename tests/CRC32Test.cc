@@ -0,0 +1,68 @@
+//
+// CRC32Test.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "CRC32.hh"
+#include <zlib.h>
+#include <cstring>
+#include <random>
+
+using namespace blip_test;
+
+
+// crc32Update and crc32Copy must agree with zlib's crc32 for every length, alignment and
+// initial value, including the short and unaligned cases the accelerated code handles apart.
+BLIP_TEST(crc32MatchesZlib) {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> src(1 << 20), dst(1 << 20);
+    for (auto &b : src)
+        b = uint8_t(rng());
+
+    int mismatches = 0;
+    for (int t = 0; t < 20000; ++t) {
+        size_t offset = rng() % 64;
+        size_t len = rng() % (t < 10000 ? 300 : 100000);
+        uint32_t initial = uint32_t(rng());
+        uint32_t expected = uint32_t(::crc32(initial, &src[offset], uInt(len)));
+        memset(dst.data(), 0, len + 64);
+        if (crc32Update(initial, &src[offset], len) != expected
+                || crc32Copy(initial, &dst[3], &src[offset], len) != expected
+                || memcmp(&dst[3], &src[offset], len) != 0)
+            ++mismatches;
+    }
+    CHECK(mismatches == 0);
+
+    // Throughput, compared with zlib's:
+    static constexpr int kPasses = 200;
+    double mb = double(kPasses) * src.size() / (1024 * 1024);
+    uint32_t crc = 0;
+    Stopwatch st;
+    for (int i = 0; i < kPasses; ++i)
+        crc = uint32_t(::crc32(crc, src.data(), uInt(src.size())));
+    logBenchmark("CRC32: zlib crc32", mb / st.elapsed(), "MB/sec");
+    st.reset();
+    uint32_t crc2 = 0;
+    for (int i = 0; i < kPasses; ++i)
+        crc2 = crc32Update(crc2, src.data(), src.size());
+    logBenchmark("CRC32: crc32Update", mb / st.elapsed(), "MB/sec");
+    CHECK(crc2 == crc);
+    st.reset();
+    for (int i = 0; i < kPasses; ++i)
+        crc2 = crc32Copy(crc2, dst.data(), src.data(), src.size());
+    logBenchmark("CRC32: crc32Copy", mb / st.elapsed(), "MB/sec");
+}
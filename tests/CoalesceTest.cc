@@ -0,0 +1,121 @@
+//
+// CoalesceTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+
+using namespace blip_test;
+
+
+// Sends one "get" request per element of `configure` (each configured by it, on top of
+// coalesceIdentical) while the server holds its responses; then lets the server echo them.
+// Returns the number of requests the server received. Checks that every caller can extract
+// the whole reply body, even when they share a response.
+static int sendWhileHeld(LoopbackPair &pair,
+                         const std::vector<std::function<void(MessageBuilder&)>> &configure)
+{
+    static constexpr size_t kBodySize = 100000;
+    alloc_slice body = replicationLikeBody(kBodySize);
+    std::mutex heldMutex;
+    std::vector<Retained<MessageIn>> held;
+    int receivedBefore = pair.serverDelegate.requestsReceived;
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        std::lock_guard<std::mutex> lock(heldMutex);
+        held.push_back(request);
+    };
+
+    Latch done(int(configure.size()));
+    std::atomic<int> good {0};
+    for (auto &fn : configure) {
+        MessageBuilder msg("get"_sl);
+        msg.coalesceIdentical = true;
+        if (fn)
+            fn(msg);
+        msg << body;
+        msg.onProgress = [&](const MessageProgress &progress) {
+            if (progress.state < MessageProgress::kComplete)
+                return;
+            if (progress.reply && progress.reply->extractBody() == body)
+                ++good;
+            done.countDown();
+        };
+        pair.client->sendRequest(msg);
+    }
+
+    // Give any requests that weren't coalesced time to arrive, then answer them all:
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    int received = pair.serverDelegate.requestsReceived - receivedBefore;
+    {
+        std::lock_guard<std::mutex> lock(heldMutex);
+        for (auto &request : held) {
+            MessageBuilder reply(request);
+            reply << request->body();
+            request->respond(reply);
+        }
+        held.clear();
+    }
+    CHECK(done.wait());
+    CHECK(good == int(configure.size()));
+    pair.serverDelegate.onRequest = nullptr;
+    return received;
+}
+
+
+// Identical requests in flight at once share one response, each getting its own MessageIn;
+// requests that differ only in flags or timeout aren't coalesced.
+BLIP_TEST(coalesceIdenticalRequests) {
+    LoopbackPair pair;
+    CHECK(sendWhileHeld(pair, {nullptr, nullptr, nullptr}) == 1);
+    CHECK(sendWhileHeld(pair, {nullptr, [](MessageBuilder &mb) {mb.urgent = true;}}) == 2);
+    CHECK(sendWhileHeld(pair, {nullptr, [](MessageBuilder &mb) {mb.compressed = true;}}) == 2);
+    CHECK(sendWhileHeld(pair, {nullptr,
+                               [](MessageBuilder &mb) {mb.timeout = std::chrono::seconds(5);}})
+          == 2);
+}
+
+
+// A follower with a progress granularity gets the request in flight's intermediate
+// notifications (which use the same granularity), without the incomplete reply.
+BLIP_TEST(coalescedRequestProgress) {
+    LoopbackPair pair;
+    static constexpr size_t kBodySize = 1024 * 1024;
+    alloc_slice body = replicationLikeBody(kBodySize);
+    std::atomic<int> followerReceiving {0}, followerReplies {0};
+    Latch done(2);
+    for (int n = 0; n < 2; ++n) {
+        MessageBuilder msg("get"_sl);
+        msg.coalescingKey = "big";
+        msg.progressGranularity = {ProgressGranularity::kEveryNBytes, 256 * 1024};
+        msg << body;
+        msg.onProgress = [&, n](const MessageProgress &progress) {
+            if (n == 1 && progress.state == MessageProgress::kReceivingReply) {
+                ++followerReceiving;
+                if (progress.reply)
+                    ++followerReplies;
+            }
+            if (progress.state >= MessageProgress::kComplete) {
+                CHECK(progress.reply && progress.reply->body() == body);
+                done.countDown();
+            }
+        };
+        pair.client->sendRequest(msg);
+    }
+    CHECK(done.wait());
+    CHECK(pair.serverDelegate.requestsReceived == 1);
+    CHECK(followerReceiving >= 1 && followerReceiving <= 4);
+    CHECK(followerReplies == 0);
+}
@@ -0,0 +1,133 @@
+//
+// CodecTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "Codec.hh"
+#include <cstring>
+#include <random>
+
+using namespace blip_test;
+
+
+// Returns a JSON document like those in replication traffic.
+static std::string makeDoc(std::mt19937 &r, int i) {
+    char buf[600];
+    snprintf(buf, sizeof buf,
+             "{\"_id\":\"doc-%06d\",\"_rev\":\"%u-%08x%08x\",\"type\":\"order\","
+             "\"customer\":{\"name\":\"Customer %u\",\"email\":\"user%u@example.com\"},"
+             "\"items\":[{\"sku\":\"SKU-%04u\",\"qty\":%u,\"price\":%u.%02u},"
+             "{\"sku\":\"SKU-%04u\",\"qty\":%u,\"price\":%u.%02u}],"
+             "\"channels\":[\"user-%u\",\"public\"],\"updated\":\"2017-0%u-1%uT12:%02u:%02uZ\"}",
+             i, 1 + r() % 5, unsigned(r()), unsigned(r()), r() % 1000, r() % 1000, r() % 500,
+             1 + r() % 9, r() % 200, r() % 100, r() % 500, 1 + r() % 9, r() % 200, r() % 100,
+             r() % 1000, 1 + r() % 9, r() % 10, r() % 60, r() % 60);
+    return buf;
+}
+
+
+struct CodecResult {
+    size_t in = 0, out = 0;
+    double encodeSecs = 0, decodeSecs = 0;
+    bool ok = true;
+};
+
+
+// Sends each message through an encoder and decoder the way BLIP frames do (4KB frames,
+// SyncFlush, the flush trailer omitted, and a checksum), timing each side.
+static CodecResult runCodec(const char *name, const std::vector<std::string> &messages) {
+    static constexpr size_t kFrameSize = 4096;
+    auto encoder = CodecRegistry::newEncoder(slice(name), Codec::DefaultCompression);
+    auto decoder = CodecRegistry::newDecoder(slice(name));
+    CodecResult result;
+    uint8_t frame[kFrameSize + Codec::kChecksumSize];
+    std::vector<uint8_t> body(1 << 20);
+    for (auto &message : messages) {
+        slice data(message.data(), message.size());
+        size_t bodySize = 0;
+        while (data.size > 0) {
+            Stopwatch st;
+            slice dst(frame, kFrameSize - Codec::kChecksumSize);
+            do {
+                encoder->write(data, dst, Codec::Mode::SyncFlush);
+            } while (data.size > 0 && dst.size >= 1024);
+            CHECK(encoder->unflushedBytes() == 0);
+            slice trailer = encoder->flushTrailer();
+            size_t written = (kFrameSize - Codec::kChecksumSize) - dst.size;
+            if (trailer.size > 0 && written > 0) {
+                dst.moveStart(-(long)trailer.size);
+                written -= trailer.size;
+            }
+            dst.setSize(dst.size + Codec::kChecksumSize);
+            encoder->writeChecksum(dst);
+            result.encodeSecs += st.elapsed();
+            result.out += written;
+
+            st.reset();
+            slice in(frame, written + Codec::kChecksumSize);
+            uint8_t checksum[Codec::kChecksumSize];
+            memcpy(checksum, frame + written, Codec::kChecksumSize);
+            if (trailer.size > 0)
+                memcpy(frame + written, trailer.buf, trailer.size);
+            else
+                in.setSize(written);
+            while (in.size > 0 || decoder->unflushedBytes() > 0) {
+                slice out(&body[bodySize], body.size() - bodySize);
+                auto start = out.buf;
+                decoder->write(in, out, Codec::Mode::SyncFlush);
+                bodySize += (uint8_t*)out.buf - (uint8_t*)start;
+            }
+            slice checksumSlice(checksum, Codec::kChecksumSize);
+            decoder->readAndVerifyChecksum(checksumSlice);
+            result.decodeSecs += st.elapsed();
+        }
+        if (bodySize != message.size() || memcmp(body.data(), message.data(), bodySize) != 0)
+            result.ok = false;
+        result.in += message.size();
+    }
+    return result;
+}
+
+
+// Compares the ratio and CPU time of zstd and deflate on replication-like messages.
+BLIP_TEST(codecBenchmark) {
+    std::mt19937 rng(42);
+    std::vector<std::string> messages;
+    for (int i = 0; i < 2000; ++i) {
+        // Mostly single documents, with some larger batches:
+        std::string msg = makeDoc(rng, i);
+        if (i % 10 == 0) {
+            for (int j = 0; j < 50; ++j)
+                msg += "\n" + makeDoc(rng, i * 100 + j);
+        }
+        messages.push_back(msg);
+    }
+
+    for (const char *name : {CodecRegistry::kDeflate, CodecRegistry::kZstd}) {
+        if (!CodecRegistry::has(slice(name))) {
+            Log("Codec %s isn't built in; skipping it", name);
+            continue;
+        }
+        CodecResult r = runCodec(name, messages);
+        CHECK(r.ok);
+        double mb = double(r.in) / (1024 * 1024);
+        std::string prefix = std::string("Codec: ") + name;
+        logBenchmark((prefix + " ratio").c_str(), double(r.out) / r.in, "");
+        logBenchmark((prefix + " encode").c_str(), mb / r.encodeSecs, "MB/sec");
+        logBenchmark((prefix + " decode").c_str(), mb / r.decodeSecs, "MB/sec");
+    }
+}
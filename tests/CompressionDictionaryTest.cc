@@ -0,0 +1,70 @@
+//
+// CompressionDictionaryTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "CompressionDictionary.hh"
+#include <random>
+
+using namespace blip_test;
+
+
+// Sends the first `count` messages of a replication-like session (changes lists and revs) over
+// a new connection, compressed, and returns the bytes the client sent.
+static uint64_t sendReplicationStart(const std::string &protocol, int count) {
+    PairOptions opts;
+    opts.protocol = protocol;
+    LoopbackPair pair(opts);
+    std::mt19937 rng(42);
+    uint64_t bytesBefore = pair.clientSocket->bytesSent;
+    for (int n = 0; n < count; ++n) {
+        std::string docID = "doc-" + std::to_string(rng() % 1000000);
+        std::string revID = "1-" + std::to_string(rng()) + std::to_string(rng());
+        MessageBuilder msg;
+        msg.compressed = true;
+        if (n % 3 == 0) {
+            msg.addProperty("Profile"_sl, "changes"_sl);
+            msg << slice("[[" + std::to_string(100 + n) + ",\"" + docID + "\",\"" + revID
+                         + "\"]]");
+        } else {
+            msg.addProperty("Profile"_sl, "rev"_sl);
+            msg.addProperty("id"_sl, slice(docID));
+            msg.addProperty("rev"_sl, slice(revID));
+            msg.addProperty("sequence"_sl, 100 + n);
+            msg << slice("{\"name\":\"user" + std::to_string(rng() % 1000)
+                         + "\",\"type\":\"profile\",\"channels\":[\"public\"],\"age\":"
+                         + std::to_string(rng() % 90) + "}");
+        }
+        Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+        CHECK(reply && !reply->isError());
+    }
+    return pair.clientSocket->bytesSent - bytesBefore;
+}
+
+
+// Measures the bytes saved by the built-in dictionary over the first messages of a connection.
+BLIP_TEST(compressionDictionarySavings) {
+    std::string withDict = Connection::protocolName(Connection::kDictionaryExtension,
+                                                    slice(CompressionDictionary::kBuiltInID));
+    for (int count : {1, 5, 20, 100}) {
+        uint64_t plain = sendReplicationStart(Connection::kWSProtocolName, count);
+        uint64_t dict = sendReplicationStart(withDict, count);
+        CHECK(dict < plain);
+        std::string what = "Dictionary: bytes saved, first " + std::to_string(count) + " msgs";
+        logBenchmark(what.c_str(), 100.0 * double(plain - dict) / double(plain), "%");
+    }
+}
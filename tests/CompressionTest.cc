@@ -0,0 +1,281 @@
+//
+// CompressionTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "CompressionTuner.hh"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+using namespace blip_test;
+
+
+// Returns `size` random bytes, which no compressor can shrink (like JPEG or gzipped data.)
+static alloc_slice randomBody(size_t size, unsigned seed =1) {
+    std::mt19937 rng(seed);
+    alloc_slice body(size);
+    auto bytes = (uint8_t*)body.buf;
+    for (size_t i = 0; i < size; ++i)
+        bytes[i] = uint8_t(rng());
+    return body;
+}
+
+
+// Sends a compressed echo request with the given profile and body, after letting `configure`
+// adjust it, and returns the client's compression stats for that profile.
+static CompressionStats sendCompressed(LoopbackPair &pair, slice profile, slice body,
+                                       const std::function<void(MessageBuilder&)> &configure
+                                                                                 = nullptr)
+{
+    MessageBuilder msg(profile);
+    msg.compressed = true;
+    if (configure)
+        configure(msg);
+    msg << body;
+    Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+    CHECK(reply && !reply->isError() && reply->body() == body);
+    return pair.client->compressionStatsByProfile()[std::string(profile)];
+}
+
+
+// Frames of high-entropy data are sent raw, without deflating them, while text still compresses.
+BLIP_TEST(compressionRawFrameBypass) {
+    static constexpr size_t kBodySize = 1024 * 1024;
+    LoopbackPair pair;
+
+    uint64_t before = pair.clientSocket->bytesSent;
+    CompressionStats stats = sendCompressed(pair, "random"_sl, randomBody(kBodySize));
+    uint64_t sent = pair.clientSocket->bytesSent - before;
+    Log("Random data: %llu compressed, %llu raw frames; sent %llu bytes",
+        (unsigned long long)stats.compressedFrames, (unsigned long long)stats.rawFrames,
+        (unsigned long long)sent);
+    // (The first frame may be compressed, since it starts with the properties:)
+    CHECK(stats.compressedFrames <= 1);
+    CHECK(stats.rawFrames >= kBodySize / 16384);
+    CHECK(stats.inputBytes >= kBodySize && stats.outputBytes <= stats.inputBytes + 1024);
+    CHECK(sent < kBodySize + kBodySize / 50);
+
+    stats = sendCompressed(pair, "text"_sl, replicationLikeBody(kBodySize));
+    CHECK(stats.rawFrames == 0);
+    CHECK(stats.compressedFrames >= kBodySize / (4 * 16384));
+    CHECK(stats.ratio() < 0.5);
+}
+
+
+// When a compressed frame doesn't pay, the next kRawFramesBeforeRetry (8) frames are sent raw
+// before compression is tried again. The kTextJSON strategy skips the entropy check, so with
+// random data every ninth frame is a retry that fails.
+BLIP_TEST(compressionRetryAfterRawFrames) {
+    static constexpr size_t kBodySize = 1024 * 1024;
+    LoopbackPair pair;
+    CompressionStats stats = sendCompressed(pair, "random"_sl, randomBody(kBodySize),
+                                            [](MessageBuilder &msg) {
+        msg.compressionStrategy = MessageBuilder::kTextJSON;
+    });
+    uint64_t frames = stats.compressedFrames + stats.rawFrames;
+    Log("Random data as text: %llu of %llu frames compressed",
+        (unsigned long long)stats.compressedFrames, (unsigned long long)frames);
+    CHECK(frames >= kBodySize / 16384);
+    CHECK(stats.compressedFrames == (frames + 8) / 9);
+
+    // Data that turns compressible partway through is compressed again, soon after:
+    alloc_slice random = randomBody(kBodySize / 4, 2), text = replicationLikeBody(kBodySize);
+    alloc_slice mixed(random.size + text.size);
+    memcpy((void*)mixed.buf, random.buf, random.size);
+    memcpy((char*)mixed.buf + random.size, text.buf, text.size);
+    stats = sendCompressed(pair, "mixed"_sl, mixed, [](MessageBuilder &msg) {
+        msg.compressionStrategy = MessageBuilder::kTextJSON;
+    });
+    CHECK(stats.rawFrames <= random.size / 16384 + 9);
+    CHECK(stats.compressedFrames >= text.size / (4 * 16384));
+    CHECK(stats.outputBytes < random.size + text.size / 2);
+}
+
+
+// Feeds a CompressionTuner one window's worth of compressed frames (its minimum is 256KB and
+// 250ms), during which the link was either saturated or idle, and returns its new level.
+// Compressing costs far less than sending over a saturated link, so that votes to raise the
+// level; an idle link costs nothing, so that votes to lower it.
+static int tunerWindow(CompressionTuner &tuner, bool linkSaturated) {
+    static constexpr size_t kInput = 512 * 1024, kOutput = 256 * 1024;
+    if (linkSaturated)
+        tuner.linkBlocked();
+    else
+        tuner.linkUnblocked();
+    tuner.compressedFrame(kInput, kOutput, std::chrono::microseconds(100));
+    tuner.sentFrame(kOutput);
+    std::this_thread::sleep_for(std::chrono::milliseconds(260));
+    return tuner.update();
+}
+
+
+// The tuner only changes the level after two consecutive windows agree, by one step at a time,
+// and keeps it within 1...9.
+BLIP_TEST(compressionTunerHysteresis) {
+    CompressionTuner tuner(6);
+    CHECK(tuner.level() == 6);
+
+    // A window that's too small is ignored:
+    tuner.linkBlocked();
+    tuner.compressedFrame(1000, 500, std::chrono::microseconds(100));
+    CHECK(tuner.update() == 6);
+
+    CHECK(tunerWindow(tuner, true) == 6);       // one vote isn't enough
+    CHECK(tunerWindow(tuner, true) == 7);
+    CHECK(tunerWindow(tuner, false) == 7);      // contrary votes...
+    CHECK(tunerWindow(tuner, true) == 7);       // ...reset the count
+    CHECK(tunerWindow(tuner, false) == 7);
+    CHECK(tunerWindow(tuner, false) == 6);
+    CHECK(tunerWindow(tuner, false) == 6);
+    CHECK(tunerWindow(tuner, false) == 5);
+
+    // The level is clamped:
+    CHECK(CompressionTuner(0).level() == 1);
+    CHECK(CompressionTuner(12).level() == 9);
+    CompressionTuner high(9);
+    CHECK(tunerWindow(high, true) == 9);
+    CHECK(tunerWindow(high, true) == 9);
+    CompressionTuner low(1);
+    CHECK(tunerWindow(low, false) == 1);
+    CHECK(tunerWindow(low, false) == 1);
+}
+
+
+// A message's own compression level and strategy are applied to the connection's deflate stream
+// for its frames, and override the connection's level, even when that's 0 (no compression).
+BLIP_TEST(compressionPerMessageParams) {
+    static constexpr size_t kBodySize = 512 * 1024;
+    alloc_slice body = replicationLikeBody(kBodySize);
+    PairOptions opts;
+    opts.clientOptions = [](Encoder &enc) {
+        enc.writeKey(slice(Connection::kCompressionLevelOption));
+        enc.writeInt(0);
+    };
+    LoopbackPair pair(opts);
+    CHECK(pair.client->compressionLevel() == 0);
+
+    // The connection's level applies; it doesn't compress:
+    sendCompressed(pair, "default"_sl, body);
+    CHECK(pair.client->compressionStatsByProfile().count("default") == 0);
+
+    auto withParams = [](int level, MessageBuilder::CompressionStrategy strategy) {
+        return [=](MessageBuilder &msg) {
+            msg.compressionLevel = int8_t(level);
+            msg.compressionStrategy = strategy;
+        };
+    };
+    CompressionStats fast = sendCompressed(pair, "fast"_sl, body,
+                                           withParams(1, MessageBuilder::kDefaultStrategy));
+    CompressionStats best = sendCompressed(pair, "best"_sl, body,
+                                           withParams(9, MessageBuilder::kDefaultStrategy));
+    CompressionStats huffman = sendCompressed(pair, "huffman"_sl, body,
+                                              withParams(9, MessageBuilder::kHuffmanOnly));
+    Log("Per-message params: level 1 ratio %.3f, level 9 %.3f, Huffman-only %.3f",
+        fast.ratio(), best.ratio(), huffman.ratio());
+    CHECK(fast.compressedFrames > 0 && best.compressedFrames > 0);
+    CHECK(best.outputBytes < fast.outputBytes);
+    // Huffman coding alone can't use the JSON's repeated strings:
+    CHECK(huffman.outputBytes > fast.outputBytes);
+    CHECK(huffman.ratio() < 1.0);
+
+    // Level 0 turns off compression for the message:
+    sendCompressed(pair, "none"_sl, body, withParams(0, MessageBuilder::kDefaultStrategy));
+    CHECK(pair.client->compressionStatsByProfile().count("none") == 0);
+}
+
+
+// While the encoder is busy compressing bulk messages at level 9, urgent requests still get
+// quick replies (so ACKs and other control frames aren't held up either.) Every bulk message
+// arrives intact, and small messages queued between them arrive in the order they were sent.
+BLIP_TEST(compressionLoadResponsiveness) {
+    using clock = std::chrono::steady_clock;
+    static constexpr int kBulkMessages = 4, kNumberedPerBulk = 10;
+    static constexpr size_t kBulkSize = 4 * 1024 * 1024;
+
+    PairOptions opts;
+    opts.clientOptions = [](Encoder &enc) {
+        enc.writeKey(slice(Connection::kCompressionLevelOption));
+        enc.writeInt(9);
+    };
+    LoopbackPair pair(opts);
+    std::vector<alloc_slice> bodies;
+    for (int i = 0; i < kBulkMessages; ++i)
+        bodies.push_back(replicationLikeBody(kBulkSize, i + 1));
+
+    std::mutex receivedMutex;
+    std::vector<long> numberedReceived;
+    std::atomic<int> bulkIntact {0};
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        slice profile = request->property("Profile"_sl);
+        long seq = request->intProperty("seq"_sl, -1);
+        if (profile == "bulk"_sl) {
+            if (seq >= 0 && seq < kBulkMessages && request->body() == bodies[seq])
+                ++bulkIntact;
+        } else if (profile == "numbered"_sl) {
+            std::lock_guard<std::mutex> lock(receivedMutex);
+            numberedReceived.push_back(seq);
+        } else {
+            request->respond();
+        }
+    };
+
+    auto start = clock::now();
+    for (int i = 0; i < kBulkMessages; ++i) {
+        MessageBuilder msg("bulk"_sl);
+        msg.addProperty("seq"_sl, int64_t(i));
+        msg.compressed = true;
+        msg.noreply = true;
+        msg << bodies[i];
+        pair.client->sendRequest(msg);
+        for (int j = 0; j < kNumberedPerBulk; ++j) {
+            MessageBuilder numbered("numbered"_sl);
+            numbered.addProperty("seq"_sl, int64_t(i * kNumberedPerBulk + j));
+            numbered.noreply = true;
+            numbered << "x"_sl;
+            pair.client->sendRequest(numbered);
+        }
+    }
+
+    // Ping while the bulk messages are being sent:
+    clock::duration maxPing {};
+    int pingsDuringLoad = 0;
+    while (bulkIntact < kBulkMessages && clock::now() - start < std::chrono::seconds(30)) {
+        MessageBuilder ping("ping"_sl);
+        ping.urgent = true;
+        auto pingStart = clock::now();
+        Retained<MessageIn> reply = sendAndWait(pair.client, ping);
+        CHECK(reply && !reply->isError());
+        if (bulkIntact < kBulkMessages) {
+            maxPing = std::max(maxPing, clock::now() - pingStart);
+            ++pingsDuringLoad;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto loadTime = clock::now() - start;
+    CHECK(waitUntil([&]{return bulkIntact == kBulkMessages;}));
+
+    using ms = std::chrono::duration<double, std::milli>;
+    Log("Under load for %.0fms: %d pings, slowest took %.1fms",
+        ms(loadTime).count(), pingsDuringLoad, ms(maxPing).count());
+    CHECK(pingsDuringLoad >= 2);
+    CHECK(maxPing < loadTime / 4);
+
+    std::lock_guard<std::mutex> lock(receivedMutex);
+    CHECK(numberedReceived.size() == size_t(kBulkMessages * kNumberedPerBulk));
+    CHECK(std::is_sorted(numberedReceived.begin(), numberedReceived.end()));
+}
@@ -0,0 +1,91 @@
+//
+// ConnectionMemoryTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include <memory>
+
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+using namespace blip_test;
+
+
+// Returns the number of bytes allocated on the heap, or 0 if that can't be determined.
+static size_t heapBytesInUse() {
+#ifdef __APPLE__
+    malloc_statistics_t stats;
+    malloc_zone_statistics(nullptr, &stats);
+    return stats.size_in_use;
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    auto info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+
+// Measures the heap used per connection: idle, after each has sent a compressed message,
+// and after they've hibernated.
+BLIP_TEST(connectionMemoryBenchmark) {
+    static constexpr int kPairs = 500;
+    if (heapBytesInUse() == 0) {
+        Log("Can't measure heap use on this platform; skipping");
+        return;
+    }
+    PairOptions opts;
+    auto hibernate = [](Encoder &enc) {
+        enc.writeKey(slice(Connection::kHibernateAfterOption));
+        enc.writeInt(1);                    // seconds
+    };
+    opts.clientOptions = opts.serverOptions = hibernate;
+
+    size_t before = heapBytesInUse();
+    std::vector<std::unique_ptr<LoopbackPair>> pairs;
+    for (int i = 0; i < kPairs; ++i)
+        pairs.emplace_back(new LoopbackPair(opts));
+    size_t idle = heapBytesInUse();
+
+    alloc_slice body = replicationLikeBody(2000);
+    for (auto &pair : pairs) {
+        MessageBuilder msg("echo"_sl);
+        msg.compressed = true;
+        msg << body;
+        Retained<MessageIn> reply = sendAndWait(pair->client, msg);
+        CHECK(reply && reply->body() == body);
+    }
+    size_t active = heapBytesInUse();
+
+    std::this_thread::sleep_for(std::chrono::seconds(3));      // let them all hibernate
+    size_t hibernated = heapBytesInUse();
+
+    auto perConnection = [&](size_t total) {
+        return (double(total) - double(before)) / (2 * kPairs);
+    };
+    logBenchmark("Memory: per connection, idle", perConnection(idle), "bytes");
+    logBenchmark("Memory: per connection, after compressed traffic", perConnection(active),
+                 "bytes");
+    logBenchmark("Memory: per connection, hibernated", perConnection(hibernated), "bytes");
+    CHECK(hibernated < active);
+
+    for (auto &pair : pairs)
+        pair->close();
+}
@@ -0,0 +1,131 @@
+//
+// ConnectionPoolTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "ConnectionPool.hh"
+#include <memory>
+
+using namespace blip_test;
+
+
+// A ConnectionPool that notes when it's been freed.
+class TestPool : public ConnectionPool {
+public:
+    TestPool(const std::vector<Retained<Connection>> &conns, std::atomic<bool> &freed)
+    :ConnectionPool(conns), _freed(freed) { }
+protected:
+    virtual ~TestPool()                                 {_freed = true;}
+private:
+    std::atomic<bool> &_freed;
+};
+
+
+// Opens `count` LoopbackPairs over simulated network latency, and pools each side.
+struct PooledPairs {
+    explicit PooledPairs(size_t count) {
+        PairOptions opts;
+        opts.latency = actor::delay_t(0.005);
+        std::vector<Retained<Connection>> clients, servers;
+        for (size_t i = 0; i < count; ++i) {
+            pairs.emplace_back(new LoopbackPair(opts));
+            clients.push_back(pairs.back()->client);
+            servers.push_back(pairs.back()->server);
+        }
+        clientPool = new TestPool(clients, clientFreed);
+        serverPool = new TestPool(servers, serverFreed);
+    }
+
+    std::atomic<bool> clientFreed {false}, serverFreed {false};
+    std::vector<std::unique_ptr<LoopbackPair>> pairs;
+    Retained<ConnectionPool> clientPool, serverPool;
+};
+
+
+// Sends `count` echo requests of `size` bytes through the pool, `window` at a time; returns
+// the elapsed time in seconds.
+static double sendThroughPool(ConnectionPool *pool, int count, size_t size, int window) {
+    alloc_slice body = replicationLikeBody(size);
+    std::atomic<int> good {0};
+    Latch done(count);
+    Stopwatch st;
+    for (int sent = 0; sent < count; sent += window) {
+        int n = std::min(window, count - sent);
+        Latch batch(n);
+        for (int i = 0; i < n; ++i) {
+            MessageBuilder msg("echo"_sl);
+            msg << body;
+            pool->sendRequest(msg).wait([&](Retained<MessageIn> reply) {
+                if (reply && !reply->isError() && reply->body() == body)
+                    ++good;
+                batch.countDown();
+                done.countDown();
+            });
+        }
+        CHECK(batch.wait());
+    }
+    CHECK(done.wait());
+    double elapsed = st.elapsed();
+    CHECK(good == count);
+    return elapsed;
+}
+
+
+// Striped requests must arrive intact, and a pool must be freed once it's released (its
+// connections' stripe handlers don't keep it alive.)
+BLIP_TEST(connectionPoolStriping) {
+    PooledPairs pooled(4);
+    pooled.clientPool->setStripeSize(64 * 1024);
+    for (size_t size : {1000, 100 * 1024, 1024 * 1024 + 3}) {
+        alloc_slice body = replicationLikeBody(size, unsigned(size));
+        MessageBuilder msg("echo"_sl);
+        msg << body;
+        Latch done;
+        Retained<MessageIn> reply;
+        pooled.clientPool->sendRequest(msg).wait([&](Retained<MessageIn> r) {
+            reply = r;
+            done.countDown();
+        });
+        CHECK(done.wait());
+        CHECK(reply && !reply->isError() && reply->body() == body);
+    }
+
+    pooled.clientPool->close();
+    for (auto &pair : pooled.pairs)
+        pair->close();
+    pooled.clientPool = nullptr;
+    pooled.serverPool = nullptr;
+    CHECK(pooled.clientFreed);
+    CHECK(pooled.serverFreed);
+}
+
+
+// Measures the throughput of 256KB requests over one connection vs. a pool of four.
+BLIP_TEST(connectionPoolThroughput) {
+    static constexpr int kCount = 200;
+    static constexpr size_t kSize = 256 * 1024;
+    double results[2];
+    size_t sizes[2] = {1, 4};
+    for (int i = 0; i < 2; ++i) {
+        PooledPairs pooled(sizes[i]);
+        pooled.clientPool->setStripeSize(0);
+        results[i] = sendThroughPool(pooled.clientPool, kCount, kSize, 16);
+    }
+    double mb = double(kCount) * kSize / (1024 * 1024);
+    logBenchmark("ConnectionPool: echo throughput, 1 connection", mb / results[0], "MB/sec");
+    logBenchmark("ConnectionPool: echo throughput, 4 connections", mb / results[1], "MB/sec");
+}
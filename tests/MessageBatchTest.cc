@@ -0,0 +1,95 @@
+//
+// MessageBatchTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "MessageBatch.hh"
+
+using namespace blip_test;
+
+
+// A handler that drops one request of a batch mustn't keep the others from being answered.
+BLIP_TEST(batchWithUnhandledRequest) {
+    PairOptions opts;
+    opts.protocol = Connection::protocolName(Connection::kBatchExtension);
+    LoopbackPair pair(opts);
+    pair.serverDelegate.onRequest = [](MessageIn *request) {
+        if (request->boolProperty("drop"_sl))
+            return;
+        MessageBuilder reply(request);
+        reply << request->body();
+        request->respond(reply);
+    };
+
+    static constexpr int kCount = 5;
+    Latch done(kCount);
+    std::atomic<int> replies {0}, errors {0};
+    MessageBatch batch;
+    for (int n = 0; n < kCount; ++n) {
+        MessageBuilder msg("echo"_sl);
+        if (n == 2)
+            msg.addProperty("drop"_sl, "true"_sl);
+        msg << slice(std::to_string(n));
+        msg.onProgress = [&, n](const MessageProgress &progress) {
+            if (progress.state < MessageProgress::kComplete)
+                return;
+            if (progress.reply && progress.reply->isError())
+                ++errors;
+            else if (progress.reply && progress.reply->body() == slice(std::to_string(n)))
+                ++replies;
+            done.countDown();
+        };
+        batch.add(msg);
+    }
+    pair.client->sendBatch(batch);
+    CHECK(done.wait(std::chrono::seconds(10)));
+    CHECK(replies == kCount - 1);
+    CHECK(errors == 1);
+}
+
+
+// Requests with their own timeout aren't auto-batched, so they keep it; nor are urgent ones,
+// so they aren't delayed, and don't make the rest of a batch urgent.
+BLIP_TEST(autoBatchingSkipsRequestsWithOptions) {
+    PairOptions opts;
+    opts.protocol = Connection::protocolName(Connection::kBatchExtension);
+    LoopbackPair pair(opts);
+    pair.client->setBatching("echo", std::chrono::milliseconds(50));
+
+    // Returns the number of WebSocket messages the client sent for two requests:
+    auto sendTwo = [&](std::function<void(MessageBuilder&)> configureSecond) {
+        uint64_t framesBefore = pair.clientSocket->framesSent;
+        Latch done(2);
+        for (int n = 0; n < 2; ++n) {
+            MessageBuilder msg("echo"_sl);
+            if (n == 1 && configureSecond)
+                configureSecond(msg);
+            msg << "hi"_sl;
+            msg.onProgress = [&](const MessageProgress &progress) {
+                if (progress.state >= MessageProgress::kComplete)
+                    done.countDown();
+            };
+            pair.client->sendRequest(msg);
+        }
+        CHECK(done.wait(std::chrono::seconds(10)));
+        return pair.clientSocket->framesSent - framesBefore;
+    };
+
+    CHECK(sendTwo(nullptr) == 1);   // batched together
+    CHECK(sendTwo([](MessageBuilder &msg) {msg.timeout = std::chrono::seconds(5);}) == 2);
+    CHECK(sendTwo([](MessageBuilder &msg) {msg.urgent = true;}) == 2);
+}
@@ -0,0 +1,189 @@
+//
+// MessageBuilderTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "MessageTemplate.hh"
+
+using namespace blip_test;
+
+
+// Exposes the encoded message, so building can be measured without a Connection.
+struct TestBuilder : public MessageBuilder {
+    using MessageBuilder::finish;
+};
+
+
+static void buildTypicalMessage(MessageBuilder &msg, int n, slice body) {
+    msg.addProperty("Profile"_sl, "rev"_sl);
+    msg.addProperty("id"_sl, "doc-0001234"_sl);
+    msg.addProperty("rev"_sl, "2-f00dcafe"_sl);
+    msg.addProperty("sequence"_sl, n);
+    msg.addProperty("deleted"_sl, "0"_sl);
+    msg << body;
+}
+
+
+// Properties and body built in the arena must arrive intact, including after reset().
+BLIP_TEST(messageBuilderRoundTrip) {
+    LoopbackPair pair;
+    alloc_slice body = replicationLikeBody(5000);
+    for (int n = 0; n < 3; ++n) {
+        MessageBuilder msg;
+        buildTypicalMessage(msg, n, body);
+        if (n == 2) {
+            // A reset builder must not leak anything from its previous message:
+            msg.reset();
+            buildTypicalMessage(msg, n, body);
+        }
+        Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+        CHECK(reply && !reply->isError());
+        if (reply)
+            CHECK(reply->body() == body);
+    }
+
+    Latch received;
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        CHECK(request->property("Profile"_sl) == "rev"_sl);
+        CHECK(request->property("id"_sl) == "doc-0001234"_sl);
+        CHECK(request->intProperty("sequence"_sl) == 77);
+        CHECK(request->body() == body);
+        request->respond();
+        received.countDown();
+    };
+    MessageBuilder msg;
+    buildTypicalMessage(msg, 77, body);
+    CHECK(sendAndWait(pair.client, msg) != nullptr);
+    CHECK(received.wait());
+}
+
+
+// A message built from a template must round-trip through MessageTemplate::read, and read
+// must still find the values of messages built without it, or with other properties first.
+BLIP_TEST(messageTemplateRoundTrip) {
+    static const MessageTemplate<3> kRevTemplate("rev"_sl, {"id"_sl, "rev"_sl, "deleted"_sl});
+    LoopbackPair pair;
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        // Echo the values separated by '/', with '?' for a missing one:
+        auto values = kRevTemplate.read(request);
+        MessageBuilder reply(request);
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (i > 0)
+                reply << "/"_sl;
+            reply << (values[i] ? values[i] : "?"_sl);
+        }
+        request->respond(reply);
+    };
+
+    auto check = [&](MessageBuilder &msg, slice expected) {
+        Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+        CHECK(reply && !reply->isError());
+        if (reply)
+            CHECK(reply->body() == expected);
+    };
+
+    MessageBuilder msg;
+    kRevTemplate.build(msg, {"doc-0001234"_sl, "2-f00dcafe"_sl, "0"_sl});
+    msg << "body"_sl;
+    check(msg, "doc-0001234/2-f00dcafe/0"_sl);
+
+    msg.reset();                        // empty values
+    kRevTemplate.build(msg, {"doc"_sl, ""_sl, ""_sl});
+    check(msg, "doc//"_sl);
+
+    msg.reset();                        // another property first, and one after
+    msg.addProperty("sequence"_sl, 17);
+    kRevTemplate.build(msg, {"doc-1"_sl, "1-abc"_sl, "1"_sl});
+    msg.addProperty("extra"_sl, "x"_sl);
+    check(msg, "doc-1/1-abc/1"_sl);
+
+    msg.reset();                        // built by hand, out of order, one missing
+    msg.addProperty("Profile"_sl, "rev"_sl);
+    msg.addProperty("rev"_sl, "3-def"_sl);
+    msg.addProperty("id"_sl, "doc-2"_sl);
+    check(msg, "doc-2/3-def/?"_sl);
+
+    msg.reset();                        // a name that's a prefix of the template's
+    msg.addProperty("Profile"_sl, "rev"_sl);
+    msg.addProperty("i"_sl, "nope"_sl);
+    msg.addProperty("id"_sl, "doc-3"_sl);
+    check(msg, "doc-3/?/?"_sl);
+}
+
+
+// A binary Fleece body must arrive readable via fleeceBody(), and once the body's been
+// extracted, fleeceBody() must not return a Value pointing into it.
+BLIP_TEST(fleeceBodyRoundTrip) {
+    LoopbackPair pair;
+    std::atomic<int> good {0};
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        bool ok = request->hasFleeceBody();
+        Dict root = request->fleeceBody().asDict();
+        ok = ok && root && root["id"_sl].asString() == "doc-1"_sl && root["n"_sl].asInt() == 42;
+        ok = ok && request->fleeceBody() == root;          // validated only once
+        alloc_slice body = request->extractBody();
+        ok = ok && body.size > 0 && !request->fleeceBody() && !request->body();
+        if (ok)
+            ++good;
+        MessageBuilder reply(request);
+        reply << body;
+        request->respond(reply);
+    };
+
+    for (int n = 0; n < 2; ++n) {
+        MessageBuilder msg("rev"_sl);
+        msg.compressed = (n == 1);
+        auto &enc = msg.fleeceBody();
+        enc.beginDict();
+        enc.writeKey("id"_sl);
+        enc.writeString("doc-1"_sl);
+        enc.writeKey("n"_sl);
+        enc.writeInt(42);
+        enc.endDict();
+        Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+        CHECK(reply && !reply->isError());
+        if (reply)
+            CHECK(reply->body().size > 0 && !reply->hasFleeceBody());
+    }
+    CHECK(good == 2);
+}
+
+
+// Measures building small messages with a fresh builder each time, and by reusing one.
+BLIP_TEST(messageBuilderBenchmark) {
+    static constexpr int kIterations = 200000;
+    alloc_slice body = replicationLikeBody(1000);
+
+    Stopwatch st;
+    for (int n = 0; n < kIterations; ++n) {
+        TestBuilder msg;
+        buildTypicalMessage(msg, n, body);
+        CHECK(msg.finish().size > 1000);
+    }
+    logBenchmark("MessageBuilder: new builder per message", st.elapsedMS() * 1000 / kIterations,
+                 "us/msg");
+
+    st.reset();
+    TestBuilder msg;
+    for (int n = 0; n < kIterations; ++n) {
+        msg.reset();
+        buildTypicalMessage(msg, n, body);
+        CHECK(msg.finish().size > 1000);
+    }
+    logBenchmark("MessageBuilder: reused builder", st.elapsedMS() * 1000 / kIterations,
+                 "us/msg");
+}
@@ -0,0 +1,86 @@
+//
+// ProgressTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+
+using namespace blip_test;
+
+
+static constexpr size_t kBodySize = 1024 * 1024;
+
+
+// The progress notifications of one echoed request.
+struct ProgressLog {
+    int sending = 0, receiving = 0, awaiting = 0, complete = 0;
+    MessageSize firstBytesReceived = 0;         // bytesReceived of the first kReceivingReply
+};
+
+
+// Sends a kBodySize echo request with the given granularity, and logs its notifications.
+static ProgressLog echoWithGranularity(LoopbackPair &pair, ProgressGranularity granularity) {
+    ProgressLog log;
+    MessageBuilder msg("echo"_sl);
+    msg << replicationLikeBody(kBodySize);
+    msg.progressGranularity = granularity;
+    msg.onProgress = [&](const MessageProgress &progress) {
+        switch (progress.state) {
+            case MessageProgress::kSending:         ++log.sending; break;
+            case MessageProgress::kAwaitingReply:   ++log.awaiting; break;
+            case MessageProgress::kReceivingReply:
+                if (log.receiving++ == 0)
+                    log.firstBytesReceived = progress.bytesReceived;
+                break;
+            case MessageProgress::kComplete:        ++log.complete; break;
+            default:                                break;
+        }
+    };
+    Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+    CHECK(reply && reply->body().size == kBodySize);
+    return log;
+}
+
+
+// Each ProgressGranularity mode must limit the kSending and kReceivingReply notifications
+// as documented, and always deliver the other states.
+BLIP_TEST(progressGranularityModes) {
+    LoopbackPair pair;
+    static constexpr size_t kFrames = kBodySize / 16384;       // (at least, in each direction)
+
+    ProgressLog log = echoWithGranularity(pair, {});
+    CHECK(log.sending >= int(kFrames) && log.receiving >= int(kFrames));
+    CHECK(log.awaiting == 1 && log.complete == 1);
+
+    log = echoWithGranularity(pair, ProgressGranularity::kCompletionOnly);
+    CHECK(log.sending == 0 && log.receiving == 0);
+    CHECK(log.awaiting == 1 && log.complete == 1);
+
+    // Every 256KB: about 4 notifications each way, and the reply's first only once 256KB of
+    // it has arrived (not on its first frame):
+    static constexpr uint32_t kInterval = 256 * 1024;
+    log = echoWithGranularity(pair, {ProgressGranularity::kEveryNBytes, kInterval});
+    CHECK(log.sending >= 3 && log.sending <= 4);
+    CHECK(log.receiving >= 3 && log.receiving <= 4);
+    CHECK(log.firstBytesReceived >= kInterval);
+    CHECK(log.awaiting == 1 && log.complete == 1);
+
+    // Every 10 seconds: the exchange takes much less than that, so there are no intermediate
+    // notifications at all after the first:
+    log = echoWithGranularity(pair, {ProgressGranularity::kEveryNMilliseconds, 10000});
+    CHECK(log.sending <= 1 && log.receiving == 0);
+    CHECK(log.awaiting == 1 && log.complete == 1);
+}
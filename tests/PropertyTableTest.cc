@@ -0,0 +1,71 @@
+//
+// PropertyTableTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+
+using namespace blip_test;
+
+
+// Sends `count` small replication-style requests and returns the total bytes sent in both
+// directions; checks that every property arrives unchanged.
+static uint64_t sendRevMessages(const std::string &protocol, int count) {
+    PairOptions opts;
+    opts.protocol = protocol;
+    LoopbackPair pair(opts);
+
+    std::atomic<int> badRequests {0};
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        long n = request->intProperty("sequence"_sl, -1);
+        if (request->property("Profile"_sl) != "rev"_sl
+                || request->property("id"_sl) != slice("doc-" + std::to_string(n % 50))
+                || request->property("history"_sl) != "1-abc,2-def"_sl
+                || request->property("noconflicts"_sl) != "true"_sl)
+            ++badRequests;
+        MessageBuilder reply(request);
+        reply.addProperty("sequence"_sl, n);
+        request->respond(reply);
+    };
+
+    uint64_t bytesBefore = pair.bytesSent();
+    for (int n = 0; n < count; ++n) {
+        MessageBuilder msg("rev"_sl);
+        msg.addProperty("id"_sl, slice("doc-" + std::to_string(n % 50)));
+        msg.addProperty("rev"_sl, slice("2-" + std::to_string(n)));
+        msg.addProperty("sequence"_sl, n);
+        msg.addProperty("history"_sl, "1-abc,2-def"_sl);
+        msg.addProperty("noconflicts"_sl, "true"_sl);
+        msg << "{\"x\":1}"_sl;
+        Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+        CHECK(reply && reply->intProperty("sequence"_sl) == n);
+    }
+    CHECK(badRequests == 0);
+    return pair.bytesSent() - bytesBefore;
+}
+
+
+BLIP_TEST(propertyTableSavesBytes) {
+    static constexpr int kCount = 1000;
+    uint64_t plainBytes = sendRevMessages(Connection::kWSProtocolName, kCount);
+    uint64_t tableBytes = sendRevMessages(Connection::protocolName(
+                                                        Connection::kPropertyTableExtension),
+                                          kCount);
+    CHECK(tableBytes < plainBytes);
+    logBenchmark("PropTable: bytes per request+reply, plain", double(plainBytes) / kCount, "bytes");
+    logBenchmark("PropTable: bytes per request+reply, PropTable", double(tableBytes) / kCount,
+                 "bytes");
+}
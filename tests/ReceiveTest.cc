@@ -0,0 +1,62 @@
+//
+// ReceiveTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+
+using namespace blip_test;
+
+
+// Sends `count` requests with 10MB compressible bodies, and returns the receiver's throughput
+// in MB/sec, timed from when each request begins to arrive until it's complete. Checks that
+// each body arrives intact.
+static double receiveThroughput(bool compressed, int count) {
+    static constexpr size_t kBodySize = 10 * 1024 * 1024;
+    LoopbackPair pair;
+    alloc_slice body = replicationLikeBody(kBodySize);
+    std::atomic<int> bad {0};
+    std::atomic<double> seconds {0};
+    Stopwatch st(false);
+    pair.serverDelegate.onBeginning = [&](MessageIn*) {
+        st.reset();
+        st.start();
+    };
+    pair.serverDelegate.onRequest = [&](MessageIn *request) {
+        seconds = seconds + st.elapsed();
+        if (request->body() != body)
+            ++bad;
+        request->respond();
+    };
+
+    for (int n = 0; n < count; ++n) {
+        MessageBuilder msg("upload"_sl);
+        msg.compressed = compressed;
+        msg << body;
+        CHECK(sendAndWait(pair.client, msg) != nullptr);
+    }
+    CHECK(bad == 0);
+    return double(count) * kBodySize / (1024 * 1024) / seconds;
+}
+
+
+BLIP_TEST(receiveThroughputBenchmark) {
+    static constexpr int kCount = 5;
+    double raw = receiveThroughput(false, kCount);
+    double compressed = receiveThroughput(true, kCount);
+    logBenchmark("Receive: 10MB bodies, uncompressed", raw, "MB/sec");
+    logBenchmark("Receive: 10MB bodies, compressed", compressed, "MB/sec");
+}
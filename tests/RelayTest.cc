@@ -0,0 +1,108 @@
+//
+// RelayTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include <algorithm>
+#include <memory>
+
+using namespace blip_test;
+
+
+// A client connected to a relay, which relays every request to a backend over a second
+// connection. The backend echoes requests, so replies are relayed back the same way.
+// The backend's connection can be given latency, making it the slow link.
+struct RelayedPairs {
+    explicit RelayedPairs(actor::delay_t backendLatency = actor::delay_t::zero()) {
+        front.reset(new LoopbackPair);
+        PairOptions backOpts;
+        backOpts.latency = backendLatency;
+        back.reset(new LoopbackPair(backOpts));
+        Connection *target = back->client;
+        // Relay as soon as a request begins, and also when it's complete (since a single-frame
+        // request has no beginning notification; the second call is ignored):
+        auto relay = [this, target](MessageIn *request) {
+            front->server->relayRequest(request, target);
+        };
+        front->serverDelegate.onBeginning = relay;
+        front->serverDelegate.onRequest = relay;
+    }
+
+    ~RelayedPairs() {
+        front->close();
+        back->close();
+    }
+
+    std::unique_ptr<LoopbackPair> front, back;
+};
+
+
+// Requests of various sizes, and their replies, must pass through a relay intact.
+BLIP_TEST(relayRoundTrip) {
+    RelayedPairs relay;
+    for (size_t size : {10, 5000, 100 * 1024, 2 * 1024 * 1024 + 7}) {
+        for (bool compressed : {false, true}) {
+            alloc_slice body = replicationLikeBody(size, unsigned(size));
+            MessageBuilder msg("echo"_sl);
+            msg.addProperty("size"_sl, int64_t(size));
+            msg.compressed = compressed;
+            msg << body;
+            Retained<MessageIn> reply = sendAndWait(relay.front->client, msg);
+            CHECK(reply && !reply->isError());
+            if (reply)
+                CHECK(reply->body() == body);
+        }
+    }
+    CHECK(relay.back->serverDelegate.requestsReceived == 8);
+}
+
+
+// A slow backend link must throttle the client through the relay: the client can't get more
+// than about a RelayPipe's buffer plus an ACK window ahead of what the relay has forwarded.
+BLIP_TEST(relayBackpressure) {
+    static constexpr size_t kBodySize = 8 * 1024 * 1024;
+    // RelayPipe::kMaxBuffered + MessageOut's unacked limit, plus generous room for frames and
+    // ACKs in transit:
+    static constexpr uint64_t kMaxAhead = 1024 * 1024;
+
+    RelayedPairs relay(actor::delay_t(0.020));
+    alloc_slice body = replicationLikeBody(kBodySize);
+    MessageBuilder msg("echo"_sl);
+    msg << body;
+    Latch done;
+    Retained<MessageIn> reply;
+    msg.onProgress = [&](const MessageProgress &progress) {
+        if (progress.state >= MessageProgress::kComplete) {
+            reply = progress.reply;
+            done.countDown();
+        }
+    };
+
+    uint64_t clientBefore = relay.front->clientSocket->bytesSent;
+    uint64_t relayBefore = relay.back->clientSocket->bytesSent;
+    relay.front->client->sendRequest(msg);
+    uint64_t maxAhead = 0;
+    while (!done.wait(std::chrono::milliseconds(1))) {
+        uint64_t sent = relay.front->clientSocket->bytesSent - clientBefore;
+        uint64_t forwarded = relay.back->clientSocket->bytesSent - relayBefore;
+        if (sent > forwarded)
+            maxAhead = std::max(maxAhead, sent - forwarded);
+    }
+    CHECK(reply && !reply->isError() && reply->body() == body);
+    Log("Relay: client was at most %llu bytes ahead of the relay", (unsigned long long)maxAhead);
+    CHECK(maxAhead <= kMaxAhead);
+}
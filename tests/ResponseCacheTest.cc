@@ -0,0 +1,184 @@
+//
+// ResponseCacheTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "MessageBatch.hh"
+#include "ResponseCache.hh"
+
+using namespace blip_test;
+
+
+// A LoopbackPair whose server answers "get" requests through a ResponseCache, echoing the
+// body (or responding with an error if the request has a "fail" property), and counts how
+// many times the handler itself is called.
+struct CachedPair {
+    explicit CachedPair(ResponseCache *cache_, const PairOptions &opts = {})
+    :pair(opts)
+    ,cache(cache_)
+    {
+        pair.server->setRequestHandler("get", [this](MessageIn *request) {
+            ++handled;
+            if (request->boolProperty("fail"_sl)) {
+                request->respondWithError({"Test"_sl, 500, "failed"_sl});
+            } else {
+                MessageBuilder reply(request);
+                reply << request->body();
+                request->respond(reply);
+            }
+        }, cache);
+    }
+
+    // Sends a "get" request and checks that its reply echoes the body; returns the reply.
+    Retained<MessageIn> get(slice body, bool fail =false) {
+        MessageBuilder msg("get"_sl);
+        if (fail)
+            msg.addProperty("fail"_sl, "true"_sl);
+        msg << body;
+        Retained<MessageIn> reply = sendAndWait(pair.client, msg);
+        CHECK(reply != nullptr);
+        if (reply && !fail)
+            CHECK(!reply->isError() && reply->body() == body);
+        return reply;
+    }
+
+    LoopbackPair pair;
+    Retained<ResponseCache> cache;
+    std::atomic<int> handled {0};
+};
+
+
+// Identical requests are answered from the cache; others, error responses and expired entries
+// go to the handler.
+BLIP_TEST(responseCacheHitsAndMisses) {
+    CachedPair cp(new ResponseCache(std::chrono::milliseconds(300)));
+    cp.get("one"_sl);
+    cp.get("one"_sl);
+    cp.get("two"_sl);
+    CHECK(cp.handled == 2);
+    auto stats = cp.cache->stats();
+    CHECK(stats.hits == 1 && stats.misses == 2 && stats.count == 2);
+
+    // Errors aren't cached:
+    cp.get("bad"_sl, true);
+    cp.get("bad"_sl, true);
+    CHECK(cp.handled == 4);
+
+    // Noreply requests bypass the cache:
+    for (int n = 0; n < 2; ++n) {
+        MessageBuilder msg("get"_sl);
+        msg.noreply = true;
+        msg << "one"_sl;
+        cp.pair.client->sendRequest(msg);
+    }
+    CHECK(waitUntil([&]{return cp.handled == 6;}));
+
+    // Entries expire after the TTL:
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    cp.get("one"_sl);
+    CHECK(cp.handled == 7);
+    CHECK(cp.cache->stats().evictions >= 1);
+
+    cp.cache->clear();
+    CHECK(cp.cache->stats().count == 0 && cp.cache->stats().bytes == 0);
+}
+
+
+// The cache never exceeds maxBytes, evicting the least recently used entries first, and
+// doesn't store a response that couldn't fit at all.
+BLIP_TEST(responseCacheEviction) {
+    // Each entry holds a 1000-byte request body and its ~1000-byte echo; so two fit:
+    CachedPair cp(new ResponseCache(std::chrono::seconds(60), 5000));
+    alloc_slice a = replicationLikeBody(1000, 1), b = replicationLikeBody(1000, 2),
+                c = replicationLikeBody(1000, 3);
+    cp.get(a);
+    cp.get(b);
+    cp.get(a);              // hit; now b is least recently used
+    cp.get(c);              // evicts b
+    CHECK(cp.handled == 3);
+    cp.get(a);              // still cached
+    CHECK(cp.handled == 3);
+    cp.get(b);              // was evicted
+    CHECK(cp.handled == 4);
+    auto stats = cp.cache->stats();
+    CHECK(stats.count == 2 && stats.bytes <= 5000 && stats.evictions == 2);
+
+    alloc_slice big = replicationLikeBody(10000);
+    cp.get(big);
+    cp.get(big);
+    CHECK(cp.handled == 6);
+    CHECK(cp.cache->stats().count == 2);
+}
+
+
+// A cache whose keys always collide, so every lookup finds some other request's entry.
+class CollidingCache : public ResponseCache {
+public:
+    CollidingCache()                                    :ResponseCache(std::chrono::seconds(60)) { }
+protected:
+    virtual Key keyFor(MessageIn*) const override       {return {1, 1};}
+};
+
+
+// A request whose hash matches a different request's entry must not get its response.
+BLIP_TEST(responseCacheHashCollision) {
+    CachedPair cp(new CollidingCache);
+    cp.get("first"_sl);
+    cp.get("second"_sl);            // collides; handled, and replaces the entry
+    CHECK(cp.handled == 2);
+    cp.get("second"_sl);            // hit
+    CHECK(cp.handled == 2);
+    cp.get("first"_sl);             // collides again
+    CHECK(cp.handled == 3);
+    auto stats = cp.cache->stats();
+    CHECK(stats.hits == 1 && stats.misses == 3 && stats.count == 1);
+}
+
+
+// Requests inside a batch are cached and answered from the cache like any others, and each
+// gets its own response in the batch's response.
+BLIP_TEST(responseCacheWithBatch) {
+    PairOptions opts;
+    opts.protocol = Connection::protocolName(Connection::kBatchExtension);
+    CachedPair cp(new ResponseCache(std::chrono::seconds(60)), opts);
+
+    static const char* const kBodies[] = {"x", "y", "x", "x", "y"};
+    Latch done(5);
+    std::atomic<int> good {0};
+    MessageBatch batch;
+    for (const char *body : kBodies) {
+        MessageBuilder msg("get"_sl);
+        msg << slice(body);
+        msg.onProgress = [&, body](const MessageProgress &progress) {
+            if (progress.state < MessageProgress::kComplete)
+                return;
+            if (progress.reply && !progress.reply->isError()
+                               && progress.reply->body() == slice(body))
+                ++good;
+            done.countDown();
+        };
+        batch.add(msg);
+    }
+    cp.pair.client->sendBatch(batch);
+    CHECK(done.wait());
+    CHECK(good == 5);
+    CHECK(cp.handled == 2);
+
+    cp.get("x"_sl);                 // cached from the batch
+    CHECK(cp.handled == 2);
+    CHECK(cp.cache->stats().hits == 4);
+}
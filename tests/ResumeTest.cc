@@ -0,0 +1,111 @@
+//
+// ResumeTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "TransferStore.hh"
+
+using namespace blip_test;
+
+
+static constexpr size_t kBodySize = 8 * 1024 * 1024;
+static const char* const kTransferID = "7f3c9a52-5d1e-4c0b-9a61-2f8e4b7d1c90";
+
+
+static PairOptions resumeOptions(TransferStore *store, const char *peer) {
+    PairOptions opts;
+    opts.latency = actor::delay_t(0.010);
+    opts.beforeStart = [=](Connection*, Connection *server) {
+        server->setTransferStore(store);
+        server->setPeerIdentity(peer);
+    };
+    return opts;
+}
+
+
+static void buildUpload(MessageBuilder &msg, slice transferID, slice body) {
+    msg.addProperty("Profile"_sl, "upload"_sl);
+    msg.setTransferID(transferID);
+    msg << body;
+}
+
+
+// Starts sending a resumable request, and closes the connection partway through.
+static void interruptUpload(TransferStore *store, const char *peer, slice transferID,
+                            slice body)
+{
+    LoopbackPair pair(resumeOptions(store, peer));
+    MessageBuilder msg;
+    buildUpload(msg, transferID, body);
+    pair.client->sendRequest(msg);
+    CHECK(waitUntil([&]{return pair.clientSocket->bytesSent >= kBodySize / 4;}));
+    pair.close();
+    CHECK(pair.serverDelegate.requestsReceived == 0);
+}
+
+
+// Resumes a request on a new connection; returns the number of bytes the client sent, and
+// checks that the complete body arrived.
+static uint64_t resumeUpload(TransferStore *store, const char *peer, slice transferID,
+                             slice body)
+{
+    LoopbackPair pair(resumeOptions(store, peer));
+    uint64_t bytesBefore = pair.clientSocket->bytesSent;
+    MessageBuilder msg;
+    buildUpload(msg, transferID, body);
+    Latch done;
+    Retained<MessageIn> reply;
+    pair.client->resumeRequest(msg).wait([&](Retained<MessageIn> r) {
+        reply = r;
+        done.countDown();
+    });
+    CHECK(done.wait());
+    CHECK(reply && !reply->isError() && reply->body() == body);
+    return pair.clientSocket->bytesSent - bytesBefore;
+}
+
+
+// An interrupted request is resumed where it left off, but only by the same peer.
+BLIP_TEST(resumeInterruptedTransfer) {
+    Retained<TransferStore> store = new TransferStore();
+    alloc_slice body = replicationLikeBody(kBodySize);
+    interruptUpload(store, "alice", slice(kTransferID), body);
+    uint64_t saved = store->savedSize("alice", kTransferID);
+    CHECK(saved > 0 && saved < kBodySize);
+
+    // Another peer can't see or resume the transfer, so it has to send the whole body:
+    CHECK(store->savedSize("mallory", kTransferID) == 0);
+    uint64_t otherBytes = resumeUpload(store, "mallory", slice(kTransferID), body);
+    CHECK(otherBytes >= kBodySize);
+    CHECK(store->savedSize("alice", kTransferID) == saved);
+
+    uint64_t resumedBytes = resumeUpload(store, "alice", slice(kTransferID), body);
+    CHECK(resumedBytes <= kBodySize - saved + 4096);
+    CHECK(store->savedSize("alice", kTransferID) == 0);
+    logBenchmark("Resume: bytes sent to resume an 8MB request", double(resumedBytes), "bytes");
+}
+
+
+// Transfers with guessable (short) IDs aren't saved.
+BLIP_TEST(resumeIgnoresShortTransferIDs) {
+    Retained<TransferStore> store = new TransferStore();
+    alloc_slice body = replicationLikeBody(kBodySize);
+    interruptUpload(store, "alice", "upload-1"_sl, body);
+    CHECK(store->savedSize("alice", "upload-1") == 0);
+    uint64_t bytes = resumeUpload(store, "alice", "upload-1"_sl, body);
+    CHECK(bytes >= kBodySize);
+}
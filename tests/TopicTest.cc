@@ -0,0 +1,88 @@
+//
+// TopicTest.cc
+//
+// Copyright (c) 2017 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BLIPTestUtil.hh"
+#include "Topic.hh"
+#include <memory>
+
+using namespace blip_test;
+
+
+// Publishes notifications to 10,000 loopback subscribers, and compares that with sending
+// each subscriber its own copy with sendRequest.
+BLIP_TEST(topicFanOutBenchmark) {
+    static constexpr int kSubscribers = 10000;
+    static constexpr int kMessages = 10;
+    alloc_slice body = replicationLikeBody(2000);
+
+    std::atomic<int> received {0}, wrong {0};
+    std::vector<std::unique_ptr<LoopbackPair>> pairs;
+    for (int i = 0; i < kSubscribers; ++i) {
+        pairs.emplace_back(new LoopbackPair());
+        pairs.back()->clientDelegate.onRequest = [&](MessageIn *msg) {
+            if (msg->body() != body)
+                ++wrong;
+            ++received;
+        };
+    }
+
+    Retained<Topic> topic = new Topic("changes");
+    for (auto &pair : pairs)
+        topic->subscribe(pair->server);
+    CHECK(waitUntil([&]{return topic->subscriberCount() == kSubscribers;}));
+
+    Stopwatch st;
+    for (int n = 0; n < kMessages; ++n) {
+        MessageBuilder msg("change"_sl);
+        msg.addProperty("seq"_sl, n);
+        msg.compressed = true;
+        msg << body;
+        topic->publish(msg);
+    }
+    CHECK(waitUntil([&]{return received == kSubscribers * kMessages;},
+                    std::chrono::seconds(120)));
+    double topicTime = st.elapsed();
+    Topic::Stats stats = topic->stats();
+    CHECK(stats.published == kMessages);
+    CHECK(stats.sent == uint64_t(kSubscribers) * kMessages);     // (never more than 16 behind)
+
+    received = 0;
+    st.reset();
+    for (int n = 0; n < kMessages; ++n) {
+        for (auto &pair : pairs) {
+            MessageBuilder msg("change"_sl);
+            msg.addProperty("seq"_sl, n);
+            msg.compressed = true;
+            msg.noreply = true;
+            msg << body;
+            pair->server->sendRequest(msg);
+        }
+    }
+    CHECK(waitUntil([&]{return received == kSubscribers * kMessages;},
+                    std::chrono::seconds(120)));
+    double directTime = st.elapsed();
+    CHECK(wrong == 0);
+
+    double copies = double(kSubscribers) * kMessages;
+    logBenchmark("Topic: fan-out to 10k subscribers, Topic", copies / topicTime, "msgs/sec");
+    logBenchmark("Topic: fan-out to 10k subscribers, sendRequest", copies / directTime,
+                 "msgs/sec");
+
+    for (auto &pair : pairs)
+        pair->close();
+}